@@ -14,6 +14,7 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "material.h"
 
 
 class xy_rect : public hittable {
@@ -33,6 +34,26 @@ class xy_rect : public hittable {
             return true;
         }
 
+        virtual double pdf_value(const point3& origin, const vec3& v) const override;
+
+        virtual vec3 random(const point3& origin, double u1, double u2) const override {
+            auto random_point = point3(x0 + u1*(x1-x0), y0 + u2*(y1-y0), k);
+            return random_point - origin;
+        }
+
+        virtual double sample_surface(double u1, double u2, hit_record& rec) const override {
+            rec.p = point3(x0 + u1*(x1-x0), y0 + u2*(y1-y0), k);
+            rec.normal = vec3(0, 0, 1);
+            rec.u = u1;
+            rec.v = u2;
+            rec.mat_ptr = mp;
+            return (x1-x0)*(y1-y0);
+        }
+
+        virtual double power() const override {
+            return luminance(mp->emitted(0.5, 0.5, point3((x0+x1)/2, (y0+y1)/2, k))) * (x1-x0)*(y1-y0);
+        }
+
     public:
         shared_ptr<material> mp;
         double x0, x1, y0, y1, k;
@@ -55,6 +76,26 @@ class xz_rect : public hittable {
             return true;
         }
 
+        virtual double pdf_value(const point3& origin, const vec3& v) const override;
+
+        virtual vec3 random(const point3& origin, double u1, double u2) const override {
+            auto random_point = point3(x0 + u1*(x1-x0), k, z0 + u2*(z1-z0));
+            return random_point - origin;
+        }
+
+        virtual double sample_surface(double u1, double u2, hit_record& rec) const override {
+            rec.p = point3(x0 + u1*(x1-x0), k, z0 + u2*(z1-z0));
+            rec.normal = vec3(0, 1, 0);
+            rec.u = u1;
+            rec.v = u2;
+            rec.mat_ptr = mp;
+            return (x1-x0)*(z1-z0);
+        }
+
+        virtual double power() const override {
+            return luminance(mp->emitted(0.5, 0.5, point3((x0+x1)/2, k, (z0+z1)/2))) * (x1-x0)*(z1-z0);
+        }
+
     public:
         shared_ptr<material> mp;
         double x0, x1, z0, z1, k;
@@ -77,6 +118,26 @@ class yz_rect : public hittable {
             return true;
         }
 
+        virtual double pdf_value(const point3& origin, const vec3& v) const override;
+
+        virtual vec3 random(const point3& origin, double u1, double u2) const override {
+            auto random_point = point3(k, y0 + u1*(y1-y0), z0 + u2*(z1-z0));
+            return random_point - origin;
+        }
+
+        virtual double sample_surface(double u1, double u2, hit_record& rec) const override {
+            rec.p = point3(k, y0 + u1*(y1-y0), z0 + u2*(z1-z0));
+            rec.normal = vec3(1, 0, 0);
+            rec.u = u1;
+            rec.v = u2;
+            rec.mat_ptr = mp;
+            return (y1-y0)*(z1-z0);
+        }
+
+        virtual double power() const override {
+            return luminance(mp->emitted(0.5, 0.5, point3(k, (y0+y1)/2, (z0+z1)/2))) * (y1-y0)*(z1-z0);
+        }
+
     public:
         shared_ptr<material> mp;
         double y0, y1, z0, z1, k;
@@ -94,10 +155,13 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
     rec.u = (x-x0)/(x1-x0);
     rec.v = (y-y0)/(y1-y0);
+    rec.dpdu = vec3(x1-x0, 0, 0);
+    rec.dpdv = vec3(0, y1-y0, 0);
     rec.t = t;
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
+    rec.object_id = object_id;
     rec.p = r.at(t);
 
     return true;
@@ -115,10 +179,13 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
     rec.u = (x-x0)/(x1-x0);
     rec.v = (z-z0)/(z1-z0);
+    rec.dpdu = vec3(x1-x0, 0, 0);
+    rec.dpdv = vec3(0, 0, z1-z0);
     rec.t = t;
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
+    rec.object_id = object_id;
     rec.p = r.at(t);
 
     return true;
@@ -136,13 +203,39 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
     rec.u = (y-y0)/(y1-y0);
     rec.v = (z-z0)/(z1-z0);
+    rec.dpdu = vec3(0, y1-y0, 0);
+    rec.dpdv = vec3(0, 0, z1-z0);
     rec.t = t;
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
+    rec.object_id = object_id;
     rec.p = r.at(t);
 
     return true;
 }
 
+// 面积采样换算到立体角：pdf = distance^2 / (cos * area)
+inline double rect_pdf_value(const hittable& rect, double area, const point3& origin, const vec3& v) {
+    hit_record rec;
+    if (!rect.hit(ray(origin, v), 0.001, infinity, rec))
+        return 0;
+
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(dot(v, rec.normal) / v.length());
+    return distance_squared / (cosine * area);
+}
+
+double xy_rect::pdf_value(const point3& origin, const vec3& v) const {
+    return rect_pdf_value(*this, (x1-x0)*(y1-y0), origin, v);
+}
+
+double xz_rect::pdf_value(const point3& origin, const vec3& v) const {
+    return rect_pdf_value(*this, (x1-x0)*(z1-z0), origin, v);
+}
+
+double yz_rect::pdf_value(const point3& origin, const vec3& v) const {
+    return rect_pdf_value(*this, (y1-y0)*(z1-z0), origin, v);
+}
+
 #endif
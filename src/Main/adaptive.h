@@ -0,0 +1,149 @@
+//
+// Created by Qiuzhe on 2021/6/25.
+//
+
+#ifndef RTWEEKEND_ADAPTIVE_H
+#define RTWEEKEND_ADAPTIVE_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+
+struct pixel_statistics {
+    /******************************
+        Welford 在线算法：逐个样本更新亮度的均值与方差，数值稳定且不需要保存样本
+    ******************************/
+    int n = 0;
+    double mean = 0;
+    double m2 = 0;
+
+    void add(double x) {
+        if (x != x)
+            x = 0; // NaN 样本按 0 处理，与 gamma_correct 一致
+        n += 1;
+        auto delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    double variance() const {
+        return n > 1 ? m2 / (n - 1) : 0;
+    }
+
+    // 均值的标准误差换算到显示空间(gamma 2.0，即开方)后的大小
+    double error() const {
+        if (n < 2)
+            return infinity;
+        auto standard_error = sqrt(variance() / n);
+        return standard_error / (2 * sqrt(fmax(mean, 0.0)) + 1e-4);
+    }
+};
+
+
+class adaptive_sampling {
+    /******************************
+        自适应采样：图像划分为 tile_size x tile_size 的块，按轮次采样。
+        第一轮每个像素采 min_spp 个样本，之后每轮把未收敛块内像素的样本数翻倍，
+        块内所有像素在显示空间的误差都低于 threshold，或样本数达到 max_spp 时，该块停止采样。
+    ******************************/
+    public:
+        // 第一轮的默认样本数：估计方差所需的最少样本，超过 max_spp 时取 max_spp
+        static const int default_min_spp = 16;
+
+        adaptive_sampling(int width, int height, double threshold, int min_spp, int max_spp, int tile_size = 8)
+            : image_width(width), image_height(height), threshold(threshold),
+              min_spp(std::min(min_spp, max_spp)), max_spp(max_spp), tile_size(tile_size),
+              tiles_x((width + tile_size - 1) / tile_size), tiles_y((height + tile_size - 1) / tile_size),
+              statistics(width * height), active(tiles_x * tiles_y, true) {}
+
+        // 像素 (i, j) (j 从图像底部开始计) 本轮是否需要采样
+        bool pixel_active(int i, int j) const {
+            return active[tile_index(i, j)];
+        }
+
+        // 本轮每个活动像素需要的样本数
+        int round_samples(int done) const {
+            return done == 0 ? min_spp : std::min(done, max_spp - done);
+        }
+
+        void add(int index, const color& sample) {
+            statistics[index].add(luminance(sample));
+        }
+
+        // 一轮结束后更新每个块的状态，返回仍在采样的块数
+        int update(int done) {
+            int count = 0;
+            for (int t = 0; t < tiles_x * tiles_y; ++t) {
+                if (!active[t])
+                    continue;
+                active[t] = done < max_spp && tile_error(t) > threshold;
+                count += active[t];
+            }
+            return count;
+        }
+
+        int tile_count() const {
+            return tiles_x * tiles_y;
+        }
+
+        // 输出每个像素的样本数分布，以及相对所有像素都采 max_spp 节省的时间(按样本数估计)
+        void report(const std::vector<int>& sample_count, double elapsed) const {
+            std::vector<long> histogram;
+            long total = 0;
+            for (auto n : sample_count) {
+                int bucket = 0;
+                while ((1 << (bucket + 1)) <= n)
+                    ++bucket;
+                if (histogram.size() <= static_cast<size_t>(bucket))
+                    histogram.resize(bucket + 1, 0);
+                histogram[bucket] += 1;
+                total += n;
+            }
+
+            printf("%10s %10s %8s\n", "spp", "pixels", "percent");
+            for (size_t b = 0; b < histogram.size(); ++b) {
+                if (histogram[b] == 0)
+                    continue;
+                printf("%4d-%-5d %10ld %7.2f%%\n", 1 << b, (1 << (b + 1)) - 1, histogram[b],
+                       100.0 * histogram[b] / sample_count.size());
+            }
+
+            auto uniform = static_cast<double>(max_spp) * sample_count.size();
+            auto average = static_cast<double>(total) / sample_count.size();
+            printf("Average spp : %.2f / %d\n", average, max_spp);
+            printf("Time saved (estimated) : %.2fs of %.2fs\n", elapsed * (uniform / total - 1), elapsed * uniform / total);
+        }
+
+    private:
+        int tile_index(int i, int j) const {
+            int row = image_height - j - 1;
+            return (row / tile_size) * tiles_x + i / tile_size;
+        }
+
+        double tile_error(int t) const {
+            int x0 = (t % tiles_x) * tile_size;
+            int y0 = (t / tiles_x) * tile_size;
+            double error = 0;
+            for (int y = y0; y < std::min(y0 + tile_size, image_height); ++y)
+                for (int x = x0; x < std::min(x0 + tile_size, image_width); ++x)
+                    error = fmax(error, statistics[y * image_width + x].error());
+            return error;
+        }
+
+    private:
+        int image_width;
+        int image_height;
+        double threshold;
+        int min_spp;
+        int max_spp;
+        int tile_size;
+        int tiles_x;
+        int tiles_y;
+        std::vector<pixel_statistics> statistics;
+        std::vector<bool> active;
+};
+
+#endif //RTWEEKEND_ADAPTIVE_H
@@ -0,0 +1,161 @@
+//
+// Created by Qiuzhe on 2021/6/28.
+//
+
+#ifndef RTWEEKEND_AOV_H
+#define RTWEEKEND_AOV_H
+
+#include "rtweekend.h"
+
+#include "integrator.h"
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+enum aov_type {
+    aov_beauty,
+    aov_depth,
+    aov_normal,
+    aov_albedo,
+    aov_material,
+    aov_object,
+    aov_direct,
+    aov_indirect,
+    aov_samples,
+    aov_count
+};
+
+// AOV 的名称，同时用于命令行参数与输出文件名
+static const char* const aov_names[aov_count] = {
+    "beauty", "depth", "normal", "albedo", "material", "object", "direct", "indirect", "samples"
+};
+
+
+class aov_buffers {
+    /******************************
+        任意输出变量(AOV)：与最终图像在同一遍渲染中填充，只为请求的变量分配缓冲。
+        normal/albedo/direct/indirect 对像素内所有样本取平均；depth/material/object 取像素第 0 个样本，
+        编号不能平均；samples 为每个像素的样本数。输出为 PFM 格式的 32 位浮点图像
+    ******************************/
+    public:
+        aov_buffers(int width, int height) : width(width), height(height) {}
+
+        // 按逗号分隔的名称列表开启输出，"all" 表示全部；遇到未知名称时返回 false
+        bool request(const std::string& names) {
+            std::stringstream stream(names);
+            std::string name;
+            while (std::getline(stream, name, ',')) {
+                if (name == "all") {
+                    for (int t = 0; t < aov_count; ++t)
+                        enable(static_cast<aov_type>(t), true);
+                    continue;
+                }
+                int t = 0;
+                while (t < aov_count && name != aov_names[t])
+                    ++t;
+                if (t == aov_count)
+                    return false;
+                enable(static_cast<aov_type>(t), true);
+            }
+            return true;
+        }
+
+        // 分配 t 的缓冲；output 为 false 时只在渲染内部使用(如降噪特征)，不写出文件
+        void enable(aov_type t, bool output) {
+            if (t != aov_beauty && t != aov_samples && buffers[t].empty())
+                buffers[t].resize(width * height, vec3(0, 0, 0));
+            written[t] = written[t] || output;
+        }
+
+        // t 是否在渲染时累积(beauty 与 samples 直接取自 framebuffer 与样本数，不需要缓冲)
+        bool enabled(aov_type t) const {
+            return !buffers[t].empty();
+        }
+
+        // 是否需要路径的附加输出
+        bool needs_features() const {
+            for (int t = 0; t < aov_count; ++t)
+                if (enabled(static_cast<aov_type>(t)))
+                    return true;
+            return false;
+        }
+
+        // 累积像素 index 的第 sample_index 个样本
+        void add(int index, int sample_index, const color& radiance, const path_features& f) {
+            if (enabled(aov_normal))
+                buffers[aov_normal][index] += f.normal;
+            if (enabled(aov_albedo))
+                buffers[aov_albedo][index] += f.albedo;
+            if (enabled(aov_direct))
+                buffers[aov_direct][index] += f.direct;
+            if (enabled(aov_indirect))
+                buffers[aov_indirect][index] += radiance - f.direct;
+            if (sample_index == 0) {
+                if (enabled(aov_depth))
+                    buffers[aov_depth][index] = vec3(f.depth, f.depth, f.depth);
+                if (enabled(aov_material))
+                    buffers[aov_material][index] = vec3(f.material_id, f.material_id, f.material_id);
+                if (enabled(aov_object))
+                    buffers[aov_object][index] = vec3(f.object_id, f.object_id, f.object_id);
+            }
+        }
+
+        // 像素 index 上 t 的平均值
+        vec3 average(aov_type t, int index, int sample_count) const {
+            return sample_count > 0 ? buffers[t][index] / sample_count : vec3(0, 0, 0);
+        }
+
+        // 把请求的 AOV 写为 prefix_<name>.pfm，framebuffer 与 sample_count 提供 beauty 与 samples
+        void write(const std::string& prefix, const std::vector<color>& framebuffer,
+                   const std::vector<int>& sample_count) const {
+            for (int t = 0; t < aov_count; ++t) {
+                if (!written[t])
+                    continue;
+                auto type = static_cast<aov_type>(t);
+                bool gray = type == aov_depth || type == aov_material || type == aov_object || type == aov_samples;
+                std::vector<float> pixels(width * height * (gray ? 1 : 3));
+                for (int i = 0; i < width * height; ++i) {
+                    vec3 value;
+                    if (type == aov_beauty)
+                        value = sample_count[i] > 0 ? framebuffer[i] / sample_count[i] : color(0, 0, 0);
+                    else if (type == aov_samples)
+                        value = vec3(sample_count[i], 0, 0);
+                    else if (type == aov_depth || type == aov_material || type == aov_object)
+                        value = buffers[t][i];
+                    else
+                        value = average(type, i, sample_count[i]);
+                    for (int k = 0; k < (gray ? 1 : 3); ++k)
+                        pixels[i * (gray ? 1 : 3) + k] = static_cast<float>(value[k]);
+                }
+                auto path = prefix + "_" + aov_names[t] + ".pfm";
+                if (!write_pfm(path, pixels, gray))
+                    fprintf(stderr, "Failed to write '%s'\n", path.c_str());
+                else
+                    printf("AOV : %s\n", path.c_str());
+            }
+        }
+
+    private:
+        // PFM：文本头 + 小端序 float，行从图像底部开始存储
+        bool write_pfm(const std::string& path, const std::vector<float>& pixels, bool gray) const {
+            FILE* file = fopen(path.c_str(), "wb");
+            if (!file)
+                return false;
+            int channels = gray ? 1 : 3;
+            fprintf(file, "%s\n%d %d\n-1.0\n", gray ? "Pf" : "PF", width, height);
+            for (int row = height - 1; row >= 0; --row)
+                fwrite(&pixels[row * width * channels], sizeof(float), width * channels, file);
+            return fclose(file) == 0;
+        }
+
+    private:
+        int width;
+        int height;
+        std::vector<vec3> buffers[aov_count];
+        bool written[aov_count] = {};
+};
+
+#endif //RTWEEKEND_AOV_H
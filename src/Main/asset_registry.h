@@ -0,0 +1,128 @@
+//
+// Created by Qiuzhe on 2021/7/7.
+//
+
+#ifndef RTWEEKEND_ASSET_REGISTRY_H
+#define RTWEEKEND_ASSET_REGISTRY_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "mesh_triangle.h"
+#include "texture.h"
+
+#include <climits>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+
+class asset_registry {
+    /******************************
+        场景使用的图片贴图与模型的登记表，以规范化的路径(realpath)加读入参数为键：
+        贴图的参数为 srgb，同一个键第二次请求时共享同一份页缓存中的数据。
+        模型分两级：OBJ 的顶点只按路径缓存，同一文件无论材质与缩放只解析一次；
+        缩放与材质在建立三角面时就已写入每个三角面，三角面与 BVH 按(路径, 材质, 缩放)缓存，只为每次摆放新建旋转、平移的包装。
+        场景函数通常为每次摆放新建材质，此时只共享顶点。
+        只有场景函数实际请求的文件才会被读入，统计中记录重复请求省下的字节数
+    ******************************/
+    public:
+        struct statistics {
+            int texture_requests = 0, textures = 0;
+            int mesh_requests = 0, meshes = 0; // meshes 为解析的 OBJ 文件数
+            int mesh_builds = 0;               // 建立三角面与 BVH 的次数
+            size_t bytes_saved = 0; // 重复请求若各自读入需要多占用的字节数(贴图按全部层级，模型按顶点、三角面与 BVH 节点估计)
+        };
+
+        // 场景构建使用的登记表
+        static asset_registry& global() {
+            static asset_registry registry;
+            return registry;
+        }
+
+        shared_ptr<image_texture> texture(const std::string& filename, bool srgb = false) {
+            counters.texture_requests += 1;
+            auto& entry = textures[std::make_tuple(canonical(filename), srgb)];
+            if (entry) {
+                counters.bytes_saved += entry->memory();
+                return entry;
+            }
+            counters.textures += 1;
+            entry = make_shared<image_texture>(filename.c_str(), srgb);
+            return entry;
+        }
+
+        // 与 read_obj_model_triangle 相同；同一文件只解析一次，同一文件、材质与缩放只建立一次三角面与 BVH
+        shared_ptr<hittable> mesh(const std::string& filename, shared_ptr<material> m, vec3 trans, vec3 rotation,
+                                  vec3 scale, hittable_list* lights = nullptr) {
+            counters.mesh_requests += 1;
+            auto path = canonical(filename);
+            auto& entry = meshes[std::make_tuple(path, m.get(), scale.x(), scale.y(), scale.z())];
+            if (entry.bvh) {
+                counters.bytes_saved += entry.triangles.objects.size() * (sizeof(triangle) + sizeof(bvh_node));
+                counters.bytes_saved += entry.triangles.objects.size() * 3 * sizeof(objl::Vertex);
+            } else {
+                const auto& parsed = obj_vertices(filename, path);
+                counters.mesh_builds += 1;
+                entry.triangles = make_mesh_triangles(*parsed, m, scale);
+                entry.bvh = make_shared<bvh_node>(entry.triangles, 0.0, 1.0);
+                entry.mat = m;
+            }
+            return place_mesh(entry.bvh, entry.triangles, trans, rotation, lights);
+        }
+
+        const statistics& stats() const {
+            return counters;
+        }
+
+    private:
+        struct mesh_entry {
+            shared_ptr<hittable> bvh;
+            hittable_list triangles;
+            shared_ptr<material> mat; // 保持材质存活，键中的指针不会被其它材质重用
+        };
+
+        asset_registry() = default;
+
+        // path 为 filename 规范化后的路径，第一次请求时解析文件
+        const shared_ptr<const std::vector<objl::Vertex>>& obj_vertices(const std::string& filename,
+                                                                        const std::string& path) {
+            auto& entry = vertices[path];
+            if (entry) {
+                counters.bytes_saved += entry->size() * sizeof(objl::Vertex);
+                return entry;
+            }
+            counters.meshes += 1;
+            entry = make_shared<const std::vector<objl::Vertex>>(read_obj_vertices(filename));
+            std::cout << "model size: " << entry->size() / 3 << std::endl;
+            return entry;
+        }
+
+        // 同一文件的不同写法(相对路径、..、符号链接)得到相同的键，文件不存在时保留原路径
+        static std::string canonical(const std::string& filename) {
+            char resolved[PATH_MAX];
+            return realpath(filename.c_str(), resolved) ? std::string(resolved) : filename;
+        }
+
+    private:
+        std::map<std::tuple<std::string, bool>, shared_ptr<image_texture>> textures;
+        std::map<std::string, shared_ptr<const std::vector<objl::Vertex>>> vertices;
+        std::map<std::tuple<std::string, const material*, double, double, double>, mesh_entry> meshes;
+        statistics counters;
+};
+
+// 场景函数通过以下两个函数读入贴图与模型
+shared_ptr<image_texture> load_texture(const std::string& filename, bool srgb = false) {
+    return asset_registry::global().texture(filename, srgb);
+}
+
+shared_ptr<hittable> load_mesh(const std::string& filename, shared_ptr<material> m, vec3 trans, vec3 rotation, vec3 scale,
+                               hittable_list* lights = nullptr) {
+    return asset_registry::global().mesh(filename, m, trans, rotation, scale, lights);
+}
+
+#endif //RTWEEKEND_ASSET_REGISTRY_H
@@ -0,0 +1,466 @@
+//
+// Created by Qiuzhe on 2021/7/1.
+//
+
+#ifndef RTWEEKEND_BDPT_H
+#define RTWEEKEND_BDPT_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "environment.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "sampler.h"
+
+#include <atomic>
+#include <vector>
+
+
+class splat_framebuffer {
+    /******************************
+        可以被多个线程同时累加的帧缓冲：光源一侧的路径可以连接到任意像素，
+        每个分量为原子变量，用比较交换实现加法
+    ******************************/
+    public:
+        splat_framebuffer(int pixel_count) : values(3 * pixel_count) {
+            clear();
+        }
+
+        void add(int index, const color& c) {
+            for (int k = 0; k < 3; ++k)
+                atomic_add(values[3 * index + k], c[k]);
+        }
+
+        color get(int index) const {
+            return color(values[3 * index].load(std::memory_order_relaxed),
+                         values[3 * index + 1].load(std::memory_order_relaxed),
+                         values[3 * index + 2].load(std::memory_order_relaxed));
+        }
+
+        void clear() {
+            for (auto& v : values)
+                v.store(0.0, std::memory_order_relaxed);
+        }
+
+    private:
+        static void atomic_add(std::atomic<double>& a, double x) {
+            auto old = a.load(std::memory_order_relaxed);
+            while (!a.compare_exchange_weak(old, old + x, std::memory_order_relaxed))
+                ;
+        }
+
+    private:
+        std::vector<std::atomic<double>> values;
+};
+
+
+// 子路径上的一个顶点
+struct bdpt_vertex {
+    enum vertex_type { camera_vertex, light_vertex, surface_vertex };
+
+    vertex_type type = surface_vertex;
+    hit_record rec;  // 位置、法线(朝向到达该点的光线一侧)与材质；相机顶点的法线为相机朝向
+    ray r_in;        // 到达该顶点的光线，用于 BSDF 的 eval 与 pdf
+    color beta;      // 子路径到该顶点的累计贡献除以 pdf
+    bool delta = false; // 镜面顶点，不能参与连接
+    double pdf_fwd = 0; // 沿子路径的生成方向采样到该顶点的概率密度(面积)
+    double pdf_rev = 0; // 从另一端反向采样到该顶点的概率密度(面积)
+};
+
+
+class bdpt {
+    /******************************
+        双向路径追踪：每个像素样本从相机与光源各生成一条子路径，把相机子路径的前 t 个顶点与光源子路径的前 s 个顶点
+        两两连接，得到长度相同的路径的多种采样方法，用 power heuristic 的 MIS 权重组合：
+        s = 0 为相机子路径直接命中光源，s = 1 为光源采样，t = 1 为把光源子路径的顶点投影到相机(光线追踪)，
+        其贡献落在任意像素上，写入可并发累加的 splat 缓冲，每遍结束后合并到帧缓冲。
+        MIS 权重按 PBRT 的方法由各顶点的正向/反向面积 pdf 之比递推得到。
+        光源子路径只从光源列表(按功率选择、面积采样)发出；环境光只由相机子路径计算，
+        在非镜面顶点上做环境光采样，与 BSDF 采样射向天空的贡献按 MIS 组合。只支持针孔相机
+    ******************************/
+    public:
+        bdpt(int width, int height) : width(width), height(height), splats(width * height) {}
+
+        // 为每个像素追加第 [first, first + count) 个样本，结果累加到 framebuffer 与 sample_count
+        void render(const camera& cam, const environment& env, const hittable& world, const light_bvh& lights,
+                    int max_depth, const sampler& prototype, int first, int count,
+                    std::vector<color>& framebuffer, std::vector<int>& sample_count) {
+            // 整幅图像在单位距离处覆盖的面积：像素 i 覆盖 s ∈ [i, i+1)/(width-1)
+            active_camera = &cam;
+            image_area = cam.film_area() * (static_cast<double>(width) / (width - 1)) *
+                         (static_cast<double>(height) / (height - 1));
+            for (int pass = first; pass < first + count; ++pass) {
+#pragma omp parallel num_threads(6)
+                {
+                    auto smp = prototype.clone();
+                    std::vector<bdpt_vertex> camera_path, light_path;
+                    camera_path.reserve(max_depth + 2);
+                    light_path.reserve(max_depth + 2);
+#pragma omp for collapse(2) schedule(dynamic, 8)
+                    for (int j = height - 1; j >= 0; j--) {
+                        for (int i = 0; i < width; ++i) {
+                            auto index = (height - j - 1) * width + i;
+                            framebuffer[index] += trace_sample(cam, env, world, lights, max_depth, *smp, i, j, pass,
+                                                               camera_path, light_path);
+                            sample_count[index] += 1;
+                        }
+                    }
+                }
+
+                for (int i = 0; i < width * height; ++i)
+                    framebuffer[i] += splats.get(i);
+                splats.clear();
+            }
+        }
+
+    private:
+        color trace_sample(const camera& cam, const environment& env, const hittable& world, const light_bvh& lights,
+                           int max_depth, sampler& smp, int i, int j, int pass,
+                           std::vector<bdpt_vertex>& camera_path, std::vector<bdpt_vertex>& light_path) {
+            smp.start_pixel_sample(i, j, pass);
+            auto jitter = smp.get_2d();
+            ray r = cam.get_ray((i + jitter.x()) / (width - 1), (j + jitter.y()) / (height - 1), smp);
+
+            // 相机子路径，同时计算环境光
+            color radiance(0, 0, 0);
+            camera_path.clear();
+            bdpt_vertex camera{};
+            camera.type = bdpt_vertex::camera_vertex;
+            camera.rec.p = cam.position();
+            camera.rec.normal = cam.forward();
+            camera.beta = color(1, 1, 1);
+            camera_path.push_back(camera);
+            radiance += random_walk(r, color(1, 1, 1), camera_pdf(cam, r.direction()), max_depth + 2, true, env, world,
+                                    smp, camera_path);
+
+            // 光源子路径
+            light_path.clear();
+            hit_record rec;
+            vec3 direction;
+            double pdf_area, pdf_direction;
+            auto u = smp.get_1d();
+            auto xi_position = smp.get_2d();
+            auto xi_direction = smp.get_2d();
+            if (lights.sample_emission(u, xi_position, xi_direction, rec, direction, pdf_area, pdf_direction)) {
+                bdpt_vertex light;
+                light.type = bdpt_vertex::light_vertex;
+                light.rec = rec;
+                light.beta = rec.mat_ptr->emitted(rec.u, rec.v, rec.p) / pdf_area;
+                light.pdf_fwd = pdf_area;
+                light_path.push_back(light);
+                auto beta = light.beta * (fabs(dot(rec.normal, direction)) / pdf_direction);
+                random_walk(ray(rec.p, direction, r.time()), beta, pdf_direction, max_depth + 1, false, env, world, smp,
+                            light_path);
+            }
+
+            // 连接所有 (s, t) 组合，s + t - 2 为路径的弹射次数
+            for (int t = 1; t <= static_cast<int>(camera_path.size()); ++t) {
+                for (int s = 0; s <= static_cast<int>(light_path.size()); ++s) {
+                    int depth = s + t - 2;
+                    if ((s == 1 && t == 1) || depth < 0 || depth > max_depth)
+                        continue;
+                    if (t == 1) {
+                        splat(cam, world, lights, light_path, camera_path, s);
+                        continue;
+                    }
+                    radiance += connect(world, lights, light_path, camera_path, s, t);
+                }
+            }
+            return radiance;
+        }
+
+        // 从 path 的最后一个顶点出发沿 r 延伸子路径，直到 max_vertices 个顶点；
+        // 相机子路径(from_camera)的返回值为环境光的贡献
+        color random_walk(ray r, color beta, double pdf_dir, int max_vertices, bool from_camera,
+                          const environment& env, const hittable& world, sampler& smp,
+                          std::vector<bdpt_vertex>& path) const {
+            color radiance(0, 0, 0);
+            for (int depth = 0; static_cast<int>(path.size()) < max_vertices; ++depth) {
+                hit_record rec;
+                if (!world.hit(r, 0.001, infinity, rec)) {
+                    if (from_camera) {
+                        auto background = env.value(r);
+                        const auto& prev = path.back();
+                        if (prev.type == bdpt_vertex::surface_vertex && !prev.delta && env.importance_sampled())
+                            background *= power_heuristic(pdf_dir, env.pdf(r.direction()));
+                        radiance += beta * background;
+                    }
+                    break;
+                }
+
+                bdpt_vertex vertex;
+                vertex.rec = rec;
+                vertex.r_in = r;
+                vertex.beta = beta;
+                vertex.pdf_fwd = to_area(pdf_dir, path.back().rec.p, vertex);
+                path.push_back(vertex);
+                if (static_cast<int>(path.size()) >= max_vertices)
+                    break;
+
+                ray scattered;
+                color attenuation;
+                if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered, smp))
+                    break;
+                pdf_dir = rec.mat_ptr->pdf(r, rec, scattered.direction());
+
+                auto& current = path.back();
+                auto& prev = path[path.size() - 2];
+                if (pdf_dir > 0) {
+                    if (from_camera && env.importance_sampled())
+                        radiance += beta * sample_environment(r, rec, env, world, smp);
+                    // 反向：从下一个顶点射来时采样到上一个顶点的概率
+                    auto pdf_rev = rec.mat_ptr->pdf(ray(scattered.at(1), -scattered.direction(), r.time()), rec,
+                                                    -r.direction());
+                    prev.pdf_rev = to_area(pdf_rev, rec.p, prev);
+                } else {
+                    current.delta = true;
+                    prev.pdf_rev = 0;
+                }
+
+                // 光源子路径上按重要性传输：BSDF 的入射与出射方向互换，非对称的 BRDF 贴图也能得到正确的权重
+                if (!from_camera)
+                    attenuation = pdf_dir > 0 ? eval_importance(rec, r, scattered.direction()) / pdf_dir
+                                              : attenuation * shading_correction(rec, r, scattered.direction());
+                beta = beta * attenuation;
+                if (depth + 1 >= russian_roulette_depth) {
+                    auto survive = fmin(max_component(beta) / russian_roulette_threshold, 1.0);
+                    if (smp.get_1d() >= survive)
+                        break;
+                    beta /= survive;
+                }
+                r = scattered;
+            }
+            return radiance;
+        }
+
+        // 相机子路径上的环境光采样，与 BSDF 采样射向天空的贡献按 MIS 组合
+        color sample_environment(const ray& r, const hit_record& rec, const environment& env, const hittable& world,
+                                 sampler& smp) const {
+            auto u = smp.get_1d();
+            auto xi = smp.get_2d();
+            auto direction = env.sample(u, xi.x(), xi.y());
+            auto pdf = env.pdf(direction);
+            if (pdf <= 0)
+                return color(0, 0, 0);
+            auto f = rec.mat_ptr->eval(r, rec, direction);
+            if (max_component(f) <= 0)
+                return color(0, 0, 0);
+            ray shadow(rec.p, direction, r.time());
+            hit_record blocker;
+            if (world.hit(shadow, 0.001, infinity, blocker))
+                return color(0, 0, 0);
+            return f * env.value(shadow) * (power_heuristic(pdf, rec.mat_ptr->pdf(r, rec, direction)) / pdf);
+        }
+
+        // s >= 0, t >= 2 的连接，返回相机子路径所在像素的贡献
+        color connect(const hittable& world, const light_bvh& lights, std::vector<bdpt_vertex>& light_path,
+                      std::vector<bdpt_vertex>& camera_path, int s, int t) const {
+            auto& pt = camera_path[t - 1];
+            color contribution;
+            if (s == 0) {
+                // 相机子路径命中光源
+                if (!pt.rec.mat_ptr->emissive())
+                    return color(0, 0, 0);
+                contribution = pt.beta * pt.rec.mat_ptr->emitted(pt.rec.u, pt.rec.v, pt.rec.p);
+            } else {
+                auto& qs = light_path[s - 1];
+                if (pt.delta || qs.delta)
+                    return color(0, 0, 0);
+                vec3 d = qs.rec.p - pt.rec.p;
+                auto distance_squared = d.length_squared();
+                auto f_camera = pt.rec.mat_ptr->eval(pt.r_in, pt.rec, d);
+                auto f_light = s == 1 ? color(1, 1, 1) * fabs(dot(qs.rec.normal, unit_vector(d)))
+                                      : eval_importance(qs.rec, qs.r_in, -unit_vector(d));
+                contribution = pt.beta * f_camera * f_light * qs.beta / distance_squared;
+                if (max_component(contribution) <= 0 || !visible(world, pt.rec.p, qs.rec.p))
+                    return color(0, 0, 0);
+            }
+            if (max_component(contribution) <= 0)
+                return color(0, 0, 0);
+            return contribution * mis_weight(lights, light_path, camera_path, s, t);
+        }
+
+        // t = 1：光源子路径的第 s 个顶点直接连接相机，贡献累加到它投影到的像素
+        void splat(const camera& cam, const hittable& world, const light_bvh& lights,
+                   std::vector<bdpt_vertex>& light_path, std::vector<bdpt_vertex>& camera_path, int s) {
+            auto& qs = light_path[s - 1];
+            if (qs.delta)
+                return;
+            double u, v;
+            if (!cam.project(qs.rec.p, u, v))
+                return;
+            int i = static_cast<int>(floor(u * (width - 1)));
+            int j = static_cast<int>(floor(v * (height - 1)));
+            if (i < 0 || i >= width || j < 0 || j >= height)
+                return;
+
+            vec3 d = cam.position() - qs.rec.p;
+            // 与路径追踪中相机光线的方向长度一致，BRDF 贴图的查询依赖于入射方向的长度
+            auto f = eval_importance(qs.rec, qs.r_in, -cam.ray_direction(qs.rec.p));
+            // 相机的重要性函数：整幅图像上均匀采样的方向概率密度 1/(面积 * cos^3)，每个像素的样本数按一遍计
+            auto contribution = qs.beta * f * (camera_pdf(cam, -d) / d.length_squared());
+            if (max_component(contribution) <= 0 || !visible(world, cam.position(), qs.rec.p))
+                return;
+            splats.add((height - j - 1) * width + i, contribution * mis_weight(lights, light_path, camera_path, s, 1));
+        }
+
+        // 光源子路径的顶点 rec 上，光沿 r_in 射来、向 direction 散射时的 BSDF * cos。
+        // eval 按相机一侧的约定调用：光线从 direction 射来，法线朝向光线一侧，参数为指向光源的方向，得到 f * |cos(to_light, Ns)|；
+        // 重要性传输时再乘以 |cos(direction, Ng)| / |cos(to_light, Ng)|，插值法线的三角形上才与路径追踪一致
+        static color eval_importance(const hit_record& rec, const ray& r_in, const vec3& direction) {
+            auto to_light = -unit_vector(r_in.direction());
+            auto cos_light = fabs(dot(rec.geometric_normal, to_light));
+            if (cos_light <= 0)
+                return color(0, 0, 0);
+            ray camera_ray(rec.p + direction, -direction, r_in.time());
+            color f;
+            if (dot(rec.normal, direction) < 0) {
+                auto flipped = rec;
+                flipped.normal = -rec.normal;
+                flipped.geometric_normal = -rec.geometric_normal;
+                flipped.front_face = !rec.front_face;
+                f = rec.mat_ptr->eval(camera_ray, flipped, to_light);
+            } else {
+                f = rec.mat_ptr->eval(camera_ray, rec, to_light);
+            }
+            return f * (fabs(dot(rec.geometric_normal, unit_vector(direction))) / cos_light);
+        }
+
+        // 镜面散射的衰减在重要性传输时的修正因子，含义同上
+        static double shading_correction(const hit_record& rec, const ray& r_in, const vec3& direction) {
+            auto to_light = -unit_vector(r_in.direction());
+            auto w = unit_vector(direction);
+            auto denominator = fabs(dot(rec.geometric_normal, to_light)) * fabs(dot(rec.normal, w));
+            if (denominator <= 0)
+                return 0;
+            return fabs(dot(rec.normal, to_light)) * fabs(dot(rec.geometric_normal, w)) / denominator;
+        }
+
+        // 从 a 射向 b 的光线是否恰好命中 b。三角形是单面的，方向与路径追踪一致(从相机一侧射向光源一侧)
+        static bool visible(const hittable& world, const point3& a, const point3& b) {
+            hit_record rec;
+            ray r(a, b - a);
+            // 与路径追踪相同，起点附近跳过 0.001 的距离(方向未归一化，换算为参数 t)
+            auto t_min = 0.001 / (b - a).length();
+            return world.hit(r, t_min, infinity, rec) && fabs(rec.t - 1) < 1e-4;
+        }
+
+        // 相机在方向 direction 上的概率密度(立体角)，方向不在图像范围内时为 0
+        double camera_pdf(const camera& cam, const vec3& direction) const {
+            auto cosine = dot(unit_vector(direction), cam.forward());
+            if (cosine <= 0)
+                return 0;
+            double u, v;
+            if (!cam.project(cam.position() + direction, u, v) || u < 0 || u * (width - 1) >= width ||
+                v < 0 || v * (height - 1) >= height)
+                return 0;
+            return 1 / (image_area * cosine * cosine * cosine);
+        }
+
+        // 在 from 处的立体角概率密度换算到顶点 to 处的面积概率密度
+        static double to_area(double pdf_dir, const point3& from, const bdpt_vertex& to) {
+            vec3 d = to.rec.p - from;
+            auto distance_squared = d.length_squared();
+            if (distance_squared <= 0)
+                return 0;
+            if (to.type == bdpt_vertex::camera_vertex)
+                return pdf_dir / distance_squared;
+            return pdf_dir * fabs(dot(to.rec.normal, d)) / (distance_squared * sqrt(distance_squared));
+        }
+
+        // 由顶点 v 采样到顶点 next 的面积概率密度，prev 为到达 v 之前的顶点
+        double pdf(const bdpt_vertex& v, const bdpt_vertex* prev, const bdpt_vertex& next) const {
+            vec3 d = next.rec.p - v.rec.p;
+            double pdf_dir;
+            if (v.type == bdpt_vertex::camera_vertex)
+                pdf_dir = camera_pdf(*active_camera, d);
+            else if (v.type == bdpt_vertex::light_vertex)
+                pdf_dir = light_bvh::emission_direction_pdf(v.rec.normal, d);
+            else
+                pdf_dir = v.rec.mat_ptr->pdf(ray(prev->rec.p, v.rec.p - prev->rec.p), v.rec, d);
+            return to_area(pdf_dir, v.rec.p, next);
+        }
+
+        // 连接 (s, t) 的 MIS 权重：把连接处的顶点看作由另一端采样得到，临时改写其反向 pdf，
+        // 沿两条子路径递推其他采样方法与当前方法的 pdf 之比，power heuristic 下为比值的平方之和
+        double mis_weight(const light_bvh& lights, std::vector<bdpt_vertex>& light_path,
+                          std::vector<bdpt_vertex>& camera_path, int s, int t) const {
+            if (s + t == 2)
+                return 1;
+            auto& pt = camera_path[t - 1];
+            // 命中不在光源列表中的发光物体：其它连接方式都采样不到这一点，只有这一种方法，权重为 1
+            if (s == 0 && !lights.emits(pt.rec.mat_ptr.get()))
+                return 1;
+            auto* qs = s > 0 ? &light_path[s - 1] : nullptr;
+            auto* pt_minus = t > 1 ? &camera_path[t - 2] : nullptr;
+            auto* qs_minus = s > 1 ? &light_path[s - 2] : nullptr;
+
+            // 保存被改写的值，计算结束后恢复
+            double pt_rev = pt.pdf_rev;
+            double pt_minus_rev = pt_minus ? pt_minus->pdf_rev : 0;
+            double qs_rev = qs ? qs->pdf_rev : 0;
+            double qs_minus_rev = qs_minus ? qs_minus->pdf_rev : 0;
+            bool pt_delta = pt.delta;
+            bool qs_delta = qs ? qs->delta : false;
+
+            pt.delta = false;
+            if (qs)
+                qs->delta = false;
+            if (s > 0) {
+                pt.pdf_rev = pdf(*qs, qs_minus, pt);
+                if (pt_minus)
+                    pt_minus->pdf_rev = pdf(pt, qs, *pt_minus);
+                qs->pdf_rev = pdf(pt, pt_minus, *qs);
+                if (qs_minus)
+                    qs_minus->pdf_rev = pdf(*qs, &pt, *qs_minus);
+            } else {
+                // 相机子路径命中光源：该点作为光源子路径的起点
+                pt.pdf_rev = lights.emission_pdf(pt.rec.mat_ptr.get(),
+                                                 pt.rec.mat_ptr->emitted(pt.rec.u, pt.rec.v, pt.rec.p));
+                pt_minus->pdf_rev = to_area(light_bvh::emission_direction_pdf(pt.rec.normal, pt_minus->rec.p - pt.rec.p),
+                                            pt.rec.p, *pt_minus);
+            }
+
+            auto ratio = [](const bdpt_vertex& v) {
+                auto r = (v.pdf_rev != 0 ? v.pdf_rev : 1) / (v.pdf_fwd != 0 ? v.pdf_fwd : 1);
+                return r * r;
+            };
+            double sum = 0;
+            double ri = 1;
+            for (int i = t - 1; i > 0; --i) {
+                ri *= ratio(camera_path[i]);
+                if (!camera_path[i].delta && !camera_path[i - 1].delta)
+                    sum += ri;
+            }
+            ri = 1;
+            for (int i = s - 1; i >= 0; --i) {
+                ri *= ratio(light_path[i]);
+                if (!light_path[i].delta && !(i > 0 && light_path[i - 1].delta))
+                    sum += ri;
+            }
+
+            pt.pdf_rev = pt_rev;
+            pt.delta = pt_delta;
+            if (pt_minus)
+                pt_minus->pdf_rev = pt_minus_rev;
+            if (qs) {
+                qs->pdf_rev = qs_rev;
+                qs->delta = qs_delta;
+            }
+            if (qs_minus)
+                qs_minus->pdf_rev = qs_minus_rev;
+            return 1 / (1 + sum);
+        }
+
+    private:
+        int width;
+        int height;
+        double image_area = 0; // 整幅图像在距相机单位距离处的面积
+        const camera* active_camera = nullptr;
+        splat_framebuffer splats;
+};
+
+#endif //RTWEEKEND_BDPT_H
@@ -51,7 +51,10 @@ box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
 }
 
 bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    return sides.hit(r, t_min, t_max, rec);
+    if (!sides.hit(r, t_min, t_max, rec))
+        return false;
+    rec.object_id = object_id;
+    return true;
 }
 
 
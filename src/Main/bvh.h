@@ -36,10 +36,20 @@ class bvh_node : public hittable  {
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual bool hit_surface(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override;
+
+        virtual bool has_media() const override {
+            return media;
+        }
+
     public:
         shared_ptr<hittable> left;
         shared_ptr<hittable> right;
         aabb box;
+        bool media = false; // 子树中是否有参与介质，没有时阴影光线按普通求交处理
 };
 
 
@@ -70,7 +80,7 @@ bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b)
 bvh_node::bvh_node(
     const std::vector<shared_ptr<hittable>>& src_objects,
     size_t start, size_t end, double time0, double time1
-) {
+) : hittable(unnumbered()) {
     auto objects = src_objects; // Create a modifiable array of the source scene objects
 
     int axis = random_int(0,2);
@@ -106,6 +116,7 @@ bvh_node::bvh_node(
         std::cerr << "No bounding box in bvh_node constructor.\n";
 
     box = surrounding_box(box_left, box_right);
+    media = left->has_media() || right->has_media();
 }
 
 
@@ -120,6 +131,30 @@ bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 }
 
 
+bool bvh_node::hit_surface(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (!media)
+        return hit(r, t_min, t_max, rec);
+    if (!box.hit(r, t_min, t_max))
+        return false;
+
+    bool hit_left = left->hit_surface(r, t_min, t_max, rec);
+    bool hit_right = right->hit_surface(r, t_min, hit_left ? rec.t : t_max, rec);
+
+    return hit_left || hit_right;
+}
+
+
+double bvh_node::transmittance(const ray& r, double t_min, double t_max) const {
+    if (!media || !box.hit(r, t_min, t_max))
+        return 1.0;
+
+    auto result = left->transmittance(r, t_min, t_max);
+    if (right != left && result > 0)
+        result *= right->transmittance(r, t_min, t_max);
+    return result;
+}
+
+
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
     output_box = box;
     return true;
@@ -39,6 +39,27 @@ class constant_medium : public hittable  {
             return boundary->bounding_box(time0, time1, output_box);
         }
 
+        virtual bool hit_surface(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return false;
+        }
+
+        // 均匀介质的透射率 exp(-密度 * 介质内的长度)
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            double t0, t1;
+            if (!inside_interval(r, t_min, t_max, t0, t1))
+                return 1.0;
+            return exp((t1 - t0) * r.direction().length() / neg_inv_density);
+        }
+
+        virtual bool has_media() const override {
+            return true;
+        }
+
+    private:
+        // 光线在边界内且位于 [t_min, t_max] 的区间
+        bool inside_interval(const ray& r, double t_min, double t_max, double& t0, double& t1) const;
+
     public:
         shared_ptr<hittable> boundary;
         shared_ptr<material> phase_function;
@@ -51,33 +72,20 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
     const bool enableDebug = false;
     const bool debugging = enableDebug && random_double() < 0.00001;
 
-    hit_record rec1, rec2;
-
-    if (!boundary->hit(r, -infinity, infinity, rec1))
+    double t0, t1;
+    if (!inside_interval(r, t_min, t_max, t0, t1))
         return false;
 
-    if (!boundary->hit(r, rec1.t+0.0001, infinity, rec2))
-        return false;
-
-    if (debugging) std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
-
-    if (rec1.t < t_min) rec1.t = t_min;
-    if (rec2.t > t_max) rec2.t = t_max;
-
-    if (rec1.t >= rec2.t)
-        return false;
-
-    if (rec1.t < 0)
-        rec1.t = 0;
+    if (debugging) std::cerr << "\nt_min=" << t0 << ", t_max=" << t1 << '\n';
 
     const auto ray_length = r.direction().length();
-    const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+    const auto distance_inside_boundary = (t1 - t0) * ray_length;
     const auto hit_distance = neg_inv_density * log(random_double());
 
     if (hit_distance > distance_inside_boundary)
         return false;
 
-    rec.t = rec1.t + hit_distance / ray_length;
+    rec.t = t0 + hit_distance / ray_length;
     rec.p = r.at(rec.t);
 
     if (debugging) {
@@ -89,8 +97,23 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
     rec.normal = vec3(1,0,0);  // arbitrary
     rec.front_face = true;     // also arbitrary
     rec.mat_ptr = phase_function;
+    rec.object_id = object_id;
 
     return true;
 }
 
+bool constant_medium::inside_interval(const ray& r, double t_min, double t_max, double& t0, double& t1) const {
+    hit_record rec1, rec2;
+
+    if (!boundary->hit(r, -infinity, infinity, rec1))
+        return false;
+
+    if (!boundary->hit(r, rec1.t+0.0001, infinity, rec2))
+        return false;
+
+    t0 = fmax(rec1.t, fmax(t_min, 0.0));
+    t1 = fmin(rec2.t, t_max);
+    return t0 < t1;
+}
+
 #endif
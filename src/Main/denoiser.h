@@ -0,0 +1,151 @@
+//
+// Created by Qiuzhe on 2021/6/27.
+//
+
+#ifndef RTWEEKEND_DENOISER_H
+#define RTWEEKEND_DENOISER_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <vector>
+
+
+class denoiser {
+    /******************************
+        边缘保持的 à-trous 小波滤波：对 5x5 的 B3 样条核做多次迭代，第 k 次迭代的采样间隔为 2^k，
+        每个邻域像素的权重由亮度差(以该像素的噪声标准差归一化)、法线差与反照率差共同决定，跨越几何或纹理边缘时权重趋于 0。
+        滤波前先除去反照率，只对光照部分滤波，结束后再乘回，纹理细节不会被模糊。
+        数据按通道分开存储为 float 数组，逐行并行处理。
+    ******************************/
+    public:
+        denoiser(int width, int height) : width(width), height(height) {}
+
+        // beauty 为归一化后的线性颜色，结果原地写回；variance 为每个像素均值亮度的方差
+        void apply(std::vector<color>& beauty, const std::vector<color>& albedo, const std::vector<vec3>& normal,
+                   const std::vector<double>& variance) const {
+            const int n = width * height;
+            std::vector<float> c[3], a[3], nrm[3], var(n);
+            for (int k = 0; k < 3; ++k) {
+                c[k].resize(n);
+                a[k].resize(n);
+                nrm[k].resize(n);
+            }
+
+            // 除去反照率，方差按反照率的亮度同样缩放
+            for (int i = 0; i < n; ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    a[k][i] = static_cast<float>(albedo[i][k]);
+                    nrm[k][i] = static_cast<float>(normal[i][k]);
+                    c[k][i] = static_cast<float>(finite(beauty[i][k]) / fmax(albedo[i][k], min_albedo));
+                }
+                auto scale = fmax(luminance(albedo[i]), min_albedo);
+                var[i] = static_cast<float>(finite(variance[i]) / (scale * scale));
+            }
+
+            std::vector<float> out[3], out_var(n);
+            for (auto& o : out)
+                o.resize(n);
+            for (int iteration = 0; iteration < iterations; ++iteration) {
+                filter(c, a, nrm, var, out, out_var, 1 << iteration);
+                for (int k = 0; k < 3; ++k)
+                    c[k].swap(out[k]);
+                var.swap(out_var);
+            }
+
+            for (int i = 0; i < n; ++i)
+                for (int k = 0; k < 3; ++k)
+                    beauty[i][k] = c[k][i] * fmax(albedo[i][k], min_albedo);
+        }
+
+    public:
+        int iterations = 5;
+        double sigma_luminance = 4.0; // 亮度差以多少倍噪声标准差为尺度
+        double sigma_normal = 0.3;
+        double sigma_albedo = 0.1;
+
+    private:
+        static double finite(double x) {
+            return std::isfinite(x) ? x : 0.0;
+        }
+
+        // 一次迭代：c/var 为输入，out/out_var 为输出，step 为采样间隔
+        void filter(const std::vector<float> (&c)[3], const std::vector<float> (&a)[3], const std::vector<float> (&nrm)[3],
+                    const std::vector<float>& var, std::vector<float> (&out)[3], std::vector<float>& out_var,
+                    int step) const {
+            static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+            const auto inv_normal = static_cast<float>(1 / (sigma_normal * sigma_normal));
+            const auto inv_albedo = static_cast<float>(1 / (sigma_albedo * sigma_albedo));
+
+#pragma omp parallel for schedule(dynamic, 4) num_threads(6)
+            for (int y = 0; y < height; ++y) {
+                for (int x = 0; x < width; ++x) {
+                    const int p = y * width + x;
+                    const float lp = luminance_at(c, p);
+                    const float scale = static_cast<float>(sigma_luminance) * std::sqrt(blurred_variance(var, x, y)) + 1e-6f;
+
+                    float sum_w = 0, sum_w2v = 0;
+                    float sum_c[3] = {0, 0, 0};
+                    for (int dy = -2; dy <= 2; ++dy) {
+                        const int qy = y + dy * step;
+                        if (qy < 0 || qy >= height)
+                            continue;
+                        for (int dx = -2; dx <= 2; ++dx) {
+                            const int qx = x + dx * step;
+                            if (qx < 0 || qx >= width)
+                                continue;
+                            const int q = qy * width + qx;
+
+                            float dn = 0, da = 0;
+                            for (int k = 0; k < 3; ++k) {
+                                dn += (nrm[k][p] - nrm[k][q]) * (nrm[k][p] - nrm[k][q]);
+                                da += (a[k][p] - a[k][q]) * (a[k][p] - a[k][q]);
+                            }
+                            const float dl = std::fabs(lp - luminance_at(c, q)) / scale;
+                            const float w = kernel[dx + 2] * kernel[dy + 2] *
+                                            std::exp(-dl - dn * inv_normal - da * inv_albedo);
+
+                            sum_w += w;
+                            sum_w2v += w * w * var[q];
+                            for (int k = 0; k < 3; ++k)
+                                sum_c[k] += w * c[k][q];
+                        }
+                    }
+
+                    // 中心像素的权重不为 0，sum_w > 0
+                    for (int k = 0; k < 3; ++k)
+                        out[k][p] = sum_c[k] / sum_w;
+                    out_var[p] = sum_w2v / (sum_w * sum_w);
+                }
+            }
+        }
+
+        static float luminance_at(const std::vector<float> (&c)[3], int p) {
+            return 0.2126f * c[0][p] + 0.7152f * c[1][p] + 0.0722f * c[2][p];
+        }
+
+        // 3x3 高斯模糊后的方差，降低方差估计本身的噪声
+        float blurred_variance(const std::vector<float>& var, int x, int y) const {
+            static const float kernel[3] = {0.25f, 0.5f, 0.25f};
+            float sum = 0, sum_w = 0;
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    int qx = x + dx, qy = y + dy;
+                    if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+                        continue;
+                    float w = kernel[dx + 1] * kernel[dy + 1];
+                    sum += w * var[qy * width + qx];
+                    sum_w += w;
+                }
+            }
+            return sum / sum_w;
+        }
+
+    private:
+        static constexpr double min_albedo = 0.01;
+
+        int width;
+        int height;
+};
+
+#endif //RTWEEKEND_DENOISER_H
@@ -0,0 +1,140 @@
+//
+// Created by Qiuzhe on 2021/6/22.
+//
+
+#ifndef RTWEEKEND_ENVIRONMENT_H
+#define RTWEEKEND_ENVIRONMENT_H
+
+#include "rtweekend.h"
+
+#include "material.h"
+#include "skybox.h"
+
+#include <vector>
+
+
+class environment {
+    /******************************
+        环境光：光线未命中场景时的光照来源，纯色背景或天空盒。
+        importance_sampling 为 true 时，天空盒会被划分为 6 个面、每面 resolution^2 个格子，
+        按 亮度*立体角 建立分段常数分布，通过别名表进行重要性采样；否则环境光只能由 BSDF 采样命中
+    ******************************/
+    public:
+        environment(color c) : background(c) {}
+
+        environment(shared_ptr<sky_box> box, bool importance_sampling, int res = 64) : sky(box), resolution(res) {
+            if (importance_sampling)
+                build_distribution();
+        }
+
+        color value(const ray& r) const {
+            if (!sky)
+                return background;
+
+            // 天空盒只与方向有关，把光线起点移到天空盒中心，相邻像素的光线也从中心出发
+            ray r_t(point3(0, 0, 0), r.direction(), r.time());
+            if (r.has_differentials) {
+                r_t.has_differentials = true;
+                r_t.rx_origin = r_t.ry_origin = point3(0, 0, 0);
+                r_t.rx_direction = r.rx_direction;
+                r_t.ry_direction = r.ry_direction;
+            }
+            hit_record rec;
+            if (!sky->hit(r_t, 0.001, infinity, rec))
+                return background;
+            rec.compute_differentials(r_t);
+            return rec.mat_ptr->emitted(rec.u, rec.v, rec.p, rec.footprint);
+        }
+
+        // 是否可以对环境光做重要性采样
+        bool importance_sampled() const {
+            return distribution.size() > 0;
+        }
+
+        // 由一个选择样本 u 与二维样本 (u1,u2) 采样方向
+        vec3 sample(double u, double u1, double u2) const {
+            double remapped;
+            int index = distribution.sample(u, remapped);
+            int face = index / (resolution * resolution);
+            int cell = index % (resolution * resolution);
+            auto s = -1 + 2 * ((cell % resolution) + u1) / resolution;
+            auto t = -1 + 2 * ((cell / resolution) + u2) / resolution;
+            return face_direction(face, s, t);
+        }
+
+        // 方向 direction 的概率密度(立体角)
+        double pdf(const vec3& direction) const {
+            int face;
+            double s, t;
+            face_coordinate(direction, face, s, t);
+            int i = std::min(static_cast<int>((s + 1) / 2 * resolution), resolution - 1);
+            int j = std::min(static_cast<int>((t + 1) / 2 * resolution), resolution - 1);
+            auto p = distribution.probability((face * resolution + j) * resolution + i);
+
+            // 面上 (s,t) 的面积密度换算到立体角：dw = dA / r^3
+            auto cell_area = (2.0 / resolution) * (2.0 / resolution);
+            auto r = sqrt(1 + s * s + t * t);
+            return p / cell_area * r * r * r;
+        }
+
+    private:
+        void build_distribution() {
+            // 每个格子取 2x2 个方向的平均亮度，乘以格子对应的立体角
+            std::vector<double> weights(6 * resolution * resolution);
+            auto sum = 0.0;
+            for (int face = 0; face < 6; ++face) {
+                for (int j = 0; j < resolution; ++j) {
+                    for (int i = 0; i < resolution; ++i) {
+                        auto luminance = 0.0;
+                        for (int k = 0; k < 4; ++k) {
+                            auto s = -1 + 2 * (i + 0.25 + 0.5 * (k % 2)) / resolution;
+                            auto t = -1 + 2 * (j + 0.25 + 0.5 * (k / 2)) / resolution;
+                            auto c = value(ray(point3(0, 0, 0), face_direction(face, s, t)));
+                            luminance += 0.25 * ::luminance(c);
+                        }
+                        auto s = -1 + 2 * (i + 0.5) / resolution;
+                        auto t = -1 + 2 * (j + 0.5) / resolution;
+                        auto r = sqrt(1 + s * s + t * t);
+                        auto w = luminance / (r * r * r);
+                        weights[(face * resolution + j) * resolution + i] = w;
+                        sum += w;
+                    }
+                }
+            }
+
+            // 给所有格子保留一个很小的概率，避免采样到 pdf 为 0 的格子内仍有亮度的情况
+            auto min_weight = 1e-3 * sum / weights.size();
+            for (auto& w : weights)
+                w += min_weight;
+            distribution = alias_table(weights);
+        }
+
+        // 第 face 个面(主轴 face/2，正负 face%2)上坐标 (s,t) 的方向
+        static vec3 face_direction(int face, double s, double t) {
+            int axis = face / 2;
+            vec3 d;
+            d[axis] = face % 2 ? -1 : 1;
+            d[(axis + 1) % 3] = s;
+            d[(axis + 2) % 3] = t;
+            return d;
+        }
+
+        static void face_coordinate(const vec3& d, int& face, double& s, double& t) {
+            int axis = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2)
+                                                 : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+            auto major = fabs(d[axis]);
+            face = axis * 2 + (d[axis] < 0 ? 1 : 0);
+            s = clamp(d[(axis + 1) % 3] / major, -1.0, 1.0);
+            t = clamp(d[(axis + 2) % 3] / major, -1.0, 1.0);
+        }
+
+    public:
+        color background;
+        shared_ptr<sky_box> sky;
+
+    private:
+        int resolution = 0;
+        alias_table distribution;
+};
+
+#endif //RTWEEKEND_ENVIRONMENT_H
@@ -0,0 +1,353 @@
+//
+// Created by Qiuzhe on 2021/7/3.
+//
+
+#ifndef RTWEEKEND_GUIDING_H
+#define RTWEEKEND_GUIDING_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+
+class direction_tree {
+    /******************************
+        方向四叉树：单位正方形经柱面等面积映射 (cos(theta), phi) 对应到单位球面，
+        每个节点把所在的正方形四等分，记录四个子区域的能量；叶子区域内为均匀分布
+    ******************************/
+    public:
+        struct node {
+            int child[4] = {0, 0, 0, 0}; // 子节点编号，0 表示该子区域为叶子
+            double sum[4] = {0, 0, 0, 0};
+        };
+
+        direction_tree() : nodes(1) {}
+
+        double total() const {
+            return nodes[0].sum[0] + nodes[0].sum[1] + nodes[0].sum[2] + nodes[0].sum[3];
+        }
+
+        size_t size() const {
+            return nodes.size();
+        }
+
+        vec3 sample(double u1, double u2) const {
+            double x = 0, y = 0, scale = 1;
+            int n = 0;
+            while (true) {
+                const auto& nd = nodes[n];
+                auto sum = nd.sum[0] + nd.sum[1] + nd.sum[2] + nd.sum[3];
+                int k;
+                if (sum <= 0) {
+                    // 没有能量的节点按均匀分布选择子区域
+                    k = std::min(static_cast<int>(u1 * 4), 3);
+                    u1 = u1 * 4 - k;
+                } else {
+                    // 先按左右两半的能量选 x，再在选中的一半中按上下的能量选 y
+                    auto left = nd.sum[0] + nd.sum[2];
+                    auto p_left = left / sum;
+                    int bx = u1 < p_left ? 0 : 1;
+                    u1 = bx == 0 ? u1 / p_left : (u1 - p_left) / (1 - p_left);
+                    auto column = bx == 0 ? left : sum - left;
+                    auto p_bottom = nd.sum[bx] / column;
+                    int by = u2 < p_bottom ? 0 : 1;
+                    u2 = by == 0 ? u2 / p_bottom : (u2 - p_bottom) / (1 - p_bottom);
+                    k = bx + 2 * by;
+                }
+                u1 = clamp(u1, 0.0, 0.999999);
+                u2 = clamp(u2, 0.0, 0.999999);
+                scale *= 0.5;
+                x += (k & 1) * scale;
+                y += (k >> 1) * scale;
+                if (nd.child[k] == 0)
+                    break;
+                n = nd.child[k];
+            }
+            return to_direction(x + u1 * scale, y + u2 * scale);
+        }
+
+        // 立体角上的概率密度
+        double pdf(const vec3& direction) const {
+            double x, y;
+            to_square(direction, x, y);
+            double p = 1;
+            int n = 0;
+            while (true) {
+                const auto& nd = nodes[n];
+                auto sum = nd.sum[0] + nd.sum[1] + nd.sum[2] + nd.sum[3];
+                int k = child_slot(x, y);
+                if (sum > 0)
+                    p *= 4 * nd.sum[k] / sum;
+                if (p <= 0 || nd.child[k] == 0)
+                    break;
+                n = nd.child[k];
+            }
+            return p / (4 * pi);
+        }
+
+        // direction 所在的叶子区域，按 节点编号 * 4 + 子区域 编号
+        int leaf_slot(const vec3& direction) const {
+            double x, y;
+            to_square(direction, x, y);
+            int n = 0;
+            while (true) {
+                int k = child_slot(x, y);
+                if (nodes[n].child[k] == 0)
+                    return 4 * n + k;
+                n = nodes[n].child[k];
+            }
+        }
+
+        // 能量超过总量 threshold 比例的子区域继续细分，最多 max_nodes 个节点，新的树能量为 0
+        direction_tree refined(double threshold, int max_nodes) const {
+            direction_tree out;
+            auto limit = threshold * total();
+            // 按层次遍历，节点数用完时保留已有的细分
+            std::vector<std::pair<int, int>> queue{{0, 0}}; // (本树节点, 新树节点)
+            for (size_t q = 0; q < queue.size(); ++q) {
+                auto from = queue[q].first, to = queue[q].second;
+                for (int k = 0; k < 4; ++k) {
+                    if (!(nodes[from].sum[k] > limit) || limit <= 0 || static_cast<int>(out.nodes.size()) >= max_nodes)
+                        continue;
+                    int child = static_cast<int>(out.nodes.size());
+                    out.nodes.emplace_back();
+                    out.nodes[to].child[k] = child;
+                    // 原来的叶子每轮只细分一层，能量仍然较大的子区域在下一轮继续细分
+                    if (nodes[from].child[k] != 0)
+                        queue.emplace_back(nodes[from].child[k], child);
+                }
+            }
+            return out;
+        }
+
+        // 由叶子能量自下而上求出各节点的能量
+        void sum_up(const std::vector<double>& leaf_energy) {
+            for (int n = static_cast<int>(nodes.size()) - 1; n >= 0; --n)
+                for (int k = 0; k < 4; ++k)
+                    nodes[n].sum[k] = nodes[n].child[k] != 0 ? total_of(nodes[n].child[k]) : leaf_energy[4 * n + k];
+        }
+
+    private:
+        double total_of(int n) const {
+            return nodes[n].sum[0] + nodes[n].sum[1] + nodes[n].sum[2] + nodes[n].sum[3];
+        }
+
+        // 取出 (x, y) 所在的子区域，并把坐标缩放到子区域内
+        static int child_slot(double& x, double& y) {
+            int bx = x < 0.5 ? 0 : 1;
+            int by = y < 0.5 ? 0 : 1;
+            x = x * 2 - bx;
+            y = y * 2 - by;
+            return bx + 2 * by;
+        }
+
+        static void to_square(const vec3& direction, double& x, double& y) {
+            auto d = unit_vector(direction);
+            x = clamp(0.5 * (d.z() + 1), 0.0, 0.999999);
+            auto phi = atan2(d.y(), d.x());
+            y = clamp((phi < 0 ? phi + 2 * pi : phi) / (2 * pi), 0.0, 0.999999);
+        }
+
+        static vec3 to_direction(double x, double y) {
+            auto z = 2 * x - 1;
+            auto r = sqrt(fmax(0.0, 1 - z * z));
+            auto phi = 2 * pi * y;
+            return vec3(r * cos(phi), r * sin(phi), z);
+        }
+
+    private:
+        std::vector<node> nodes;
+};
+
+
+// 非镜面顶点上 BSDF 采样与引导分布的混合
+struct guided_bsdf {
+    const direction_tree* tree = nullptr; // 为空时只使用 BSDF 采样
+    double fraction = 0; // 按引导分布采样的概率
+
+    double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+        auto p = rec.mat_ptr->pdf(r_in, rec, direction);
+        if (!tree)
+            return p;
+        return (1 - fraction) * p + fraction * tree->pdf(direction);
+    }
+};
+
+
+class path_guide {
+    /******************************
+        路径引导的 SD 树：空间上为沿 x/y/z 轮流对半划分的二叉树，每个叶子保存一棵方向四叉树。
+        渲染时记录每个非镜面顶点沿采样方向的入射亮度(除以采样 pdf)；每轮结束后 refine：
+        记录的结果成为下一轮的采样分布，样本过多的空间叶子对半划分，方向四叉树按能量重新细分。
+        渲染过程中树的结构不变，记录只对叶子做原子加法，多线程安全；节点总数受 max_bytes 限制
+    ******************************/
+    public:
+        path_guide(size_t max_bytes) : max_nodes(std::max<size_t>(max_bytes / bytes_per_node, 64)) {}
+
+        void build(const hittable& world) {
+            aabb box;
+            world.bounding_box(0, 1, box);
+            // 稍微放大，避免边界上的点落在外面
+            auto margin = 0.01 * (box.max() - box.min()) + vec3(1e-3, 1e-3, 1e-3);
+            bounds = aabb(box.min() - margin, box.max() + margin);
+            space.assign(1, space_node());
+            space[0].leaf = 0;
+            sampling.assign(1, direction_tree());
+            building.assign(1, direction_tree());
+            reset_records();
+        }
+
+        // 点 p 所在的空间叶子
+        int leaf(const point3& p) const {
+            auto lo = bounds.min(), hi = bounds.max();
+            int n = 0;
+            while (space[n].leaf < 0) {
+                int axis = space[n].axis;
+                auto mid = 0.5 * (lo[axis] + hi[axis]);
+                if (p[axis] < mid) {
+                    hi[axis] = mid;
+                    n = space[n].child;
+                } else {
+                    lo[axis] = mid;
+                    n = space[n].child + 1;
+                }
+            }
+            return space[n].leaf;
+        }
+
+        // 叶子上的混合采样分布，还没有记录时只使用 BSDF 采样
+        guided_bsdf bsdf(int leaf) const {
+            guided_bsdf g;
+            if (sampling[leaf].total() > 0) {
+                g.tree = &sampling[leaf];
+                g.fraction = bsdf_fraction;
+            }
+            return g;
+        }
+
+        // 记录一个入射方向上的样本，可在多个线程中同时调用
+        void record(int leaf, const vec3& direction, double value) {
+            if (!(value > 0) || value == infinity)
+                return;
+            atomic_add(leaf_energy[leaf][building[leaf].leaf_slot(direction)], value);
+            sample_counts[leaf].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // 一轮渲染结束后更新分布；spp 为该轮每个像素的样本数
+        void refine(int spp) {
+            // 本轮记录的结果成为采样分布
+            int leaf_count = static_cast<int>(building.size());
+            std::vector<int> counts(leaf_count);
+            for (int l = 0; l < leaf_count; ++l) {
+                std::vector<double> energy(leaf_energy[l].size());
+                for (size_t i = 0; i < energy.size(); ++i)
+                    energy[i] = leaf_energy[l][i].load(std::memory_order_relaxed);
+                counts[l] = sample_counts[l].load(std::memory_order_relaxed);
+                if (counts[l] == 0)
+                    continue;
+                building[l].sum_up(energy);
+                sampling[l] = building[l];
+            }
+
+            // 样本过多的空间叶子对半划分，两半各复制一份分布
+            auto split_threshold = spatial_threshold * sqrt(static_cast<double>(std::max(spp, 1)));
+            size_t total = node_count();
+            for (int n = 0; n < static_cast<int>(space.size()); ++n) {
+                if (space[n].leaf < 0)
+                    continue;
+                int l = space[n].leaf;
+                if (counts[l] <= split_threshold || total + sampling[l].size() + building[l].size() > max_nodes)
+                    continue;
+                int child = static_cast<int>(space.size());
+                space[n].child = child;
+                space.push_back(space_node());
+                space.push_back(space_node());
+                space[child].axis = space[child + 1].axis = (space[n].axis + 1) % 3;
+                space[child].leaf = l;
+                space[child + 1].leaf = static_cast<int>(sampling.size());
+                space[n].leaf = -1;
+                sampling.push_back(sampling[l]);
+                building.push_back(building[l]);
+                total += sampling[l].size() + building[l].size();
+                // 样本近似均分到两半，仍然过多的一半在本轮继续划分
+                counts[l] /= 2;
+                counts.push_back(counts[l]);
+            }
+
+            // 方向四叉树按本轮的能量重新细分，每棵树的节点数按预算平均分配
+            leaf_count = static_cast<int>(sampling.size());
+            int per_tree = std::max<int>(static_cast<int>(max_nodes / (2 * leaf_count)), 1);
+            for (int l = 0; l < leaf_count; ++l)
+                building[l] = building[l].refined(direction_threshold, std::min(per_tree, max_tree_nodes));
+            reset_records();
+        }
+
+        size_t leaf_count() const {
+            return sampling.size();
+        }
+
+        size_t node_count() const {
+            size_t n = 0;
+            for (size_t l = 0; l < sampling.size(); ++l)
+                n += sampling[l].size() + building[l].size();
+            return n;
+        }
+
+        size_t memory() const {
+            size_t bytes = space.size() * sizeof(space_node);
+            for (size_t l = 0; l < sampling.size(); ++l)
+                bytes += sampling[l].size() * sizeof(direction_tree::node) +
+                         building[l].size() * (sizeof(direction_tree::node) + 4 * sizeof(std::atomic<double>));
+            return bytes;
+        }
+
+    private:
+        struct space_node {
+            int axis = 0;   // 划分轴，子节点的划分轴依次轮换
+            int child = 0;  // 两个子节点为 child 与 child + 1
+            int leaf = -1;  // 叶子编号，-1 表示内部节点
+        };
+
+        void reset_records() {
+            leaf_energy.clear();
+            leaf_energy.reserve(building.size());
+            for (const auto& tree : building)
+                leaf_energy.emplace_back(4 * tree.size());
+            for (auto& e : leaf_energy)
+                for (auto& v : e)
+                    v.store(0.0, std::memory_order_relaxed);
+            sample_counts = std::vector<std::atomic<int>>(building.size());
+            for (auto& c : sample_counts)
+                c.store(0, std::memory_order_relaxed);
+        }
+
+        static void atomic_add(std::atomic<double>& a, double x) {
+            auto old = a.load(std::memory_order_relaxed);
+            while (!a.compare_exchange_weak(old, old + x, std::memory_order_relaxed))
+                ;
+        }
+
+    private:
+        // 预算按每个方向节点(采样或记录)的最大占用计算：节点本身与记录用的四个原子变量
+        static const size_t bytes_per_node = sizeof(direction_tree::node) + 4 * sizeof(std::atomic<double>);
+        static constexpr double bsdf_fraction = 0.5;       // 按引导分布采样的概率
+        static constexpr double spatial_threshold = 3000; // 空间叶子划分的样本数阈值，乘以 sqrt(spp)
+        static constexpr double direction_threshold = 0.01; // 方向节点细分的能量比例阈值
+        static const int max_tree_nodes = 4096;
+
+        size_t max_nodes;
+        aabb bounds;
+        std::vector<space_node> space;
+        std::vector<direction_tree> sampling; // 当前用于采样的分布
+        std::vector<direction_tree> building; // 本轮记录使用的结构
+        std::vector<std::vector<std::atomic<double>>> leaf_energy; // building[l] 各叶子区域的能量
+        std::vector<std::atomic<int>> sample_counts;
+};
+
+#endif //RTWEEKEND_GUIDING_H
@@ -0,0 +1,389 @@
+//
+// Created by Qiuzhe on 2021/7/4.
+//
+
+#ifndef RTWEEKEND_HETEROGENEOUS_MEDIUM_H
+#define RTWEEKEND_HETEROGENEOUS_MEDIUM_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+#include "perlin.h"
+#include "sampler.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <vector>
+
+
+// 介质的求交接口没有采样器，自由程与零碰撞的判定使用由当前像素样本决定的随机数流，同一设置的渲染结果可以复现
+inline double medium_random() {
+    return sample_stream_random();
+}
+
+// ratio tracking 的透射率低于该值时做轮盘赌，存活后提升回该值
+const double ratio_tracking_threshold = 0.1;
+
+// 光线与包围盒的交集裁剪到 [t0, t1]，为空时返回 false
+inline bool clip_to_box(const aabb& box, const ray& r, double& t0, double& t1) {
+    for (int k = 0; k < 3; ++k) {
+        auto inv = 1 / r.direction()[k];
+        auto ta = (box.min()[k] - r.origin()[k]) * inv;
+        auto tb = (box.max()[k] - r.origin()[k]) * inv;
+        if (inv < 0)
+            std::swap(ta, tb);
+        t0 = fmax(t0, ta);
+        t1 = fmin(t1, tb);
+        if (t1 <= t0)
+            return false;
+    }
+    return true;
+}
+
+// 3D-DDA：网格从 origin 开始，各轴 res[k] 个边长为 cell[k] 的单元，沿光线在 [t0, t1] 上按顺序访问经过的单元，
+// visit(index, t_enter, t_exit) 返回 false 时停止。t0 处的点落在网格外时取最近的单元
+template <typename Visit>
+void grid_traverse(const ray& r, double t0, double t1, const point3& origin, const double cell[3], const int res[3],
+                   Visit visit) {
+    auto p = r.at(t0);
+    int index[3], step[3], limit[3];
+    double t_next[3], t_delta[3];
+    for (int k = 0; k < 3; ++k) {
+        auto d = r.direction()[k];
+        index[k] = std::min(std::max(static_cast<int>(floor((p[k] - origin[k]) / cell[k])), 0), res[k] - 1);
+        auto lo = origin[k] + index[k] * cell[k];
+        if (d > 0) {
+            step[k] = 1;
+            limit[k] = res[k];
+            t_next[k] = t0 + (lo + cell[k] - p[k]) / d;
+            t_delta[k] = cell[k] / d;
+        } else if (d < 0) {
+            step[k] = -1;
+            limit[k] = -1;
+            t_next[k] = t0 + (lo - p[k]) / d;
+            t_delta[k] = -cell[k] / d;
+        } else {
+            step[k] = 0;
+            limit[k] = -1;
+            t_next[k] = infinity;
+            t_delta[k] = infinity;
+        }
+    }
+
+    auto t = t0;
+    while (t < t1) {
+        int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+        auto t_exit = fmin(t_next[axis], t1);
+        if (t_exit > t && !visit(index, t, t_exit))
+            return;
+        t = t_exit;
+        index[axis] += step[axis];
+        if (index[axis] == limit[axis])
+            return;
+        t_next[axis] += t_delta[axis];
+    }
+}
+
+// delta tracking：segments(visit) 沿光线按顺序给出分段常数的密度上界 visit(t_enter, t_exit, majorant)，
+// 在每段内按上界采样自由程，以 密度/上界 的概率接受为真实碰撞。发生碰撞时返回 true，t_hit 为碰撞位置
+template <typename Segments, typename Density>
+bool delta_tracking(const ray& r, Segments segments, Density density, double& t_hit) {
+    const auto length = r.direction().length();
+    bool collided = false;
+    segments([&](double t_enter, double t_exit, double majorant) {
+        if (majorant <= 0)
+            return true;
+        auto t = t_enter;
+        while (true) {
+            t -= log(1 - medium_random()) / (majorant * length);
+            if (t >= t_exit)
+                return true;
+            if (medium_random() * majorant < density(r.at(t))) {
+                t_hit = t;
+                collided = true;
+                return false;
+            }
+        }
+    });
+    return collided;
+}
+
+// ratio tracking：与 delta tracking 相同地采样试探碰撞，每次乘上 1 - 密度/上界，得到透射率的无偏估计
+template <typename Segments, typename Density>
+double ratio_tracking(const ray& r, Segments segments, Density density) {
+    const auto length = r.direction().length();
+    auto result = 1.0;
+    segments([&](double t_enter, double t_exit, double majorant) {
+        if (majorant <= 0)
+            return true;
+        auto t = t_enter;
+        while (true) {
+            t -= log(1 - medium_random()) / (majorant * length);
+            if (t >= t_exit)
+                return true;
+            result *= 1 - density(r.at(t)) / majorant;
+            if (result < ratio_tracking_threshold) {
+                if (medium_random() * ratio_tracking_threshold >= result) {
+                    result = 0;
+                    return false;
+                }
+                result = ratio_tracking_threshold;
+            }
+        }
+    });
+    return result;
+}
+
+// 介质中的碰撞点：散射各向同性，法线与朝向没有意义
+inline void set_medium_record(const ray& r, double t, const shared_ptr<material>& phase_function, int object_id,
+                              hit_record& rec) {
+    rec.t = t;
+    rec.p = r.at(t);
+    rec.normal = vec3(1, 0, 0);  // arbitrary
+    rec.geometric_normal = rec.normal;
+    rec.front_face = true;       // also arbitrary
+    rec.u = rec.v = 0;
+    rec.dpdu = rec.dpdv = vec3(0, 0, 0);
+    rec.mat_ptr = phase_function;
+    rec.object_id = object_id;
+}
+
+
+class density_field {
+    /******************************
+        非均匀介质的密度场：density 为该点的消光系数(单位长度)，
+        max_density 为 box 内密度的上界，用于构建 majorant 网格，上界越紧空白区域跳过得越多
+    ******************************/
+    public:
+        virtual ~density_field() = default;
+
+        virtual double density(const point3& p) const = 0;
+
+        virtual double max_density(const aabb& box) const = 0;
+};
+
+
+class perlin_density : public density_field {
+    /******************************
+        分形 Perlin 噪声的密度：scale * max(0, fbm(frequency * p) + offset)，fbm 为 3 个倍频的噪声之和。
+        单元内的上界取 9x9x9 个格点上的最大值，再加上噪声在格点间距内可能的增量(斜率上界 * 到最近格点的最大距离)；
+        噪声的斜率上界由插值公式解析得到，密度不会超过上界，delta tracking 无偏
+    ******************************/
+    public:
+        perlin_density(double scale, double frequency, double offset = 0)
+            : scale(scale), frequency(frequency), offset(offset) {
+            // 每个倍频的频率加倍、幅度减半，斜率与单个噪声相同。
+            // 噪声是 8 个角的梯度与到角的向量的点积按 smoothstep 权重插值：对 u 求导时权重的导数不超过 1.5，
+            // 同一条 u 棱两端点积之差不超过 2*sqrt(3)，其余维度的权重之和为 1；加上权重和为 1 的梯度分量，
+            // 每个分量的偏导数不超过 3*sqrt(3) + 1，梯度长度不超过 sqrt(3) 倍
+            slope = octaves * sqrt(3.0) * (3 * sqrt(3.0) + 1);
+        }
+
+        virtual double density(const point3& p) const override {
+            return scale * fmax(0.0, fbm(frequency * p) + offset);
+        }
+
+        virtual double max_density(const aabb& box) const override {
+            const int n = 9;
+            auto extent = box.max() - box.min();
+            auto value = -infinity;
+            for (int i = 0; i < n; ++i)
+                for (int j = 0; j < n; ++j)
+                    for (int k = 0; k < n; ++k) {
+                        auto p = box.min() + vec3(extent.x() * i, extent.y() * j, extent.z() * k) / (n - 1);
+                        value = fmax(value, fbm(frequency * p));
+                    }
+            auto reach = 0.5 * frequency * extent.length() / (n - 1);
+            return scale * fmax(0.0, value + slope * reach + offset);
+        }
+
+    private:
+        double fbm(const point3& p) const {
+            auto accum = 0.0;
+            auto weight = 1.0;
+            auto q = p;
+            for (int i = 0; i < octaves; ++i) {
+                accum += weight * noise.noise(q);
+                weight *= 0.5;
+                q *= 2;
+            }
+            return accum;
+        }
+
+    private:
+        static const int octaves = 3;
+
+        perlin noise;
+        double scale;
+        double frequency;
+        double offset;
+        double slope; // fbm 的斜率上界(噪声坐标)
+};
+
+
+class voxel_density : public density_field {
+    /******************************
+        稠密体素网格：nx*ny*nz 个体素覆盖 bounds，密度位于体素中心，x 变化最快，
+        体素之间三线性插值，边界外取最近的体素。插值结果是周围 8 个体素的凸组合，单元的上界为覆盖该单元的体素的最大值
+    ******************************/
+    public:
+        voxel_density(const aabb& bounds, int nx, int ny, int nz, std::vector<float> values, double scale = 1)
+            : bounds(bounds), values(std::move(values)), scale(scale) {
+            res[0] = nx;
+            res[1] = ny;
+            res[2] = nz;
+            for (int k = 0; k < 3; ++k)
+                voxel[k] = (bounds.max()[k] - bounds.min()[k]) / res[k];
+        }
+
+        virtual double density(const point3& p) const override {
+            int base[3];
+            double f[3];
+            for (int k = 0; k < 3; ++k) {
+                auto x = (p[k] - bounds.min()[k]) / voxel[k] - 0.5;
+                base[k] = static_cast<int>(floor(x));
+                f[k] = x - base[k];
+            }
+            auto sum = 0.0;
+            for (int corner = 0; corner < 8; ++corner) {
+                auto w = 1.0;
+                int c[3];
+                for (int k = 0; k < 3; ++k) {
+                    int bit = (corner >> k) & 1;
+                    c[k] = std::min(std::max(base[k] + bit, 0), res[k] - 1);
+                    w *= bit ? f[k] : 1 - f[k];
+                }
+                sum += w * at(c[0], c[1], c[2]);
+            }
+            return scale * sum;
+        }
+
+        virtual double max_density(const aabb& box) const override {
+            int lo[3], hi[3];
+            for (int k = 0; k < 3; ++k) {
+                lo[k] = std::max(static_cast<int>(floor((box.min()[k] - bounds.min()[k]) / voxel[k] - 0.5)), 0);
+                hi[k] = std::min(static_cast<int>(floor((box.max()[k] - bounds.min()[k]) / voxel[k] - 0.5)) + 1,
+                                 res[k] - 1);
+                lo[k] = std::min(lo[k], res[k] - 1);
+                hi[k] = std::max(hi[k], 0);
+            }
+            auto value = 0.0;
+            for (int z = lo[2]; z <= hi[2]; ++z)
+                for (int y = lo[1]; y <= hi[1]; ++y)
+                    for (int x = lo[0]; x <= hi[0]; ++x)
+                        value = fmax(value, at(x, y, z));
+            return scale * value;
+        }
+
+    private:
+        double at(int x, int y, int z) const {
+            return values[(static_cast<size_t>(z) * res[1] + y) * res[0] + x];
+        }
+
+    private:
+        aabb bounds;
+        std::vector<float> values;
+        double scale;
+        int res[3];
+        double voxel[3];
+};
+
+
+class heterogeneous_medium : public hittable {
+    /******************************
+        非均匀参与介质：范围为包围盒 bounds，消光系数由密度场给出，散射为各向同性，反照率为 albedo。
+        包围盒划分为粗粒度的 majorant 网格(最长边 resolution 个单元)，每个单元记录其中密度的上界。
+        光线只与包围盒求交一次，沿光线用 3D-DDA 逐个单元遍历，上界为 0 的单元直接跳过：
+        求交(散射)用 delta tracking，阴影光线不与介质碰撞，用 ratio tracking 估计透射率
+    ******************************/
+    public:
+        heterogeneous_medium(const aabb& bounds, shared_ptr<density_field> density, shared_ptr<texture> albedo,
+                             int resolution = 16)
+            : bounds(bounds), density(density), phase_function(make_shared<isotropic>(albedo)) {
+            build_majorants(resolution);
+        }
+
+        heterogeneous_medium(const aabb& bounds, shared_ptr<density_field> density, color albedo,
+                             int resolution = 16)
+            : bounds(bounds), density(density), phase_function(make_shared<isotropic>(albedo)) {
+            build_majorants(resolution);
+        }
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            double t0 = t_min, t1 = t_max, t_hit;
+            if (!clip_to_box(bounds, r, t0, t1))
+                return false;
+            auto segments = [&](auto visit) { traverse(r, t0, t1, visit); };
+            auto sigma = [this](const point3& p) { return density->density(p); };
+            if (!delta_tracking(r, segments, sigma, t_hit))
+                return false;
+            set_medium_record(r, t_hit, phase_function, object_id, rec);
+            return true;
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = bounds;
+            return true;
+        }
+
+        virtual bool hit_surface(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return false;
+        }
+
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            double t0 = t_min, t1 = t_max;
+            if (!clip_to_box(bounds, r, t0, t1))
+                return 1.0;
+            auto segments = [&](auto visit) { traverse(r, t0, t1, visit); };
+            auto sigma = [this](const point3& p) { return density->density(p); };
+            return ratio_tracking(r, segments, sigma);
+        }
+
+        virtual bool has_media() const override {
+            return true;
+        }
+
+        size_t majorant_cells() const {
+            return majorants.size();
+        }
+
+    private:
+        void build_majorants(int resolution) {
+            auto extent = bounds.max() - bounds.min();
+            auto longest = fmax(extent.x(), fmax(extent.y(), extent.z()));
+            for (int k = 0; k < 3; ++k) {
+                res[k] = std::max(static_cast<int>(ceil(resolution * extent[k] / longest - 1e-9)), 1);
+                cell[k] = extent[k] / res[k];
+            }
+            majorants.resize(static_cast<size_t>(res[0]) * res[1] * res[2]);
+            for (int z = 0; z < res[2]; ++z)
+                for (int y = 0; y < res[1]; ++y)
+                    for (int x = 0; x < res[0]; ++x) {
+                        auto lo = bounds.min() + vec3(x * cell[0], y * cell[1], z * cell[2]);
+                        majorants[(static_cast<size_t>(z) * res[1] + y) * res[0] + x] =
+                                density->max_density(aabb(lo, lo + vec3(cell[0], cell[1], cell[2])));
+                    }
+        }
+
+        // 沿光线在 [t0, t1] 上逐个访问 majorant 单元，visit(t_enter, t_exit, majorant) 返回 false 时停止
+        template <typename Visit>
+        void traverse(const ray& r, double t0, double t1, Visit visit) const {
+            grid_traverse(r, t0, t1, bounds.min(), cell, res, [&](const int index[3], double t_enter, double t_exit) {
+                return visit(t_enter, t_exit,
+                             majorants[(static_cast<size_t>(index[2]) * res[1] + index[1]) * res[0] + index[0]]);
+            });
+        }
+
+    private:
+        aabb bounds;
+        shared_ptr<density_field> density;
+        shared_ptr<material> phase_function;
+
+        int res[3];
+        double cell[3];
+        std::vector<double> majorants;
+};
+
+#endif //RTWEEKEND_HETEROGENEOUS_MEDIUM_H
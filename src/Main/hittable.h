@@ -14,6 +14,9 @@
 #include "rtweekend.h"
 
 #include "aabb.h"
+#include "texture.h"
+
+#include <atomic>
 
 
 class material;
@@ -22,23 +25,116 @@ class material;
 struct hit_record {
     point3 p; // hit point
     vec3 normal; // normal vec
+    vec3 geometric_normal; // 几何法线，与 normal 同侧；只有插值法线的三角形上两者不同
     shared_ptr<material> mat_ptr;
     double t; // record t
     double u; // texture u
     double v; // texture v
     bool front_face; // front_face?
+    int object_id = 0; // 命中物体的编号
+
+    // 位置对贴图坐标的导数，由设置 u、v 的形体给出；为 0 时贴图坐标的变化范围无法求出
+    vec3 dpdu, dpdv;
+    // 由光线微分求出的相邻像素间交点位置与贴图坐标的变化，has_differentials 为 false 时无效
+    bool has_differentials = false;
+    vec3 dpdx, dpdy;
+    texture_footprint footprint;
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal :-outward_normal;
+        geometric_normal = normal;
+    }
+
+    // 相邻像素的光线与交点处的切平面求交得到 dpdx、dpdy，再按最小二乘把它们分解到 dpdu、dpdv 上得到贴图坐标的变化
+    inline void compute_differentials(const ray& r) {
+        has_differentials = false;
+        footprint = texture_footprint();
+        if (!r.has_differentials)
+            return;
+
+        auto d = dot(geometric_normal, p);
+        auto tx = (d - dot(geometric_normal, r.rx_origin)) / dot(geometric_normal, r.rx_direction);
+        auto ty = (d - dot(geometric_normal, r.ry_origin)) / dot(geometric_normal, r.ry_direction);
+        if (!std::isfinite(tx) || !std::isfinite(ty))
+            return;
+        dpdx = r.rx_origin + tx * r.rx_direction - p;
+        dpdy = r.ry_origin + ty * r.ry_direction - p;
+        has_differentials = true;
+
+        auto a00 = dot(dpdu, dpdu), a01 = dot(dpdu, dpdv), a11 = dot(dpdv, dpdv);
+        auto det = a00 * a11 - a01 * a01;
+        if (!(det > 1e-12 * a00 * a11))
+            return;
+        auto solve = [&](const vec3& dp, double& du, double& dv) {
+            auto b0 = dot(dpdu, dp), b1 = dot(dpdv, dp);
+            du = (a11 * b0 - a01 * b1) / det;
+            dv = (a00 * b1 - a01 * b0) / det;
+        };
+        solve(dpdx, footprint.dudx, footprint.dvdx);
+        solve(dpdy, footprint.dudy, footprint.dvdy);
     }
 };
 
 
 class hittable {
     public:
+        hittable() : object_id(next_object_id()) {}
+
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+        // 光源采样：从 origin 看向方向 v 时，按 random 采样得到该方向的概率密度(立体角)
+        virtual double pdf_value(const point3& origin, const vec3& v) const {
+            return 0.0;
+        }
+
+        // 光源采样：由样本值 (u1,u2) 在物体上采样一点，返回从 origin 指向该点的方向
+        virtual vec3 random(const point3& origin, double u1, double u2) const {
+            return vec3(1, 0, 0);
+        }
+
+        // 光子发射：由样本值 (u1,u2) 在表面上按面积均匀采样一点，rec 记录位置、朝外的法线、贴图坐标与材质，
+        // 返回表面积；不支持面积采样的物体返回 0
+        virtual double sample_surface(double u1, double u2, hit_record& rec) const {
+            return 0.0;
+        }
+
+        // 光源功率的估计(发光亮度 * 面积)，用于多光源时按贡献选择光源，不发光的物体为 0
+        virtual double power() const {
+            return 0.0;
+        }
+
+        // 阴影光线的求交：只与表面求交，参与介质不产生碰撞，其衰减由 transmittance 给出
+        virtual bool hit_surface(const ray& r, double t_min, double t_max, hit_record& rec) const {
+            return hit(r, t_min, t_max, rec);
+        }
+
+        // 光线在 [t_min, t_max] 上穿过参与介质的透射率(随机估计，期望为真实透射率)，不含介质的物体为 1
+        virtual double transmittance(const ray& r, double t_min, double t_max) const {
+            return 1.0;
+        }
+
+        // 是否含有参与介质；不含时 hit_surface 与 hit 相同，transmittance 为 1
+        virtual bool has_media() const {
+            return false;
+        }
+
+    public:
+        // 物体编号，用于 object ID 输出。基本形体命中时写入 hit_record，
+        // 平移、旋转、盒子等组合物体命中后用自己的编号覆盖，一个模型整体只有一个编号
+        int object_id;
+
+    protected:
+        // 三角面、BVH 节点与物体列表只作为模型或场景的组成部分，数量很多且编号总被外层物体覆盖，构造时不占用编号(为 0)
+        struct unnumbered {};
+        explicit hittable(unnumbered) : object_id(0) {}
+
+    private:
+        static int next_object_id() {
+            static std::atomic<int> counter(0);
+            return ++counter;
+        }
 };
 
 
@@ -53,6 +149,38 @@ class translate : public hittable {
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual double pdf_value(const point3& origin, const vec3& v) const override {
+            return ptr->pdf_value(origin - offset, v);
+        }
+
+        virtual vec3 random(const point3& origin, double u1, double u2) const override {
+            return ptr->random(origin - offset, u1, u2);
+        }
+
+        virtual double sample_surface(double u1, double u2, hit_record& rec) const override {
+            auto area = ptr->sample_surface(u1, u2, rec);
+            rec.p += offset;
+            return area;
+        }
+
+        virtual double power() const override {
+            return ptr->power();
+        }
+
+        virtual bool hit_surface(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            return ptr->transmittance(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+        }
+
+        virtual bool has_media() const override {
+            return ptr->has_media();
+        }
+
+    private:
+        // 命中后把交点从物体坐标变回世界坐标
+        void transform_record(const ray& moved_r, hit_record& rec) const;
+
     public:
         shared_ptr<hittable> ptr;
         vec3 offset;
@@ -64,13 +192,33 @@ bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
     if (!ptr->hit(moved_r, t_min, t_max, rec))
         return false;
 
-    rec.p += offset;
-    rec.set_face_normal(moved_r, rec.normal);
+    transform_record(moved_r, rec);
+    return true;
+}
+
+
+bool translate::hit_surface(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (!ptr->has_media())
+        return hit(r, t_min, t_max, rec);
+
+    ray moved_r(r.origin() - offset, r.direction(), r.time());
+    if (!ptr->hit_surface(moved_r, t_min, t_max, rec))
+        return false;
 
+    transform_record(moved_r, rec);
     return true;
 }
 
 
+void translate::transform_record(const ray& moved_r, hit_record& rec) const {
+    rec.p += offset;
+    auto geometric_normal = rec.geometric_normal;
+    rec.set_face_normal(moved_r, rec.normal);
+    rec.geometric_normal = geometric_normal;
+    rec.object_id = object_id;
+}
+
+
 bool translate::bounding_box(double time0, double time1, aabb& output_box) const {
     if (!ptr->bounding_box(time0, time1, output_box))
         return false;
@@ -95,6 +243,48 @@ class rotate_y : public hittable {
             return hasbox;
         }
 
+        virtual double pdf_value(const point3& origin, const vec3& v) const override {
+            return ptr->pdf_value(to_local(origin), to_local(v));
+        }
+
+        virtual vec3 random(const point3& origin, double u1, double u2) const override {
+            return to_world(ptr->random(to_local(origin), u1, u2));
+        }
+
+        virtual double sample_surface(double u1, double u2, hit_record& rec) const override {
+            auto area = ptr->sample_surface(u1, u2, rec);
+            rec.p = to_world(rec.p);
+            rec.normal = to_world(rec.normal);
+            return area;
+        }
+
+        virtual double power() const override {
+            return ptr->power();
+        }
+
+        virtual bool hit_surface(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            return ptr->transmittance(ray(to_local(r.origin()), to_local(r.direction()), r.time()), t_min, t_max);
+        }
+
+        virtual bool has_media() const override {
+            return ptr->has_media();
+        }
+
+        // 世界坐标与物体坐标之间绕 y 轴的旋转
+        vec3 to_local(const vec3& p) const {
+            return vec3(cos_theta*p[0] - sin_theta*p[2], p[1], sin_theta*p[0] + cos_theta*p[2]);
+        }
+
+        vec3 to_world(const vec3& p) const {
+            return vec3(cos_theta*p[0] + sin_theta*p[2], p[1], -sin_theta*p[0] + cos_theta*p[2]);
+        }
+
+    private:
+        // 命中后把交点从物体坐标变回世界坐标
+        void transform_record(const ray& rotated_r, hit_record& rec) const;
+
     public:
         shared_ptr<hittable> ptr;
         double sin_theta;
@@ -138,33 +328,38 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 
 
 bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    auto origin = r.origin();
-    auto direction = r.direction();
+    ray rotated_r(to_local(r.origin()), to_local(r.direction()), r.time());
+    if (!ptr->hit(rotated_r, t_min, t_max, rec))
+        return false;
 
-    origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
-    origin[2] = sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
+    transform_record(rotated_r, rec);
+    return true;
+}
 
-    direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
-    direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
+bool rotate_y::hit_surface(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (!ptr->has_media())
+        return hit(r, t_min, t_max, rec);
 
-    if (!ptr->hit(rotated_r, t_min, t_max, rec))
+    ray rotated_r(to_local(r.origin()), to_local(r.direction()), r.time());
+    if (!ptr->hit_surface(rotated_r, t_min, t_max, rec))
         return false;
 
-    auto p = rec.p;
-    auto normal = rec.normal;
+    transform_record(rotated_r, rec);
+    return true;
+}
 
-    p[0] =  cos_theta*rec.p[0] + sin_theta*rec.p[2];
-    p[2] = -sin_theta*rec.p[0] + cos_theta*rec.p[2];
 
-    normal[0] =  cos_theta*rec.normal[0] + sin_theta*rec.normal[2];
-    normal[2] = -sin_theta*rec.normal[0] + cos_theta*rec.normal[2];
+void rotate_y::transform_record(const ray& rotated_r, hit_record& rec) const {
+    auto normal = to_world(rec.normal);
+    auto geometric_normal = to_world(rec.geometric_normal);
 
-    rec.p = p;
+    rec.p = to_world(rec.p);
+    rec.dpdu = to_world(rec.dpdu);
+    rec.dpdv = to_world(rec.dpdv);
     rec.set_face_normal(rotated_r, normal);
-
-    return true;
+    rec.geometric_normal = dot(geometric_normal, rec.normal) < 0 ? -geometric_normal : geometric_normal;
+    rec.object_id = object_id;
 }
 
 
@@ -15,25 +15,60 @@
 
 #include "hittable.h"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
 
 class hittable_list : public hittable  {
     public:
-        hittable_list() {}
-        hittable_list(shared_ptr<hittable> object) { add(object); }
+        hittable_list() : hittable(unnumbered()) {}
+        hittable_list(shared_ptr<hittable> object) : hittable(unnumbered()) { add(object); }
 
-        void clear() { objects.clear(); }
-        void add(shared_ptr<hittable> object) { objects.push_back(object); }
+        void clear() { objects.clear(); media = false; }
+        void add(shared_ptr<hittable> object) {
+            objects.push_back(object);
+            media = media || object->has_media();
+        }
 
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        // 作为光源列表时，均匀选择其中一个光源采样，概率密度为各光源的平均
+        virtual double pdf_value(const point3& origin, const vec3& v) const override;
+
+        virtual vec3 random(const point3& origin, double u1, double u2) const override;
+
+        virtual double power() const override {
+            auto sum = 0.0;
+            for (const auto& object : objects)
+                sum += object->power();
+            return sum;
+        }
+
+        virtual bool hit_surface(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            auto result = 1.0;
+            for (const auto& object : objects)
+                if (object->has_media())
+                    result *= object->transmittance(r, t_min, t_max);
+            return result;
+        }
+
+        // 在 add 时记录，每条阴影光线都会查询，不再遍历所有物体
+        virtual bool has_media() const override {
+            return media;
+        }
+
     public:
         std::vector<shared_ptr<hittable>> objects;
+
+    private:
+        bool media = false; // 是否有物体含有介质
 };
 
 
@@ -54,6 +89,23 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 }
 
 
+bool hittable_list::hit_surface(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    hit_record temp_rec;
+    auto hit_anything = false;
+    auto closest_so_far = t_max;
+
+    for (const auto& object : objects) {
+        if (object->hit_surface(r, t_min, closest_so_far, temp_rec)) {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            rec = temp_rec;
+        }
+    }
+
+    return hit_anything;
+}
+
+
 bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const {
     if (objects.empty()) return false;
 
@@ -70,4 +122,25 @@ bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) c
 }
 
 
+double hittable_list::pdf_value(const point3& origin, const vec3& v) const {
+    if (objects.empty())
+        return 0.0;
+
+    auto sum = 0.0;
+    for (const auto& object : objects)
+        sum += object->pdf_value(origin, v);
+
+    return sum / objects.size();
+}
+
+
+vec3 hittable_list::random(const point3& origin, double u1, double u2) const {
+    // 用 u1 的整数部分选光源，小数部分重新拉伸到 [0,1) 继续使用，保留分层性
+    auto n = objects.size();
+    auto scaled = u1 * n;
+    auto index = std::min(static_cast<size_t>(scaled), n - 1);
+    return objects[index]->random(origin, fmin(scaled - index, 0.99999999), u2);
+}
+
+
 #endif
@@ -0,0 +1,285 @@
+//
+// Created by Qiuzhe on 2021/6/22.
+//
+
+#ifndef RTWEEKEND_INTEGRATOR_H
+#define RTWEEKEND_INTEGRATOR_H
+
+#include "rtweekend.h"
+
+#include "environment.h"
+#include "guiding.h"
+#include "hittable.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "photon_map.h"
+#include "radiance_cache.h"
+#include "sampler.h"
+
+// 从第几次弹射开始进行俄罗斯轮盘赌
+const int russian_roulette_depth = 3;
+// throughput 低于该值的路径参与轮盘赌，存活后权重提升回该值
+const double russian_roulette_threshold = 0.1;
+
+inline double max_component(const color& c) {
+    return fmax(c.x(), fmax(c.y(), c.z()));
+}
+
+// 多重重要性采样的 power heuristic
+inline double power_heuristic(double pdf_a, double pdf_b) {
+    auto a2 = pdf_a * pdf_a;
+    auto b2 = pdf_b * pdf_b;
+    return a2 + b2 > 0 ? a2 / (a2 + b2) : 0;
+}
+
+// 光源采样时选择环境光的概率，其余概率分给光源列表
+inline double environment_selection_probability(const environment &env, const light_bvh &lights) {
+    if (!env.importance_sampled())
+        return 0;
+    return lights.empty() ? 1.0 : 0.5;
+}
+
+inline bool has_light_sampling(const environment &env, const light_bvh &lights) {
+    return env.importance_sampled() || !lights.empty();
+}
+
+// 光源采样(环境光与光源列表的混合分布)得到方向 direction 的概率密度
+inline double light_pdf(const environment &env, const light_bvh &lights, const point3 &origin, const vec3 &direction) {
+    auto p_env = environment_selection_probability(env, lights);
+    auto pdf = 0.0;
+    if (p_env > 0)
+        pdf += p_env * env.pdf(direction);
+    if (p_env < 1)
+        pdf += (1 - p_env) * lights.pdf_value(origin, direction);
+    return pdf;
+}
+
+// 光源采样的前半部分：在环境光或光源上采样方向 direction，weight 为 BSDF * MIS 权重 / pdf，
+// 即阴影光线带回的入射光之外的部分；没有贡献时返回 false。
+// mis 为 false 时路径在该顶点结束，BSDF 采样的光线不会再求交，光源采样的权重取 1
+inline bool sample_light_direction(
+        const ray &r, const hit_record &rec, const environment &env, const light_bvh &lights,
+        sampler &smp, vec3 &direction, color &weight, const guided_bsdf *guided = nullptr, bool mis = true) {
+    auto p_env = environment_selection_probability(env, lights);
+    auto u = smp.get_1d();
+    auto xi = smp.get_2d();
+    direction = u < p_env ? env.sample(u / p_env, xi.x(), xi.y())
+                          : lights.random(rec.p, xi.x(), xi.y());
+    auto pdf = light_pdf(env, lights, rec.p, direction);
+    if (pdf <= 0)
+        return false;
+
+    auto f = rec.mat_ptr->eval(r, rec, direction);
+    if (max_component(f) <= 0)
+        return false;
+
+    if (!mis) {
+        weight = f / pdf;
+        return true;
+    }
+    auto bsdf_pdf = guided ? guided->pdf(r, rec, direction) : rec.mat_ptr->pdf(r, rec, direction);
+    weight = f * (power_heuristic(pdf, bsdf_pdf) / pdf);
+    return true;
+}
+
+// 阴影光线命中的第一个表面的发光值，未命中时为环境光；
+// 参与介质不遮挡阴影光线，乘上光线到该表面为止穿过介质的透射率
+inline color shadow_incoming(const ray &shadow, const environment &env, const hittable &world) {
+    hit_record light_rec;
+    auto hit = world.hit_surface(shadow, 0.001, infinity, light_rec);
+    auto incoming = hit ? light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p) : env.value(shadow);
+    if (max_component(incoming) <= 0 || !world.has_media())
+        return incoming;
+    return incoming * world.transmittance(shadow, 0.001, hit ? light_rec.t : infinity);
+}
+
+color sample_lights(
+        const ray &r, const hit_record &rec, const environment &env, const hittable &world,
+        const light_bvh &lights, sampler &smp, const guided_bsdf *guided = nullptr, bool mis = true) {
+    /***************
+    光源采样(next-event estimation)：在环境光或光源上采样一个方向并发出阴影光线，
+    阴影光线命中的第一个物体的发光值(未命中时为环境光)即可见性与光照的乘积，再与 BSDF 采样做 MIS；
+    给出 guided 时 BSDF 采样一侧的 pdf 为与引导分布的混合
+    ***************/
+    vec3 direction;
+    color weight;
+    if (!sample_light_direction(r, rec, env, lights, smp, direction, weight, guided, mis))
+        return color(0, 0, 0);
+    return weight * shadow_incoming(ray(rec.p, direction, r.time()), env, world);
+}
+
+struct path_features {
+    /******************************
+        路径的附加输出，用于降噪与 AOV。
+        albedo/normal 为沿镜面反射/折射链到达的第一个非镜面顶点的反照率与法线：直接看到的环境光以其颜色为反照率；
+        经过镜面链后命中光源或射向环境光时反照率为镜面链的衰减，此时看到的环境光随菲涅尔选择的分支变化，作为噪声交给滤波。
+        depth/material_id/object_id 取相机光线的第一个交点，未命中时为 0。
+        direct 为经过至多一次非镜面散射到达相机的光照(包括直接看到的光源与环境光)，其余为间接光照
+    ******************************/
+    color albedo = color(1, 1, 1);
+    vec3 normal = vec3(0, 0, 0);
+    double depth = 0;
+    int material_id = 0;
+    int object_id = 0;
+    color direct = color(0, 0, 0);
+};
+
+color ray_color(
+        const ray &r_in, const environment &env, const hittable &world, const light_bvh &lights,
+        int max_depth, sampler &smp, path_features *features = nullptr, const photon_map *caustics = nullptr,
+        const radiance_cache *cache = nullptr, std::vector<cache_vertex> *cache_path = nullptr,
+        path_guide *guide = nullptr) {
+    /***************
+    迭代形式的路径追踪：throughput 记录路径到当前顶点的累计衰减，
+    超过 russian_roulette_depth 后按 throughput 的大小随机终止路径并补偿权重，保持无偏。
+    室外场景的镜面路径大多很快射向天空，只对低 throughput 的路径做轮盘赌，避免引入额外噪声。
+    非镜面顶点上同时做光源采样，BSDF 采样命中光源或射向环境光时按 MIS 权重计入。
+    给出焦散光子图时，在第一个非镜面顶点上加入光子图的焦散估计，
+    从该顶点出发经镜面链命中光源或射向环境光的贡献不再计入，避免重复。
+    给出辐射缓存时，路径在 cache->terminate_depth() 次非镜面散射之后的顶点上做完光源采样，以缓存的间接光照结束；
+    给出 cache_path 时记录每个非镜面顶点，用于填充缓存。
+    给出路径引导时，非镜面顶点的散射方向按 BSDF 与引导分布的混合采样(单样本 MIS)，
+    路径结束后把各顶点沿采样方向的入射亮度记录到引导结构中
+    ***************/
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray r = r_in;
+    point3 prev_p;
+    double prev_pdf = 0; // 上一次 BSDF 采样的 pdf，0 表示镜面或相机光线
+    bool light_sampling = has_light_sampling(env, lights);
+    int diffuse_vertices = 0; // 已经过的非镜面顶点数
+    bool surface_recorded = false; // 是否已记录第一个非镜面顶点的特征
+
+    // 引导顶点：空间叶子、采样方向与 pdf、离开该顶点时的 throughput 与此前累计的亮度
+    struct guide_vertex {
+        int leaf;
+        vec3 direction;
+        double pdf;
+        color throughput;
+        color radiance;
+    };
+    std::vector<guide_vertex> guide_path;
+
+    // 累加一项贡献，同时按是否为直接光照分别记录
+    auto add = [&](const color &contribution, bool direct) {
+        radiance += contribution;
+        if (features && direct)
+            features->direct += contribution;
+    };
+
+    for (int depth = 0; depth < max_depth; ++depth) {
+        hit_record rec;
+        // 第一个非镜面顶点之后全部为镜面散射，到达光源的这部分光照已由光子图估计
+        bool photon_mapped = caustics && diffuse_vertices == 1 && prev_pdf == 0;
+
+        // 如果光线啥都没碰到，从背景或天空盒中取颜色
+        if (!world.hit(r, 0.001, infinity, rec)) {
+            auto background = env.value(r);
+            if (features && !surface_recorded)
+                features->albedo = depth == 0 ? clamp(background, 0.0, 1.0) : clamp(throughput, 0.0, 1.0);
+            if (prev_pdf > 0 && env.importance_sampled())
+                background *= power_heuristic(prev_pdf, light_pdf(env, lights, prev_p, r.direction()));
+            if (!(photon_mapped && caustics->emits_environment()))
+                add(throughput * background, diffuse_vertices <= 1);
+            break;
+        }
+
+        // 相机光线与镜面链上的光线带有微分，用于贴图滤波
+        rec.compute_differentials(r);
+
+        if (features && depth == 0) {
+            features->depth = rec.t * r.direction().length();
+            features->material_id = rec.mat_ptr->id;
+            features->object_id = rec.object_id;
+        }
+
+        // 光子只从光源列表中的发光物体发射，列表之外的发光物体经镜面链的贡献仍由路径计入
+        if (rec.mat_ptr->emissive() && !(photon_mapped && caustics->emits_lights() && lights.emits(rec.mat_ptr.get()))) {
+            auto emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p, rec.footprint);
+            if (prev_pdf > 0 && light_sampling)
+                emitted *= power_heuristic(prev_pdf, light_pdf(env, lights, prev_p, r.direction()));
+            add(throughput * emitted, diffuse_vertices <= 1);
+        }
+
+        // 如果碰撞到的物体不会再进行散射，路径结束
+        ray scattered;
+        color attenuation;
+        if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered, smp)) {
+            if (features && !surface_recorded)
+                features->normal = rec.normal;
+            break;
+        }
+
+        prev_pdf = rec.mat_ptr->pdf(r, rec, scattered.direction());
+        prev_p = rec.p;
+        guided_bsdf guided;
+        int guide_leaf = -1;
+        if (guide && prev_pdf > 0) {
+            guide_leaf = guide->leaf(rec.p);
+            guided = guide->bsdf(guide_leaf);
+        }
+        if (prev_pdf > 0) {
+            if (features && !surface_recorded) {
+                features->albedo = clamp(throughput * attenuation, 0.0, 1.0);
+                features->normal = rec.normal;
+                surface_recorded = true;
+            }
+            if (light_sampling)
+                // 最后一次弹射之后不再求交，BSDF 采样一侧命中光源的部分不会被计入，光源采样不做 MIS
+                add(throughput * sample_lights(r, rec, env, world, lights, smp, &guided, depth + 1 < max_depth),
+                    diffuse_vertices == 0);
+            if (caustics && diffuse_vertices == 0)
+                add(throughput * caustics->estimate(r, rec), true);
+            if (cache_path)
+                cache_path->push_back(cache_vertex{rec.p, rec.normal, rec.mat_ptr->id, throughput, radiance});
+            color cached;
+            if (cache && diffuse_vertices >= cache->terminate_depth() && cache->lookup(rec, cached)) {
+                add(throughput * cached, false);
+                break;
+            }
+            diffuse_vertices += 1;
+        }
+
+        // 按混合分布重新选择方向：两个分支都消耗相同的采样维度
+        if (guided.tree) {
+            auto u = smp.get_1d();
+            auto xi = smp.get_2d();
+            if (u < guided.fraction)
+                scattered = ray(rec.p, guided.tree->sample(xi.x(), xi.y()), r.time());
+            prev_pdf = guided.pdf(r, rec, scattered.direction());
+            if (prev_pdf <= 0)
+                break;
+            attenuation = rec.mat_ptr->eval(r, rec, scattered.direction()) / prev_pdf;
+            // 引导分布采样到表面另一侧的方向时路径没有贡献
+            if (max_component(attenuation) <= 0)
+                break;
+        }
+        if (guide_leaf >= 0)
+            guide_path.push_back(guide_vertex{guide_leaf, scattered.direction(), prev_pdf, color(0, 0, 0), radiance});
+
+        throughput = throughput * attenuation;
+
+        if (depth + 1 >= russian_roulette_depth) {
+            auto survive = fmin(max_component(throughput) / russian_roulette_threshold, 1.0);
+            if (smp.get_1d() >= survive)
+                break;
+            throughput /= survive;
+        }
+        if (guide_leaf >= 0)
+            guide_path.back().throughput = throughput;
+
+        r = scattered;
+    }
+
+    // 顶点之后累计的亮度按通道除以离开该顶点时的 throughput，即沿采样方向的入射亮度
+    for (const auto &v : guide_path) {
+        color incident;
+        for (int k = 0; k < 3; ++k)
+            incident[k] = v.throughput[k] > 0 ? (radiance[k] - v.radiance[k]) / v.throughput[k] : 0;
+        guide->record(v.leaf, v.direction, luminance(incident) / v.pdf);
+    }
+
+    return radiance;
+}
+
+#endif //RTWEEKEND_INTEGRATOR_H
@@ -0,0 +1,231 @@
+//
+// Created by Qiuzhe on 2021/6/23.
+//
+
+#ifndef RTWEEKEND_LIGHT_BVH_H
+#define RTWEEKEND_LIGHT_BVH_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+
+class light_bvh {
+    /******************************
+        光源层次包围盒：在所有发光物体上建立二叉树，每个节点记录包围盒与总功率。
+        采样时从根节点出发，按 功率/距离^2 估计左右子树对着色点的贡献，按比例随机下降到叶子，
+        选择一个光源的代价为 O(log n)；该光源被选中的概率为路径上各次选择概率之积。
+    ******************************/
+    public:
+        light_bvh() {}
+
+        light_bvh(const hittable_list& list) {
+            for (const auto& object : list.objects) {
+                aabb box;
+                auto p = object->power();
+                if (p <= 0 || !object->bounding_box(0, 1, box))
+                    continue;
+                lights.push_back(object);
+                boxes.push_back(box);
+                powers.push_back(p);
+
+                // 记录可以发射光路的光源的材质，用于判断路径命中的发光物体是否在光源列表中
+                hit_record rec;
+                if (object->sample_surface(0.5, 0.5, rec) > 0 && rec.mat_ptr)
+                    emitters.insert(rec.mat_ptr.get());
+            }
+            if (lights.empty())
+                return;
+            power_distribution = alias_table(powers);
+            for (auto p : powers)
+                total_power += p;
+
+            std::vector<int> indices(lights.size());
+            for (size_t i = 0; i < indices.size(); ++i)
+                indices[i] = static_cast<int>(i);
+            nodes.reserve(2 * lights.size());
+            build(indices, 0, indices.size());
+        }
+
+        bool empty() const {
+            return lights.empty();
+        }
+
+        size_t size() const {
+            return lights.size();
+        }
+
+        const shared_ptr<hittable>& light(int index) const {
+            return lights[index];
+        }
+
+        // 在 origin 处按贡献选择一个光源，返回其下标，pmf 为被选中的概率；u 被重新拉伸到 [0,1) 可以继续使用
+        int sample(const point3& origin, double& u, double& pmf) const {
+            int index = 0;
+            pmf = 1.0;
+            while (nodes[index].light < 0) {
+                auto p_left = left_probability(nodes[index], origin);
+                if (u < p_left) {
+                    u = fmin(u / p_left, 0.99999999);
+                    pmf *= p_left;
+                    index = nodes[index].left;
+                } else {
+                    u = fmin((u - p_left) / (1 - p_left), 0.99999999);
+                    pmf *= 1 - p_left;
+                    index = nodes[index].right;
+                }
+            }
+            return nodes[index].light;
+        }
+
+        // 与着色点无关，按功率选择一个光源，用于光子发射；u 被重新拉伸到 [0,1) 可以继续使用
+        int sample_power(double& u, double& pmf) const {
+            double remapped;
+            int index = power_distribution.sample(u, remapped);
+            u = remapped;
+            pmf = power_distribution.probability(index);
+            return index;
+        }
+
+        // 光子与光路的发射：按功率选择光源，由 xi_position 在其表面按面积均匀采样一点 rec，
+        // 再以 1/2 的概率选择一侧，由 xi_direction 做余弦加权采样得到方向 direction。
+        // pdf_area 为该点的面积概率密度(含选择光源的概率)，pdf_direction 为方向的立体角概率密度；没有可发射的光时返回 false
+        bool sample_emission(double u, const vec3& xi_position, const vec3& xi_direction, hit_record& rec,
+                             vec3& direction, double& pdf_area, double& pdf_direction) const {
+            if (lights.empty())
+                return false;
+            double pmf;
+            const auto& light = lights[sample_power(u, pmf)];
+            auto area = light->sample_surface(xi_position.x(), xi_position.y(), rec);
+            if (area <= 0)
+                return false;
+            rec.geometric_normal = rec.normal;
+
+            direction = local_to_world(u < 0.5 ? rec.normal : -rec.normal,
+                                       sample_cosine_hemisphere(xi_direction.x(), xi_direction.y()));
+            // 与路径追踪一致：只有从该方向射来的光线能命中光源时(如三角形只有正面)，光源才向该方向发光
+            auto eps = 1e-4 * fmax(1.0, rec.p.length());
+            hit_record check;
+            if (!light->hit(ray(rec.p + eps * direction, -direction), 0.5 * eps, 1.5 * eps, check))
+                return false;
+
+            pdf_area = pmf / area;
+            pdf_direction = emission_direction_pdf(rec.normal, direction);
+            return true;
+        }
+
+        // 材质为 m 的发光物体是否在光源列表中，可以由 sample_emission 采样到
+        bool emits(const material* m) const {
+            return emitters.count(m) > 0;
+        }
+
+        // sample_emission 采样到材质为 m、发光亮度为 emitted 的光源上一点的面积概率密度，要求光源的发光亮度在表面上均匀；
+        // 发光物体不在光源列表中(sample_emission 不可能采样到)时为 0
+        double emission_pdf(const material* m, const color& emitted) const {
+            if (total_power <= 0 || !emits(m))
+                return 0.0;
+            return luminance(emitted) / total_power;
+        }
+
+        // sample_emission 在法线为 normal 的点上采样到方向 direction 的概率密度(立体角)
+        static double emission_direction_pdf(const vec3& normal, const vec3& direction) {
+            return 0.5 * fabs(dot(normal, unit_vector(direction))) / pi;
+        }
+
+        // 选择一个光源，再由 (u1,u2) 在该光源上采样，返回从 origin 指向采样点的方向
+        vec3 random(const point3& origin, double u1, double u2) const {
+            double pmf;
+            int index = sample(origin, u1, pmf);
+            return lights[index]->random(origin, u1, u2);
+        }
+
+        // 按 random 采样得到方向 v 的概率密度(立体角)，只访问光线穿过的节点
+        double pdf_value(const point3& origin, const vec3& v) const {
+            if (lights.empty())
+                return 0.0;
+            return pdf_value(0, ray(origin, v), 1.0);
+        }
+
+    private:
+        struct node {
+            aabb box;
+            double power = 0;
+            int left = -1;
+            int right = -1;
+            int light = -1; // 叶子节点对应的光源下标，内部节点为 -1
+        };
+
+        int build(std::vector<int>& indices, size_t start, size_t end) {
+            int index = static_cast<int>(nodes.size());
+            nodes.emplace_back();
+
+            if (end - start == 1) {
+                nodes[index].box = boxes[indices[start]];
+                nodes[index].power = powers[indices[start]];
+                nodes[index].light = indices[start];
+                return index;
+            }
+
+            // 按包围盒中心所在范围的最长轴从中间划分
+            aabb centroids(center(boxes[indices[start]]), center(boxes[indices[start]]));
+            for (auto i = start + 1; i < end; ++i)
+                centroids = surrounding_box(centroids, aabb(center(boxes[indices[i]]), center(boxes[indices[i]])));
+            int axis = centroids.longest_axis();
+            auto mid = start + (end - start) / 2;
+            std::nth_element(indices.begin() + start, indices.begin() + mid, indices.begin() + end,
+                             [&](int a, int b) { return center(boxes[a])[axis] < center(boxes[b])[axis]; });
+
+            int left = build(indices, start, mid);
+            int right = build(indices, mid, end);
+            nodes[index].left = left;
+            nodes[index].right = right;
+            nodes[index].box = surrounding_box(nodes[left].box, nodes[right].box);
+            nodes[index].power = nodes[left].power + nodes[right].power;
+            return index;
+        }
+
+        static point3 center(const aabb& box) {
+            return 0.5 * (box.min() + box.max());
+        }
+
+        // 节点对 p 的贡献估计：功率除以到包围盒中心距离的平方，p 靠近或位于包围盒内时用包围盒半径代替距离
+        static double importance(const node& n, const point3& p) {
+            auto distance_squared = (center(n.box) - p).length_squared();
+            auto radius_squared = 0.25 * (n.box.max() - n.box.min()).length_squared();
+            return n.power / fmax(distance_squared, radius_squared);
+        }
+
+        double left_probability(const node& n, const point3& p) const {
+            auto left = importance(nodes[n.left], p);
+            auto right = importance(nodes[n.right], p);
+            return left + right > 0 ? left / (left + right) : 0.5;
+        }
+
+        double pdf_value(int index, const ray& r, double pmf) const {
+            const auto& n = nodes[index];
+            if (pmf <= 0 || !n.box.hit(r, 0.001, infinity))
+                return 0.0;
+            if (n.light >= 0)
+                return pmf * lights[n.light]->pdf_value(r.origin(), r.direction());
+
+            auto p_left = left_probability(n, r.origin());
+            return pdf_value(n.left, r, pmf * p_left) + pdf_value(n.right, r, pmf * (1 - p_left));
+        }
+
+    private:
+        std::vector<shared_ptr<hittable>> lights;
+        std::vector<aabb> boxes;
+        std::vector<double> powers;
+        alias_table power_distribution;
+        double total_power = 0;
+        std::unordered_set<const material*> emitters; // 光源列表中可以发射光路的光源的材质
+        std::vector<node> nodes;
+};
+
+#endif //RTWEEKEND_LIGHT_BVH_H
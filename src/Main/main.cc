@@ -11,91 +11,56 @@
 
 #include "rtweekend.h"
 
+#include "asset_registry.h"
 #include "box.h"
 #include "bvh.h"
 #include "camera.h"
 #include "color.h"
 #include "constant_medium.h"
+#include "heterogeneous_medium.h"
+#include "sparse_volume.h"
 #include "hittable_list.h"
+#include "adaptive.h"
+#include "aov.h"
+#include "bdpt.h"
+#include "progressive.h"
+#include "denoiser.h"
+#include "integrator.h"
+#include "light_bvh.h"
+#include "photon_map.h"
+#include "restir.h"
+#include "wavefront.h"
 #include "material.h"
 #include "moving_sphere.h"
 #include "sphere.h"
 #include "texture.h"
 #include "mesh_triangle.h"
+#include "sampler.h"
 #include "skybox.h"
 #include <omp.h>
 #include "opencv4/opencv2/opencv.hpp"
 #include <boost/timer.hpp>
 
+#include <fstream>
 #include <iostream>
+#include <random>
 #include <unistd.h>
 
-sky_box make_sky_box() {
+shared_ptr<sky_box> make_sky_box() {
     /***************
     生成天空盒
     ***************/
 
     // 读取天空盒6面
-    auto front = make_shared<sky>(make_shared<image_texture>("../models/skybox/front.png"));
-    auto back = make_shared<sky>(make_shared<image_texture>("../models/skybox/back.png"));
-    auto left = make_shared<sky>(make_shared<image_texture>("../models/skybox/left.png"));
-    auto right = make_shared<sky>(make_shared<image_texture>("../models/skybox/right.png"));
-    auto top = make_shared<sky>(make_shared<image_texture>("../models/skybox/top.png"));
-    auto bottom = make_shared<sky>(make_shared<image_texture>("../models/skybox/bottom.png"));
+    auto front = make_shared<sky>(load_texture("../models/skybox/front.png"));
+    auto back = make_shared<sky>(load_texture("../models/skybox/back.png"));
+    auto left = make_shared<sky>(load_texture("../models/skybox/left.png"));
+    auto right = make_shared<sky>(load_texture("../models/skybox/right.png"));
+    auto top = make_shared<sky>(load_texture("../models/skybox/top.png"));
+    auto bottom = make_shared<sky>(load_texture("../models/skybox/bottom.png"));
 
     // 返回天空盒
-    return sky_box({back, front, top, bottom, right, left});
-}
-
-color ray_color(const ray &r, const color &background, const hittable &world, int depth) {
-    hit_record rec;
-
-    // 如果达到了最大碰撞深度，不再进行碰撞
-    if (depth <= 0)
-        return color(0, 0, 0);
-
-    // 如果光线啥都没碰到，从背景中取颜色
-    if (!world.hit(r, 0.001, infinity, rec))
-        return background;
-
-    ray scattered;
-    color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-
-    // 如果碰撞到的物体不会再进行散射，则直接返回其光照值
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
-
-    // 返回照度与后续照度的叠加
-    return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
-}
-
-color ray_color_sky_box(const ray &r, const hittable &sky_box, const hittable &world, int depth) {
-    hit_record rec;
-
-    // 如果达到了最大碰撞深度，不再进行碰撞
-    if (depth <= 0)
-        return color(0, 0, 0);
-
-    // 如果光线啥都没碰到，从天空盒中取颜色
-    if (!world.hit(r, 0.001, infinity, rec)) {
-        ray r_t(r);
-        r_t.orig = {0, 0, 0};
-        sky_box.hit(r_t, 0.001, infinity, rec);
-        auto back = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-        return back;
-    }
-
-    ray scattered;
-    color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-
-    // 如果碰撞到的物体不会再进行散射，则直接返回其光照值
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
-
-    // 返回照度与后续照度的叠加
-    return emitted + attenuation * ray_color_sky_box(scattered, sky_box, world, depth - 1);
+    return make_shared<sky_box>(std::array<shared_ptr<material>, 6>{back, front, top, bottom, right, left});
 }
 
 
@@ -104,7 +69,7 @@ hittable_list my_scene1() {
 
     // 创建贴图材质
     auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    auto spot_texture = make_shared<image_texture>("../models/spot_texture.png");
+    auto spot_texture = load_texture("../models/spot_texture.png");
     auto perlin_texture = make_shared<perlin_brdf_texture>(4);
     auto material = make_shared<BRDF>(perlin_texture);
     auto metal_m = make_shared<metal>(color(0.8, 0.8, 0.9), 0.2);
@@ -116,18 +81,18 @@ hittable_list my_scene1() {
 
     // 创建透明兔子
     objects.add(
-            read_obj_model_triangle("../models/bunny4.obj", make_shared<dielectric>(1.5), vec3(4, 0, 0), vec3(0, 0, 0),
-                                    vec3(0.4, 0.4, 0.4)));
+            load_mesh("../models/bunny4.obj", make_shared<dielectric>(1.5), vec3(4, 0, 0), vec3(0, 0, 0),
+                      vec3(0.4, 0.4, 0.4)));
     // 创建地板
     objects.add(make_shared<xz_rect>(-30, 30, -30, 30, 0, make_shared<metal>(color(0.6, 0.6, 0.6), 0.)));
 
     // 创建龙
-    objects.add(read_obj_model_triangle("../models/dragon2.obj", material, vec3(-0.5, 0, -3), vec3(0, 80, 0),
-                                        vec3(0.5, 0.5, 0.5)));
+    objects.add(load_mesh("../models/dragon2.obj", material, vec3(-0.5, 0, -3), vec3(0, 80, 0),
+                          vec3(0.5, 0.5, 0.5)));
 
     // 创建牛
-    objects.add(read_obj_model_triangle("../models/spot_triangulated_good.obj", make_shared<lambertian>(spot_texture),
-                                        vec3(0, 1, 5), vec3(0, -60, 0), vec3(1.5, 1.5, 1.5)));
+    objects.add(load_mesh("../models/spot_triangulated_good.obj", make_shared<lambertian>(spot_texture),
+                          vec3(0, 1, 5), vec3(0, -60, 0), vec3(1.5, 1.5, 1.5)));
     return hittable_list(make_shared<bvh_node>(objects, 0.0, 1.0));
 }
 
@@ -141,34 +106,34 @@ hittable_list my_scene2() {
     auto metal_tex = make_shared<metal>(color(0.8, 0.8, 0.9), 0.0);
     auto perlin_mat = make_shared<perlin_brdf_texture>(4);
     auto perlin_tex = make_shared<BRDF>(perlin_mat);
-    auto colorspot_tex = make_shared<image_texture>("../models/spot_texture.png");
+    auto colorspot_tex = load_texture("../models/spot_texture.png");
     auto die_tex = make_shared<dielectric>(1.5);
 
     //floor
     objects.add(make_shared<xz_rect>(-30, 30, -30, 30, 0, make_shared<lambertian>(checker_tex)));
     //objects
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/Rabbit.obj",
             metal_tex,
             vec3(1.5, 0, 2.5),
             vec3(0, 120, 0),
             vec3(1, 1, 1)));
 
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/Dog2.obj",
             perlin_tex,
             vec3(1, 0, 0.5),
             vec3(0, 60, 0),
             vec3(0.2, 0.2, 0.2)));
 
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/spot_triangulated_good.obj",
             make_shared<lambertian>(colorspot_tex),
             vec3(2, 1, -2.5),
             vec3(0, -120, 0),
             vec3(1.2, 1.2, 1.2)));
 
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/SeaUrchin2.obj",
             die_tex,
             vec3(5, 0, 0),
@@ -189,34 +154,34 @@ hittable_list my_scene3() {
     auto metal_tex = make_shared<metal>(color(0.8, 0.8, 0.9), 0.0);
     auto perlin_mat = make_shared<perlin_brdf_texture>(4);
     auto perlin_tex = make_shared<BRDF>(perlin_mat);
-    auto colorspot_tex = make_shared<image_texture>("../models/spot_texture.png");
+    auto colorspot_tex = load_texture("../models/spot_texture.png");
     auto die_tex = make_shared<dielectric>(1.5);
 
     //floor
     objects.add(make_shared<xz_rect>(-30, 30, -30, 30, 0, make_shared<lambertian>(noise_tex)));
     //objects
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/Rabbit.obj",
             metal_tex,
             vec3(1.5, 0, 2.5),
             vec3(0, 120, 0),
             vec3(1, 1, 1)));
 
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/Dog2.obj",
             perlin_tex,
             vec3(1, 0, 0.5),
             vec3(0, 60, 0),
             vec3(0.2, 0.2, 0.2)));
 
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/spot_triangulated_good.obj",
             make_shared<lambertian>(colorspot_tex),
             vec3(2, 1, -2.5),
             vec3(0, -120, 0),
             vec3(1.2, 1.2, 1.2)));
 
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/SeaUrchin2.obj",
             die_tex,
             vec3(5, 0, 0),
@@ -226,7 +191,7 @@ hittable_list my_scene3() {
     return hittable_list(make_shared<bvh_node>(objects, 0.0, 1.0));
 }
 
-hittable_list cornell_box2() {
+hittable_list cornell_box2(hittable_list &lights) {
     hittable_list objects;
 
     auto purple = make_shared<lambertian>(color(0.54, 0.25, 0.46));
@@ -242,7 +207,7 @@ hittable_list cornell_box2() {
     auto metal_tex2 = make_shared<metal>(green, 0.2);
     auto perlin_mat = make_shared<perlin_brdf_texture>(4);
     auto perlin_tex = make_shared<BRDF>(perlin_mat);
-    auto colorspot_tex = make_shared<image_texture>("../models/spot_texture.png");
+    auto colorspot_tex = load_texture("../models/spot_texture.png");
     auto die_tex = make_shared<dielectric>(1.5);
 
     //make a room
@@ -251,7 +216,9 @@ hittable_list cornell_box2() {
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, blue));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
-    objects.add(make_shared<xz_rect>(100, 456, 114, 446, 554, light));
+    auto ceiling_light = make_shared<xz_rect>(100, 456, 114, 446, 554, light);
+    objects.add(ceiling_light);
+    lights.add(ceiling_light);
 
     //objects
 
@@ -269,25 +236,25 @@ hittable_list cornell_box2() {
     box_square = make_shared<translate>(box_square, vec3(130, 0, 65));
     objects.add(box_square);
     //others
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/SeaUrchin2.obj",
             metal_tex2,
             vec3(380, 330, 340),
             vec3(0, 0, 0),
             vec3(7, 7, 7)));
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/Rabbit.obj",
             metal_tex,
             vec3(30, 170, 210),
             vec3(0, 120, 0),
             vec3(30, 30, 30)));
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/Dog2.obj",
             perlin_tex,
             vec3(320, 0, 210),
             vec3(0, -150, 0),
             vec3(15, 15, 15)));
-    objects.add(read_obj_model_triangle(
+    objects.add(load_mesh(
             "../models/spot_triangulated_good.obj",
             make_shared<lambertian>(colorspot_tex),
             vec3(335, 50, 300),
@@ -297,11 +264,176 @@ hittable_list cornell_box2() {
     return hittable_list(make_shared<bvh_node>(objects, 0.0, 1.0));
 }
 
+hittable_list many_lights_scene(hittable_list &lights) {
+    /***************
+    多光源场景：天花板上 16x16 个颜色、亮度各不相同的小面光源，以及一只发光的兔子
+    ***************/
+    hittable_list objects;
+
+    auto white = make_shared<lambertian>(color(0.73, 0.73, 0.73));
+    auto blue = make_shared<lambertian>(color(0.09, 0.38, 0.67));
+    auto yellow = make_shared<lambertian>(color(0.98, 0.65, 0.20));
+    auto gray = make_shared<lambertian>(color(0.57, 0.50, 0.45));
+
+    //make a room
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, blue));
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, yellow));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+
+    //ceiling lights
+    for (int i = 0; i < 16; ++i) {
+        for (int j = 0; j < 16; ++j) {
+            auto strength = 2.0 + 6.0 * ((i * 7 + j * 13) % 8);
+            auto tint = (i + j) % 3 == 0 ? color(1.0, 0.7, 0.4) : (i + j) % 3 == 1 ? color(0.5, 0.7, 1.0) : color(1, 1, 1);
+            auto x0 = 30 + i * 32.0;
+            auto z0 = 30 + j * 32.0;
+            auto light = make_shared<xz_rect>(x0, x0 + 12, z0, z0 + 12, 554, make_shared<diffuse_light>(strength * tint));
+            objects.add(light);
+            lights.add(light);
+        }
+    }
+
+    //objects
+    shared_ptr<hittable> box_tall = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), gray);
+    box_tall = make_shared<rotate_y>(box_tall, 15);
+    box_tall = make_shared<translate>(box_tall, vec3(265, 0, 295));
+    objects.add(box_tall);
+
+    objects.add(make_shared<sphere>(vec3(150, 90, 190), 90, white));
+    objects.add(load_mesh(
+            "../models/Rabbit.obj",
+            make_shared<diffuse_light>(color(6, 3, 1)),
+            vec3(420, 0, 120),
+            vec3(0, 150, 0),
+            vec3(45, 45, 45),
+            &lights));
+
+    return hittable_list(make_shared<bvh_node>(objects, 0.0, 1.0));
+}
+
+hittable_list medium_scene(hittable_list &lights) {
+    /***************
+    非均匀介质场景：Cornell Box 的下半部分充满 Perlin 噪声的雾，高盒子上方悬浮一团体素网格表示的云
+    ***************/
+    hittable_list objects;
+
+    auto red = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+    //make a room
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+    auto ceiling_light = make_shared<xz_rect>(213, 343, 227, 332, 554, light);
+    objects.add(ceiling_light);
+    lights.add(ceiling_light);
+
+    shared_ptr<hittable> box_tall = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+    box_tall = make_shared<rotate_y>(box_tall, 15);
+    box_tall = make_shared<translate>(box_tall, vec3(265, 0, 295));
+    objects.add(box_tall);
+
+    //fog
+    auto fog = make_shared<perlin_density>(0.02, 1.0 / 120, -0.1);
+    objects.add(make_shared<heterogeneous_medium>(aabb(point3(0, 0, 0), point3(555, 220, 555)), fog,
+                                                  color(0.8, 0.8, 0.8)));
+
+    //cloud：球形衰减叠加噪声的 48^3 体素
+    const int n = 48;
+    perlin noise;
+    std::vector<float> voxels(n * n * n);
+    for (int z = 0; z < n; ++z)
+        for (int y = 0; y < n; ++y)
+            for (int x = 0; x < n; ++x) {
+                auto p = (vec3(x, y, z) + vec3(0.5, 0.5, 0.5)) / n * 2 - vec3(1, 1, 1);
+                auto falloff = 1 - p.length() + 0.6 * noise.turb(3 * p, 4);
+                voxels[(z * n + y) * n + x] = static_cast<float>(fmax(0.0, falloff));
+            }
+    aabb cloud_box(point3(80, 300, 120), point3(260, 480, 300));
+    auto cloud = make_shared<voxel_density>(cloud_box, n, n, n, std::move(voxels), 0.05);
+    objects.add(make_shared<heterogeneous_medium>(cloud_box, cloud, color(0.9, 0.9, 0.95)));
+
+    return hittable_list(make_shared<bvh_node>(objects, 0.0, 1.0));
+}
+
+shared_ptr<sparse_grid> load_smoke_volume(const std::string &filename) {
+    /***************
+    读取稀疏体素文件；文件不存在时程序生成 1024^3 定义域中的一道弯曲上升的烟柱并写入该文件
+    ***************/
+    if (std::ifstream(filename).good())
+        return sparse_grid::load(filename);
+
+    const int n = 1024;
+    auto grid = make_shared<sparse_grid>(n, n, n);
+    perlin noise;
+    for (int y = 0; y < n; ++y) {
+        auto h = (y + 0.5) / n;
+        auto cx = 0.5 + 0.15 * sin(6 * h), cz = 0.5 + 0.15 * cos(5 * h) - 0.15;
+        auto radius = 0.02 + 0.06 * h;
+        // 噪声最多把半径放大 1.8 倍，只遍历这个范围内的体素
+        int x0 = static_cast<int>((cx - 1.8 * radius) * n), x1 = static_cast<int>((cx + 1.8 * radius) * n);
+        int z0 = static_cast<int>((cz - 1.8 * radius) * n), z1 = static_cast<int>((cz + 1.8 * radius) * n);
+        for (int z = std::max(z0, 0); z <= std::min(z1, n - 1); ++z)
+            for (int x = std::max(x0, 0); x <= std::min(x1, n - 1); ++x) {
+                auto u = point3(x + 0.5, y + 0.5, z + 0.5) / n;
+                auto distance = sqrt((u.x() - cx) * (u.x() - cx) + (u.z() - cz) * (u.z() - cz)) / radius;
+                auto value = (1 - distance + 0.8 * noise.turb(24 * u, 4) - 0.3) * fmin(1.0, 8 * (1 - h));
+                if (value > 0)
+                    grid->set(x, y, z, static_cast<float>(value));
+            }
+    }
+    grid->update_majorants();
+    if (!grid->save(filename))
+        std::cerr << "ERROR: Could not write sparse volume file '" << filename << "'.\n";
+    return grid;
+}
+
+hittable_list smoke_scene() {
+    /***************
+    稀疏体素场景：1024^3 的烟柱放在天空盒中的地面上
+    ***************/
+    hittable_list objects;
+
+    objects.add(make_shared<xz_rect>(-30, 30, -30, 30, 0, make_shared<lambertian>(color(0.5, 0.5, 0.5))));
+
+    auto grid = load_smoke_volume("../models/smoke.svol");
+    if (grid) {
+        printf("Sparse volume : %zu leaves, %.1f MB (dense %.1f MB)\n", grid->leaf_count(), grid->memory() / 1048576.0,
+               4.0 * grid->dim(0) * grid->dim(1) * grid->dim(2) / 1048576.0);
+        objects.add(make_shared<sparse_volume>(aabb(point3(-2, 0, -2), point3(2, 4, 2)), grid, 40.0,
+                                               color(0.85, 0.85, 0.85)));
+    }
+
+    return hittable_list(make_shared<bvh_node>(objects, 0.0, 1.0));
+}
+
+hittable_list texture_scene() {
+    /***************
+    贴图滤波场景：铺满图片贴图的地面延伸到远处，一个镜面球反射地面
+    ***************/
+    hittable_list objects;
+
+    auto rock = make_shared<lambertian>(load_texture("../models/rock/rock.png"));
+    for (int i = -10; i < 10; ++i)
+        for (int j = -2; j < 198; ++j)
+            objects.add(make_shared<xz_rect>(2 * i, 2 * i + 2, 2 * j, 2 * j + 2, 0, rock));
+
+    objects.add(make_shared<sphere>(point3(0, 1.5, 8), 1.5, make_shared<metal>(color(0.9, 0.9, 0.9), 0.0)));
+
+    return hittable_list(make_shared<bvh_node>(objects, 0.0, 1.0));
+}
+
 hittable_list lambertian_scene() {
     hittable_list objects;
 
     //auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    auto spot_texture = make_shared<image_texture>("../models/spot_texture.png");
+    auto spot_texture = load_texture("../models/spot_texture.png");
     auto lambertian_tex = make_shared<lambertian>(spot_texture);
     auto red = make_shared<lambertian>(color(.65, .05, .05));
     auto white = make_shared<lambertian>(color(.73, .73, .73));
@@ -326,7 +458,7 @@ hittable_list perlin_scene() {
     hittable_list objects;
 
     //auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    auto spot_texture = make_shared<image_texture>("../models/spot_texture.png");
+    auto spot_texture = load_texture("../models/spot_texture.png");
     auto lambertian_tex = make_shared<lambertian>(spot_texture);
     auto red = make_shared<lambertian>(color(.65, .05, .05));
     auto white = make_shared<lambertian>(color(.73, .73, .73));
@@ -351,7 +483,7 @@ hittable_list dielectric_scene() {
     hittable_list objects;
 
     auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    auto spot_texture = make_shared<image_texture>("../models/spot_texture.png");
+    auto spot_texture = load_texture("../models/spot_texture.png");
     auto perlin_texture = make_shared<perlin_brdf_texture>(4);
     auto material = make_shared<BRDF>(perlin_texture);
     auto metal_m = make_shared<metal>(color(0.8, 0.8, 0.9), 0.2);
@@ -371,7 +503,7 @@ hittable_list metal_scene() {
     hittable_list objects;
 
     //auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    auto spot_texture = make_shared<image_texture>("../models/spot_texture.png");
+    auto spot_texture = load_texture("../models/spot_texture.png");
     auto lambertian_tex = make_shared<lambertian>(spot_texture);
     auto noise_tex = make_shared<noise_texture>(4);
 //    auto perlin_texture = make_shared<perlin_brdf_texture>(4);
@@ -396,7 +528,7 @@ hittable_list BRDF_scene() {
     hittable_list objects;
 
     //auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    auto spot_texture = make_shared<image_texture>("../models/spot_texture.png");
+    auto spot_texture = load_texture("../models/spot_texture.png");
     auto lambertian_tex = make_shared<lambertian>(spot_texture);
     auto noise_tex = make_shared<noise_texture>(4);
 //    auto perlin_texture = make_shared<perlin_brdf_texture>(4);
@@ -425,13 +557,13 @@ hittable_list bvh_test() {
     hittable_list objects;
 
     auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    auto spot_texture = make_shared<image_texture>("../models/spot_texture.png");
+    auto spot_texture = load_texture("../models/spot_texture.png");
     auto perlin_texture = make_shared<perlin_brdf_texture>(4);
     auto material = make_shared<BRDF>(perlin_texture);
     auto metal_m = make_shared<metal>(color(0.8, 0.8, 0.9), 0.2);
 
-    objects.add(read_obj_model_triangle("../models/dragon2.obj", material, vec3(-0.5, 0, -3), vec3(0, 80, 0),
-                                        vec3(0.5, 0.5, 0.5)));
+    objects.add(load_mesh("../models/dragon2.obj", material, vec3(-0.5, 0, -3), vec3(0, 80, 0),
+                          vec3(0.5, 0.5, 0.5)));
     return hittable_list(make_shared<bvh_node>(objects, 0.0, 1.0));
 }
 
@@ -439,7 +571,7 @@ hittable_list no_bvh_test() {
     hittable_list objects;
 
     auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    auto spot_texture = make_shared<image_texture>("../models/spot_texture.png");
+    auto spot_texture = load_texture("../models/spot_texture.png");
     auto perlin_texture = make_shared<perlin_brdf_texture>(4);
     auto material = make_shared<BRDF>(perlin_texture);
     auto metal_m = make_shared<metal>(color(0.8, 0.8, 0.9), 0.2);
@@ -449,51 +581,215 @@ hittable_list no_bvh_test() {
     return hittable_list(make_shared<bvh_node>(objects, 0.0, 1.0));
 }
 
-void parse_arg(int argc, char *argv[], int &spp, int &scene) {
+struct render_options {
+    int samples_per_pixel = 0; // 每像素采样数，渐进模式下为样本数上限，0 表示未指定
+    int scene = 10; // Scene_id
+    std::string sampler_type = "sobol"; // 采样器类型
+    std::string reference; // 收敛报告使用的参考图像
+    std::string integrator = "path"; // 积分器：path 路径追踪，wavefront 波前路径追踪，bdpt 双向路径追踪，restir 蓄水池重采样直接光照
+    double adaptive_threshold = 0; // 自适应采样的误差阈值(显示空间)，0 表示每个像素都采 samples_per_pixel 个样本
+    double time_budget = 0; // 渐进模式的时间预算(秒)，0 表示不限时
+    double target_noise = 0; // 渐进模式的目标噪声(显示空间各像素标准误差的均方根)，0 表示不检查
+    bool denoise = false; // 输出前使用反照率与法线特征进行降噪
+    std::string aovs; // 需要输出的 AOV，逗号分隔
+    int reorder_buffer = 0; // 波前积分器中次级光线重排的分组大小，0 表示不重排；大于默认批大小时批大小随之增大
+    int photon_count = 0; // 焦散光子图发射的光子数，0 表示不使用光子图
+    double photon_radius = 0; // 光子图密度估计的半径，0 表示按场景大小自动选择
+    int cache_depth = 0; // 路径在辐射缓存中结束之前的非镜面散射次数，0 表示不使用缓存
+    double cache_cell = 0; // 辐射缓存的单元大小，0 表示按场景大小自动选择
+    int cache_samples = 1; // 填充辐射缓存时每个像素的样本数
+    int guide_memory = 0; // 路径引导结构的内存上限(MB)，0 表示不使用路径引导
+    bool texture_filtering = true; // 相机光线带有光线微分，图片贴图按 mip 层级滤波
+    std::string texture_benchmark; // 贴图查找基准测试使用的图片，不为空时只做测试，不渲染
+    int texture_cache_memory = 512; // 图片贴图页缓存的内存上限(MB)
+    bool environment_sampling = false; // 对天空盒做重要性采样并与 BSDF 采样做 MIS
+
+    bool progressive() const {
+        return time_budget > 0 || target_noise > 0;
+    }
+};
+
+void parse_arg(int argc, char *argv[], render_options &options) {
     int opt;
-    while ((opt = getopt(argc, argv, "hs:p:")) != -1) {
+    while ((opt = getopt(argc, argv, "hs:p:S:r:i:a:t:n:dA:R:P:C:G:FB:M:E")) != -1) {
         switch (opt) {
             case 'h':
-                printf("Usage: %s [-s scene] [-p spp]\n", argv[0]);
+                printf("Usage: %s [-s scene] [-p spp] [-S random|stratified|sobol|bluenoise] [-r reference] [-i path|wavefront|bdpt|restir] [-a threshold] [-t time] [-n noise] [-d] [-A aov,...|all] [-R reorder_buffer] [-P photons[,radius]] [-C depth[,cell[,spp]]] [-G megabytes] [-F] [-B texture] [-M megabytes] [-E]\n", argv[0]);
                 exit(0);
                 break;
             case 's':
-                scene = atoi(optarg);
+                options.scene = atoi(optarg);
                 break;
             case 'p':
-                spp = atoi(optarg);
+                options.samples_per_pixel = atoi(optarg);
+                break;
+            case 'S':
+                options.sampler_type = optarg;
+                break;
+            case 'r':
+                options.reference = optarg;
+                break;
+            case 'i':
+                options.integrator = optarg;
+                break;
+            case 'a':
+                options.adaptive_threshold = atof(optarg);
+                break;
+            case 't':
+                options.time_budget = parse_duration(optarg);
+                if (options.time_budget <= 0) {
+                    fprintf(stderr, "Invalid time budget '%s', expected e.g. 30s, 2m or 500ms\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'n':
+                options.target_noise = atof(optarg);
+                break;
+            case 'd':
+                options.denoise = true;
+                break;
+            case 'A':
+                options.aovs = optarg;
+                break;
+            case 'R':
+                options.reorder_buffer = atoi(optarg);
+                break;
+            case 'P': {
+                // 光子数与可选的半径，如 1000000 或 1000000,2.5
+                char *end;
+                options.photon_count = static_cast<int>(strtol(optarg, &end, 10));
+                if (*end == ',')
+                    options.photon_radius = atof(end + 1);
+                break;
+            }
+            case 'C': {
+                // 结束深度与可选的单元大小、填充样本数，如 1 或 1,5,2
+                char *end;
+                options.cache_depth = static_cast<int>(strtol(optarg, &end, 10));
+                if (*end == ',')
+                    options.cache_cell = strtod(end + 1, &end);
+                if (*end == ',')
+                    options.cache_samples = atoi(end + 1);
+                break;
+            }
+            case 'G':
+                options.guide_memory = atoi(optarg);
+                break;
+            case 'F':
+                options.texture_filtering = false;
+                break;
+            case 'B':
+                options.texture_benchmark = optarg;
+                break;
+            case 'M':
+                options.texture_cache_memory = std::max(atoi(optarg), 1);
+                break;
+            case 'E':
+                options.environment_sampling = true;
                 break;
             default:
                 break;
         }
     }
+    if (options.samples_per_pixel <= 0 && !options.progressive())
+        options.samples_per_pixel = 1;
+}
+
+void run_texture_benchmark(const std::string &filename) {
+    /***************
+    贴图查找的基准测试(单线程)：随机位置、按行连续、按列连续三种顺序，分别测试最近像素与双线性插值的查找，
+    线性与 sRGB 解码各一遍。连续顺序每次在第 0 层上移动一个像素，到边界后换到下一行(列)
+    ***************/
+    const int n = 1 << 22;
+    const char *orders[] = {"random", "row", "column"};
+    // 变化范围远小于一个像素，双线性插值总在第 0 层上进行
+    texture_footprint magnified;
+    magnified.dudx = magnified.dvdy = 1e-9;
+
+    for (bool srgb : {false, true}) {
+        image_texture tex(filename.c_str(), srgb);
+        if (tex.width() == 0)
+            return;
+        if (!srgb)
+            printf("Texture : %dx%d, %d levels, %.1f MB\n%-8s %-8s %12s %12s\n", tex.width(), tex.height(),
+                   tex.level_count(), tex.memory() / 1048576.0, "decode", "order", "nearest", "bilinear");
+
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        std::vector<double> us(n), vs(n);
+        for (int order = 0; order < 3; ++order) {
+            for (int k = 0; k < n; ++k) {
+                if (order == 0) {
+                    us[k] = uniform(rng);
+                    vs[k] = uniform(rng);
+                } else {
+                    int along = k % tex.width(), across = (k / tex.width()) % tex.height();
+                    double a = (along + 0.5) / tex.width(), b = (across + 0.5) / tex.height();
+                    us[k] = order == 1 ? a : b;
+                    vs[k] = order == 1 ? b : a;
+                }
+            }
+            double ns[2];
+            color sum(0, 0, 0); // 累加查找结果，避免查找被优化掉
+            for (int method = 0; method < 2; ++method) {
+                auto start = omp_get_wtime();
+                for (int k = 0; k < n; ++k)
+                    sum += method == 0 ? tex.value(us[k], vs[k], point3()) : tex.filtered(us[k], vs[k], magnified);
+                ns[method] = (omp_get_wtime() - start) / n * 1e9;
+            }
+            printf("%-8s %-8s %9.2f ns %9.2f ns  (%.4f)\n", srgb ? "srgb" : "linear", orders[order], ns[0], ns[1],
+                   luminance(sum) / (2 * n));
+        }
+    }
+}
+
+double image_rmse(const std::vector<color> &framebuffer, const std::vector<int> &sample_count, const cv::Mat &reference) {
+    /***************
+    计算当前结果与参考图像(8位, BGR)在显示空间下的均方根误差
+    ***************/
+    double sum = 0;
+    for (auto i = 0; i < reference.rows * reference.cols; ++i) {
+        auto c = gamma_correct(framebuffer[i], sample_count[i]);
+        auto &ref = reference.at<cv::Vec3b>(i / reference.cols, i % reference.cols);
+        for (int k = 0; k < 3; ++k) {
+            auto d = clamp(c[k], 0.0, 0.999) - (ref[2 - k] + 0.5) / 256.0;
+            sum += d * d;
+        }
+    }
+    return sqrt(sum / (3.0 * reference.rows * reference.cols));
 }
 
 int main(int argc, char *argv[]) {
 
     auto aspect_ratio = 16.0 / 9.0; // 图像比例
     int image_width = 960; // 图像宽度
-    int samples_per_pixel = 1; // 每像素采样数
     int max_depth = 50; // 最大碰撞深度
 
     // World
     hittable_list world; // 碰撞体的集合——世界
-
-    int scene = 10; // Scene_id
+    hittable_list lights; // 用于光源采样的发光体
 
     point3 lookfrom; // 视点原点
     point3 lookat; // 视点方向
     auto vfov = 40.0; // 视角
     auto aperture = 0.0; // 光圈
     color background(0, 0, 0); // 背景颜色
-    auto sky_box = make_sky_box(); // 天空盒实现
+    shared_ptr<sky_box> sky_box; // 天空盒实现，只在场景使用天空盒时读入
     bool using_sky_box = false;
 
 
     // 选择对应的场景进行渲染
-    parse_arg(argc, argv, samples_per_pixel, scene);
-    printf("Samples Per Pixel : %d\nScene : %d\n", samples_per_pixel, scene);
-    switch (scene) {
+    render_options options;
+    parse_arg(argc, argv, options);
+    texture_cache::global().set_capacity(static_cast<size_t>(options.texture_cache_memory) << 20);
+    if (!options.texture_benchmark.empty()) {
+        run_texture_benchmark(options.texture_benchmark);
+        return 0;
+    }
+    const int samples_per_pixel = options.samples_per_pixel;
+    printf("Samples Per Pixel : %d\nScene : %d\nSampler : %s\nIntegrator : %s\n", samples_per_pixel, options.scene,
+           options.sampler_type.c_str(), options.integrator.c_str());
+    switch (options.scene) {
         case 1:
             world = my_scene1();
             using_sky_box = true;
@@ -514,7 +810,7 @@ int main(int argc, char *argv[]) {
             break;
 
         case 3:
-            world = cornell_box2();
+            world = cornell_box2(lights);
             aspect_ratio = 1.0;
             image_width = 600;
             lookfrom = point3(278, 278, -800);
@@ -596,6 +892,52 @@ int main(int argc, char *argv[]) {
             vfov = 60.0;
             max_depth = 25;
             break;
+
+        case 12:
+            world = many_lights_scene(lights);
+            aspect_ratio = 1.0;
+            image_width = 600;
+            lookfrom = point3(278, 278, -800);
+            lookat = point3(278, 278, 0);
+            max_depth = 25;
+            vfov = 40.0;
+            break;
+
+        case 13:
+            world = medium_scene(lights);
+            aspect_ratio = 1.0;
+            image_width = 600;
+            lookfrom = point3(278, 278, -800);
+            lookat = point3(278, 278, 0);
+            max_depth = 25;
+            vfov = 40.0;
+            break;
+
+        case 14:
+            world = smoke_scene();
+            using_sky_box = true;
+            lookfrom = point3(7, 2.5, 0);
+            lookat = point3(0, 1.8, 0);
+            vfov = 45.0;
+            max_depth = 25;
+            break;
+
+        case 15:
+            world = texture_scene();
+            using_sky_box = true;
+            lookfrom = point3(0, 2, -4);
+            lookat = point3(0, 1, 20);
+            vfov = 40.0;
+            max_depth = 25;
+            break;
+    }
+    if (using_sky_box)
+        sky_box = make_sky_box();
+    {
+        const auto& assets = asset_registry::global().stats();
+        printf("Assets : %d/%d textures, %d/%d meshes loaded (%d built), %.1f MB saved by sharing\n", assets.textures,
+               assets.texture_requests, assets.meshes, assets.mesh_requests, assets.mesh_builds,
+               assets.bytes_saved / 1048576.0);
     }
 
     // 相机
@@ -607,61 +949,356 @@ int main(int argc, char *argv[]) {
 
     // 渲染
     std::vector<color> framebuffer(image_width * image_height); // 渲染的buffer，以供并行渲染
-    boost::timer t_ogm;
-    if (using_sky_box) {
-#pragma omp parallel for collapse(2) schedule(dynamic, 8) num_threads(6)
-        for (int j = image_height - 1; j >= 0; j--) {
-            for (int i = 0; i < image_width; ++i) {
-                color pixel_color(0, 0, 0);
-                for (int s = 0; s < samples_per_pixel; ++s) {
-                    auto u = (i + random_double()) / (image_width - 1);
-                    auto v = (j + random_double()) / (image_height - 1);
-                    ray r = cam.get_ray(u, v);
-                    //                pixel_color += ray_color(r, background, world, max_depth); // Background 渲染
-                    pixel_color += ray_color_sky_box(r, sky_box, world, max_depth); // 天空盒渲染
+    std::vector<int> sample_count(image_width * image_height, 0); // 每个像素已采样的样本数
+    auto pixel_sampler = make_sampler(options.sampler_type, samples_per_pixel);
+    // ReSTIR 只计算直接光照，天空盒只能作为光源采样，因此总是建立环境光的分布
+    const bool environment_sampling = options.environment_sampling || options.integrator == "restir";
+    auto env = using_sky_box ? environment(sky_box, environment_sampling)
+                             : environment(background); // 天空盒或纯色背景
+    light_bvh light_tree(lights); // 按贡献选择光源
+    printf("Lights : %zu\n", light_tree.size());
+
+    // ReSTIR 直接光照：每一帧为每个像素追加一个样本，帧之间做时间复用
+    shared_ptr<restir> restir_renderer;
+    if (options.integrator == "restir")
+        restir_renderer = make_shared<restir>(image_width, image_height);
+
+    // 波前路径追踪：整批光线按弹射逐层求交、按材质排序着色
+    shared_ptr<wavefront> wavefront_renderer;
+    if (options.integrator == "wavefront")
+        wavefront_renderer = make_shared<wavefront>(std::max(1 << 16, options.reorder_buffer), options.reorder_buffer);
+    else if (options.reorder_buffer > 0)
+        printf("Ray reordering requires the wavefront integrator\n");
+
+    // 双向路径追踪：光源子路径连接到相机的贡献可以落在任意像素上，每一遍整帧进行
+    shared_ptr<bdpt> bdpt_renderer;
+    if (options.integrator == "bdpt") {
+        bdpt_renderer = make_shared<bdpt>(image_width, image_height);
+        if (aperture > 0)
+            printf("The bdpt integrator treats the camera as a pinhole when connecting light subpaths\n");
+    }
+
+    // 整帧渲染的积分器不经过逐像素的渲染循环，不支持自适应采样、噪声统计与路径特征
+    const bool frame_integrator = restir_renderer || wavefront_renderer || bdpt_renderer;
+
+    // 焦散光子图：渲染前发射光子，只用于逐像素的路径追踪
+    shared_ptr<photon_map> caustics;
+    if (options.photon_count > 0 && frame_integrator) {
+        printf("Photon mapping is not supported by the %s integrator\n", options.integrator.c_str());
+    } else if (options.photon_count > 0) {
+        auto start = omp_get_wtime();
+        caustics = make_shared<photon_map>(options.photon_count, options.photon_radius);
+        caustics->build(env, world, light_tree, max_depth);
+        printf("Photon map : %d emitted, %zu stored, radius %g, %.3fs\n", options.photon_count, caustics->size(),
+               caustics->gather_radius(), omp_get_wtime() - start);
+    }
+
+    // 辐射缓存：渲染前用路径追踪填充，只用于逐像素的路径追踪
+    shared_ptr<radiance_cache> cache;
+    // 路径引导：每轮渲染时学习，轮次之间更新分布，只用于逐像素的路径追踪
+    shared_ptr<path_guide> guide;
+
+    // 光线微分的间距：每个像素有多个样本时按样本数的平方根缩小，贴图滤波与像素内的超采样不重复模糊
+    auto differential_scale = fmax(1 / sqrt(std::max(samples_per_pixel, 1)), 0.125);
+    auto du = differential_scale / (image_width - 1);
+    auto dv = differential_scale / (image_height - 1);
+    // 波前积分器的相机光线微分，关闭贴图滤波时为 0
+    auto ray_du = options.texture_filtering ? du : 0.0;
+    auto ray_dv = options.texture_filtering ? dv : 0.0;
+
+    // 像素 (i, j) 的第 s 个样本；cache_path 不为空时记录路径的非镜面顶点
+    auto trace_sample = [&](int i, int j, int s, sampler &smp, path_features *features,
+                            std::vector<cache_vertex> *cache_path = nullptr) {
+        smp.start_pixel_sample(i, j, s);
+        auto jitter = smp.get_2d();
+        auto u = (i + jitter.x()) / (image_width - 1);
+        auto v = (j + jitter.y()) / (image_height - 1);
+        ray r = options.texture_filtering ? cam.get_ray(u, v, du, dv, smp) : cam.get_ray(u, v, smp);
+        return ray_color(r, env, world, light_tree, max_depth, smp, features, caustics.get(), cache.get(), cache_path,
+                         guide.get());
+    };
+
+    if (options.cache_depth > 0 && frame_integrator) {
+        printf("Radiance caching is not supported by the %s integrator\n", options.integrator.c_str());
+    } else if (options.cache_depth > 0) {
+        auto start = omp_get_wtime();
+        // 填充时使用与渲染不同的样本序号，避免与渲染的样本相关
+        auto filled = make_shared<radiance_cache>(options.cache_depth, options.cache_cell, options.cache_samples);
+        auto fill_sampler = make_sampler(options.sampler_type, options.cache_samples, 2);
+        filled->build(world, image_width, image_height, *fill_sampler,
+                      [&](int i, int j, int s, sampler &smp, std::vector<cache_vertex> &path) {
+                          return trace_sample(i, j, s, smp, nullptr, &path);
+                      });
+        cache = filled;
+        printf("Radiance cache : depth %d, cell %g, %zu cells, %.3fs\n", cache->terminate_depth(), cache->cell(),
+               cache->size(), omp_get_wtime() - start);
+    }
+
+    if (options.guide_memory > 0 && frame_integrator) {
+        printf("Path guiding is not supported by the %s integrator\n", options.integrator.c_str());
+    } else if (options.guide_memory > 0) {
+        guide = make_shared<path_guide>(static_cast<size_t>(options.guide_memory) << 20);
+        guide->build(world);
+    }
+    // 一轮 spp 个样本结束后更新引导分布
+    double guide_time = 0;
+    auto refine_guide = [&](int spp) {
+        if (!guide)
+            return;
+        auto start = omp_get_wtime();
+        guide->refine(spp);
+        guide_time += omp_get_wtime() - start;
+    };
+
+    // AOV 与降噪所需的特征缓冲，只在请求时分配
+    aov_buffers aovs(image_width, image_height);
+    if (!aovs.request(options.aovs)) {
+        std::cerr << "Unknown AOV in '" << options.aovs << "'\n";
+        return 1;
+    }
+    if (options.adaptive_threshold > 0 && frame_integrator)
+        printf("Adaptive sampling is not supported by the %s integrator\n", options.integrator.c_str());
+    const bool denoise = options.denoise && !frame_integrator;
+    if (options.denoise && frame_integrator)
+        printf("Denoising is not supported by the %s integrator\n", options.integrator.c_str());
+    if (denoise) {
+        aovs.enable(aov_albedo, false);
+        aovs.enable(aov_normal, false);
+    }
+    if (aovs.needs_features() && frame_integrator)
+        printf("The %s integrator only fills the beauty and samples AOVs\n", options.integrator.c_str());
+    const bool features_needed = aovs.needs_features();
+    std::vector<double> moment_buffer(denoise ? image_width * image_height : 0); // 样本亮度的平方和
+
+    // 像素 index 累积第 s 个样本
+    auto add_sample = [&](int index, int i, int j, int s, sampler &smp) {
+        path_features features;
+        auto sample = trace_sample(i, j, s, smp, features_needed ? &features : nullptr);
+        framebuffer[index] += sample;
+        if (features_needed)
+            aovs.add(index, s, sample, features);
+        if (denoise) {
+            auto l = luminance(sample);
+            if (l == l)
+                moment_buffer[index] += l * l;
+        }
+        return sample;
+    };
+
+    // 为每个像素追加第 [first, first + count) 个样本，采样器保证不同轮次的样本衔接
+    auto render_samples = [&](int first, int count) {
+        if (restir_renderer) {
+            for (int s = first; s < first + count; ++s)
+                restir_renderer->render_frame(cam, env, world, light_tree, max_depth, *pixel_sampler, s, framebuffer);
+            for (auto &n : sample_count)
+                n += count;
+            return;
+        }
+        if (wavefront_renderer) {
+            wavefront_renderer->render(cam, env, world, light_tree, max_depth, *pixel_sampler, image_width, image_height,
+                                       first, count, framebuffer, sample_count, ray_du, ray_dv);
+            return;
+        }
+        if (bdpt_renderer) {
+            bdpt_renderer->render(cam, env, world, light_tree, max_depth, *pixel_sampler, first, count, framebuffer,
+                                  sample_count);
+            return;
+        }
+#pragma omp parallel num_threads(6)
+        {
+            auto smp = pixel_sampler->clone();
+#pragma omp for collapse(2) schedule(dynamic, 8)
+            for (int j = image_height - 1; j >= 0; j--) {
+                for (int i = 0; i < image_width; ++i) {
+                    auto index = (image_height - j - 1) * image_width + i;
+                    for (int s = first; s < first + count; ++s)
+                        add_sample(index, i, j, s, *smp);
+                    sample_count[index] += count;
                 }
-                framebuffer[(image_height - j - 1) * image_width + i] = pixel_color;
             }
         }
-    } else {
-#pragma omp parallel for collapse(2) schedule(dynamic, 8) num_threads(6)
-        for (int j = image_height - 1; j >= 0; j--) {
-            for (int i = 0; i < image_width; ++i) {
-                color pixel_color(0, 0, 0);
-                for (int s = 0; s < samples_per_pixel; ++s) {
-                    auto u = (i + random_double()) / (image_width - 1);
-                    auto v = (j + random_double()) / (image_height - 1);
-                    ray r = cam.get_ray(u, v);
-                    pixel_color += ray_color(r, background, world, max_depth); // Background 渲染
-//                    pixel_color += ray_color_sky_box(r, sky_box, world, max_depth); // 天空盒渲染
+    };
+
+    // 自适应采样的一轮：只对未收敛块内的像素追加 count 个样本，并逐个样本更新方差估计
+    auto render_adaptive_round = [&](adaptive_sampling &adaptive, int first, int count) {
+#pragma omp parallel num_threads(6)
+        {
+            auto smp = pixel_sampler->clone();
+#pragma omp for collapse(2) schedule(dynamic, 8)
+            for (int j = image_height - 1; j >= 0; j--) {
+                for (int i = 0; i < image_width; ++i) {
+                    if (!adaptive.pixel_active(i, j))
+                        continue;
+                    auto index = (image_height - j - 1) * image_width + i;
+                    for (int s = first; s < first + count; ++s)
+                        adaptive.add(index, add_sample(index, i, j, s, *smp));
+                    sample_count[index] += count;
+                }
+            }
+        }
+    };
+
+    // 渐进模式的一遍：为每个像素追加第 pass 个样本，到达截止时间后跳过剩余像素
+    auto render_progressive_pass = [&](progressive_render &progress, int pass) {
+        if (restir_renderer) {
+            restir_renderer->render_frame(cam, env, world, light_tree, max_depth, *pixel_sampler, pass, framebuffer);
+            for (auto &n : sample_count)
+                n += 1;
+            return;
+        }
+        if (wavefront_renderer) {
+            wavefront_renderer->render(cam, env, world, light_tree, max_depth, *pixel_sampler, image_width, image_height,
+                                       pass, 1, framebuffer, sample_count, ray_du, ray_dv);
+            return;
+        }
+        if (bdpt_renderer) {
+            bdpt_renderer->render(cam, env, world, light_tree, max_depth, *pixel_sampler, pass, 1, framebuffer,
+                                  sample_count);
+            return;
+        }
+#pragma omp parallel num_threads(6)
+        {
+            auto smp = pixel_sampler->clone();
+#pragma omp for collapse(2) schedule(dynamic, 8)
+            for (int j = image_height - 1; j >= 0; j--) {
+                for (int i = 0; i < image_width; ++i) {
+                    if (progress.expired(omp_get_wtime()))
+                        continue;
+                    auto index = (image_height - j - 1) * image_width + i;
+                    progress.add(index, add_sample(index, i, j, pass, *smp));
+                    sample_count[index] += 1;
                 }
-                framebuffer[(image_height - j - 1) * image_width + i] = pixel_color;
             }
         }
+    };
+
+    cv::Mat reference;
+    if (!options.reference.empty()) {
+        reference = cv::imread(options.reference);
+        if (reference.rows != image_height || reference.cols != image_width) {
+            std::cerr << "Reference image '" << options.reference << "' does not match the render size.\n";
+            return 1;
+        }
+    }
+
+    boost::timer t_ogm;
+    if (options.progressive()) {
+        // 渐进模式：逐遍累积整幅图像，直到截止时间、目标噪声或样本上限
+        auto start = omp_get_wtime();
+        progressive_render progress(image_width * image_height, start, options.time_budget,
+                                    frame_integrator ? 0.0 : options.target_noise, samples_per_pixel);
+        if (frame_integrator && options.target_noise > 0)
+            printf("Target noise is not tracked by the %s integrator, only the time budget applies\n",
+                   options.integrator.c_str());
+        printf("%8s %12s %12s %12s\n", "pass", "time(s)", "noise", "RMSE");
+        int pass = 0;
+        bool finished = false;
+        while (!finished) {
+            render_progressive_pass(progress, pass++);
+            // 路径引导在第 1、2、4、8... 遍之后更新，每轮的样本数翻倍
+            if ((pass & (pass - 1)) == 0)
+                refine_guide(std::max(pass / 2, 1));
+            auto now = omp_get_wtime();
+            finished = progress.finished(pass, now);
+            // 第 1、2、4、8... 遍以及最后一遍输出进度
+            if (finished || (pass & (pass - 1)) == 0)
+                printf("%8d %12.3f %12.6f %12.6f\n", pass, now - start, progress.noise(),
+                       reference.empty() ? 0.0 : image_rmse(framebuffer, sample_count, reference));
+        }
+        auto min_max = std::minmax_element(sample_count.begin(), sample_count.end());
+        printf("Stopped (%s) : %d passes, spp %d-%d, %.3fs\n", progress.reason, pass, *min_max.first,
+               *min_max.second, omp_get_wtime() - start);
+    } else if (options.adaptive_threshold > 0 && !frame_integrator) {
+        // 自适应采样：按轮次翻倍样本数，已收敛的块不再采样
+        adaptive_sampling adaptive(image_width, image_height, options.adaptive_threshold,
+                                   adaptive_sampling::default_min_spp, samples_per_pixel);
+        printf("%8s %12s %12s %12s %12s\n", "round", "max spp", "active", "time(s)", "RMSE");
+        auto start = omp_get_wtime();
+        int done = 0;
+        int round = 0;
+        int active = adaptive.tile_count();
+        while (active > 0) {
+            int count = adaptive.round_samples(done);
+            render_adaptive_round(adaptive, done, count);
+            refine_guide(count);
+            done += count;
+            active = adaptive.update(done);
+            printf("%8d %12d %12d %12.3f %12.6f\n", round++, done, active, omp_get_wtime() - start,
+                   reference.empty() ? 0.0 : image_rmse(framebuffer, sample_count, reference));
+        }
+        adaptive.report(sample_count, omp_get_wtime() - start);
+    } else if (reference.empty() && !guide) {
+        render_samples(0, samples_per_pixel);
+    } else {
+        // 收敛报告：样本数逐次翻倍，记录与参考图像的 RMSE；路径引导在每轮之后更新
+        if (!reference.empty())
+            printf("%8s %12s %12s\n", "spp", "time(s)", "RMSE");
+        auto start = omp_get_wtime();
+        int done = 0;
+        while (done < samples_per_pixel) {
+            int count = std::min(std::max(done, 1), samples_per_pixel - done);
+            render_samples(done, count);
+            refine_guide(count);
+            done += count;
+            if (!reference.empty())
+                printf("%8d %12.3f %12.6f\n", done, omp_get_wtime() - start,
+                       image_rmse(framebuffer, sample_count, reference));
+        }
     }
     float time_cost = t_ogm.elapsed();
     std::cout << "Time_cost: " << time_cost << std::endl;
+    {
+        auto stats = texture_cache::global().stats();
+        auto lookups = stats.local_hits + stats.shared_hits + stats.misses;
+        if (lookups > 0)
+            printf("Texture cache : %.1f%% local hits, %.2f%% shared hits, %llu pages read, %llu evicted, "
+                   "peak %.1f MB / %d MB\n", 100.0 * stats.local_hits / lookups, 100.0 * stats.shared_hits / lookups,
+                   (unsigned long long) stats.misses, (unsigned long long) stats.evictions,
+                   texture_cache::global().peak_bytes() / 1048576.0, options.texture_cache_memory);
+    }
+    if (wavefront_renderer)
+        wavefront_renderer->report();
+    if (guide)
+        printf("Path guide : %zu regions, %zu nodes, %.1f MB, refine %.3fs\n", guide->leaf_count(), guide->node_count(),
+               guide->memory() / 1048576.0, guide_time);
     // 渲染结束
 
+    // 降噪：在归一化后的线性颜色上滤波，耗时与渲染分开统计
+    if (denoise) {
+        auto start = omp_get_wtime();
+        const int n = image_width * image_height;
+        std::vector<color> beauty(n), albedo(n);
+        std::vector<vec3> normal(n);
+        std::vector<double> variance(n);
+        for (int i = 0; i < n; ++i) {
+            if (sample_count[i] == 0)
+                continue;
+            double scale = 1.0 / sample_count[i];
+            beauty[i] = framebuffer[i] * scale;
+            albedo[i] = aovs.average(aov_albedo, i, sample_count[i]);
+            normal[i] = aovs.average(aov_normal, i, sample_count[i]);
+            // 像素均值的方差 = 样本方差 / 样本数；只有一个样本时无法估计，按标准差与均值相当处理
+            auto mean = luminance(beauty[i]);
+            variance[i] = sample_count[i] > 1 ? fmax(moment_buffer[i] * scale - mean * mean, 0.0) * scale : mean * mean;
+        }
+        denoiser(image_width, image_height).apply(beauty, albedo, normal, variance);
+        for (int i = 0; i < n; ++i)
+            framebuffer[i] = beauty[i] * sample_count[i];
+        printf("Denoise time: %.3fs\n", omp_get_wtime() - start);
+        if (!reference.empty())
+            printf("Denoised RMSE: %.6f\n", image_rmse(framebuffer, sample_count, reference));
+    }
+
     // 从Buffer转为图像显示并保存
     int h = image_height;
     int w = image_width;
     cv::Mat image(h, w, CV_8UC3);
     cv::Mat image2(h, w, CV_8UC3);
     for (auto i = 0; i < image_height * image_width; ++i) {
-        auto r = framebuffer[i].x();
-        auto g = framebuffer[i].y();
-        auto b = framebuffer[i].z();
-
-        if (r != r) r = 0.0;
-        if (g != g) g = 0.0;
-        if (b != b) b = 0.0;
-
-        auto scale = 1.0 / samples_per_pixel;
-        r = sqrt(scale * r);
-        g = sqrt(scale * g);
-        b = sqrt(scale * b);
-
+        auto pixel = gamma_correct(framebuffer[i], sample_count[i]);
+        auto r = pixel.x();
+        auto g = pixel.y();
+        auto b = pixel.z();
 
         static unsigned char color[3];
         color[0] = (unsigned char) (static_cast<int>(256 * clamp(r, 0.0, 0.999)));
@@ -672,10 +1309,16 @@ int main(int argc, char *argv[]) {
         image.at<cv::Vec3b>(i / image_width, i % image_width)[2] = color[0];
     }
     cv::imwrite("./scene.jpg", image);
+    aovs.write("./scene", framebuffer, sample_count);
     cv::imshow("test", image);
     cv::waitKey();
     // 结束
     std::cout << "Image width: " << image_width << std::endl;
     std::cout << "Image height: " << image_height << std::endl;
-    std::cout << "Samples per pixel: " << samples_per_pixel << std::endl;
+    // 渐进与自适应模式下各像素的样本数不同，输出实际的范围
+    auto spp_range = std::minmax_element(sample_count.begin(), sample_count.end());
+    if (*spp_range.first == *spp_range.second)
+        std::cout << "Samples per pixel: " << *spp_range.first << std::endl;
+    else
+        std::cout << "Samples per pixel: " << *spp_range.first << "-" << *spp_range.second << std::endl;
 }
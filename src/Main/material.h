@@ -4,90 +4,204 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "sampler.h"
 #include "texture.h"
 
+#include <atomic>
+
 
 class material {
     /******************************
-        材质基类，包括发光和散射方法
+        材质基类，包括发光和散射方法。
+        材质只有固定的几种，emitted/eval/pdf/scatter 不是虚函数：按构造时记录的 type 用 switch 转到具体材质的同名函数，
+        可以内联，材质混杂时也没有难以预测的间接跳转。新增材质时在 material_type 与文件末尾的分发函数中加上对应的分支
     *******************************/
     public:
-        // 用于光源物体
-        virtual color emitted(double u, double v, const point3& p) const {
-            return color(0,0,0);
+        enum class material_type { lambertian, metal, dielectric, BRDF, diffuse_light, isotropic, sky };
+
+        // 用于光源物体；footprint 为贴图坐标的变化范围，用于图片贴图的滤波
+        color emitted(double u, double v, const point3& p, const texture_footprint& footprint = texture_footprint()) const;
+
+        // 是否发光；不发光的材质不必调用 emitted，也不必计算命中光源时的 MIS 权重
+        bool emissive() const {
+            return type == material_type::diffuse_light || type == material_type::sky;
         }
 
+        // BSDF 与 cos(theta) 的乘积在出射方向 direction 上的值，用于光源采样
+        color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const;
+
+        // scatter 采样到方向 direction 的概率密度(立体角)，镜面等 delta 分布返回 0，不参与光源采样
+        double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const;
+
         // 用于对对象的吸收率和光线散射进行定义
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const = 0;
+        bool scatter(
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+            sampler& smp
+        ) const;
+
+    protected:
+        explicit material(material_type type) : type(type), id(next_id()) {}
+
+    public:
+        const material_type type;
+        int id; // 材质编号，用于 material ID 输出
+
+    private:
+        static int next_id() {
+            static std::atomic<int> counter(0);
+            return ++counter;
+        }
 };
 
 
-class lambertian : public material {
+// 镜面反射或折射时把光线微分传给散射光线：相邻像素的光线从交点偏移 dpdx、dpdy 处出发，方向按同一法线反射或折射。
+// 不考虑法线在表面上的变化，曲面镜面之后的滤波范围略偏小；相邻光线发生全反射时散射光线不带微分
+inline void specular_differentials(const ray& r_in, const hit_record& rec, bool reflected, double refraction_ratio,
+                                   ray& scattered) {
+    if (!r_in.has_differentials || !rec.has_differentials)
+        return;
+    auto bend = [&](const vec3& direction, vec3& out) {
+        auto d = unit_vector(direction);
+        if (reflected) {
+            out = reflect(d, rec.normal);
+            return true;
+        }
+        auto cos_theta = fmin(dot(-d, rec.normal), 1.0);
+        if (refraction_ratio * refraction_ratio * (1 - cos_theta * cos_theta) > 1)
+            return false;
+        out = refract(d, rec.normal, refraction_ratio);
+        return true;
+    };
+    if (!bend(r_in.rx_direction, scattered.rx_direction) || !bend(r_in.ry_direction, scattered.ry_direction))
+        return;
+    scattered.rx_origin = rec.p + rec.dpdx;
+    scattered.ry_origin = rec.p + rec.dpdy;
+    scattered.has_differentials = true;
+}
+
+
+class lambertian final : public material {
     /******************************
         朗博材质，对于光照的吸收沿法线的cos(theta)衰减
     ******************************/
     public:
-        lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
-        lambertian(shared_ptr<texture> a) : albedo(a) {}
+        lambertian(const color& a) : material(material_type::lambertian), albedo(a) {}
+        lambertian(shared_ptr<texture> a) : material(material_type::lambertian), albedo(a) {}
+
+        bool scatter(
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+            sampler& smp
+        ) const {
+            // 沿法线所在半球做余弦加权采样，即cos(theta)分布
+            auto xi = smp.get_2d();
+            auto scatter_direction = local_to_world(rec.normal, sample_cosine_hemisphere(xi.x(), xi.y()));
+            return scatter_to(r_in, rec, scatter_direction, attenuation, scattered);
+        }
+
+        // 方向已经采样好的 scatter，波前积分器批量着色时由 sample_n 一次生成一组方向
+        bool scatter_to(
+            const ray& r_in, const hit_record& rec, const vec3& direction, color& attenuation, ray& scattered
+        ) const {
+            scattered = ray(rec.p, direction, r_in.time());
+            attenuation = albedo.value(rec.u, rec.v, rec.p, rec.footprint);
+            return true;
+        }
 
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const override {
-            // 光线散射方向为法线向量加一个球形的采样，模拟cos(theta)分布
-            auto scatter_direction = rec.normal + random_unit_vector();
+        // scatter 的方向采样的批量版本：(u1,u2) 为各条光线的二维样本，(nx,ny,nz) 为法线，方向写入 (x,y,z)
+        static void sample_n(int n, const double* u1, const double* u2, const double* nx, const double* ny,
+                             const double* nz, double* x, double* y, double* z) {
+            sample_cosine_hemisphere_n(n, u1, u2, x, y, z);
+            local_to_world_n(n, nx, ny, nz, x, y, z);
+        }
 
-            // 处理采样到原点的点
-            if (scatter_direction.near_zero())
-                scatter_direction = rec.normal;
+        color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            auto cosine = dot(rec.normal, unit_vector(direction));
+            if (cosine <= 0)
+                return color(0,0,0);
+            return albedo.value(rec.u, rec.v, rec.p, rec.footprint) * (cosine / pi);
+        }
 
-            scattered = ray(rec.p, scatter_direction, r_in.time());
-            attenuation = albedo->value(rec.u, rec.v, rec.p);
-            return true;
+        double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return cosine_hemisphere_pdf(dot(rec.normal, unit_vector(direction)));
         }
 
     public:
-        shared_ptr<texture> albedo;
+        compiled_texture albedo;
 };
 
-class sky : public material {
+class sky final : public material {
     /******************************
         天空盒材质，
     ******************************/
     public:
-        sky(shared_ptr<texture> a) : emit(a) {}
-        sky(color c) : emit(make_shared<solid_color>(c)) {}
+        sky(shared_ptr<texture> a) : material(material_type::sky), emit(a) {}
+        sky(color c) : material(material_type::sky), emit(c) {}
 
-        virtual bool scatter(
-                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const override {
+        bool scatter(
+                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+            sampler& smp
+        ) const {
             return false;
         }
 
-        virtual color emitted(double u, double v, const point3& p) const override {
-            return emit->value(v, u, p);
+        color emitted(double u, double v, const point3& p, const texture_footprint& footprint) const {
+            // 贴图坐标 u、v 互换，变化范围也随之互换
+            texture_footprint swapped;
+            swapped.dudx = footprint.dvdx;
+            swapped.dvdx = footprint.dudx;
+            swapped.dudy = footprint.dvdy;
+            swapped.dvdy = footprint.dudy;
+            return emit.value(v, u, p, swapped);
         }
 
     public:
-        shared_ptr<texture> emit;
+        compiled_texture emit;
 };
 
-class BRDF : public material {
+class BRDF final : public material {
     /******************************
         BRDF材质
     ******************************/
     public:
-        BRDF(shared_ptr<texture> a) : BRDF_texture(a) {}
+        BRDF(shared_ptr<texture> a) : material(material_type::BRDF), BRDF_texture(a) {}
 
-        virtual bool scatter(
-                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-                ) const override {
+        bool scatter(
+                const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+                sampler& smp
+                ) const {
             // 沿法线所在半球随机采样
-            auto scatter_direction = random_in_hemisphere(rec.normal);
-            if (scatter_direction.near_zero())
-                scatter_direction = rec.normal;
-            
+            auto xi = smp.get_2d();
+            auto scatter_direction = local_to_world(rec.normal, sample_uniform_hemisphere(xi.x(), xi.y()));
+            return scatter_to(r_in, rec, scatter_direction, attenuation, scattered);
+        }
+
+        bool scatter_to(
+            const ray& r_in, const hit_record& rec, const vec3& direction, color& attenuation, ray& scattered
+        ) const {
+            scattered = ray(rec.p, direction, r_in.time());
+            attenuation = lookup(r_in, rec, direction);
+            return true;
+        }
+
+        static void sample_n(int n, const double* u1, const double* u2, const double* nx, const double* ny,
+                             const double* nz, double* x, double* y, double* z) {
+            sample_uniform_hemisphere_n(n, u1, u2, x, y, z);
+            local_to_world_n(n, nx, ny, nz, x, y, z);
+        }
+
+        // 均匀半球采样的 pdf 为 1/(2pi)，贴图值即 eval/pdf
+        color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            if (dot(rec.normal, direction) <= 0)
+                return color(0,0,0);
+            return lookup(r_in, rec, unit_vector(direction)) * uniform_hemisphere_pdf();
+        }
+
+        double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return dot(rec.normal, direction) > 0 ? uniform_hemisphere_pdf() : 0;
+        }
+
+    private:
+        color lookup(const ray& r_in, const hit_record& rec, const vec3& scatter_direction) const {
             // 求解入射光线与出射光线的中线
             vec3 half_dir = normalize(r_in.direction() + scatter_direction);
 
@@ -97,31 +211,33 @@ class BRDF : public material {
             // 求解入射光线与half dir的角度作为BRDF贴图的纵坐标
             double v = dot(normalize(r_in.direction()), half_dir);
 
-            scattered = ray(rec.p, scatter_direction, r_in.time());
-            attenuation = BRDF_texture->value(u, v, rec.p);
-            return true;
+            return BRDF_texture.value(u, v, rec.p);
         }
 
     public:
-        shared_ptr<texture> BRDF_texture;
+        compiled_texture BRDF_texture;
 };
 
 
-class metal : public material {
+class metal final : public material {
     /******************************
         金属材质
     ******************************/
     public:
-        metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+        metal(const color& a, double f) : material(material_type::metal), albedo(a), fuzz(f < 1 ? f : 1) {}
 
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const override {
+        bool scatter(
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+            sampler& smp
+        ) const {
             // 求解镜面反射光线方向
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
 
             // 根据粗糙程度对反射光线进行随机偏转
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(), r_in.time());
+            auto xi = smp.get_2d();
+            scattered = ray(rec.p, reflected + fuzz*sample_uniform_ball(xi.x(), xi.y(), smp.get_1d()), r_in.time());
+            if (fuzz == 0)
+                specular_differentials(r_in, rec, true, 1, scattered);
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
@@ -132,16 +248,17 @@ class metal : public material {
 };
 
 
-class dielectric : public material {
+class dielectric final : public material {
     /******************************
         非传导性介质材质
     ******************************/
     public:
-        dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+        dielectric(double index_of_refraction) : material(material_type::dielectric), ir(index_of_refraction) {}
 
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const override {
+        bool scatter(
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+            sampler& smp
+        ) const {
             // 透光率
             attenuation = color(1.0, 1.0, 1.0);
 
@@ -157,12 +274,14 @@ class dielectric : public material {
             vec3 direction;
 
             // 如果不能折射或者根据反射与折射比值进行抽样模拟模拟为反射时反射，否则折射
-            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+            bool reflected = cannot_refract || reflectance(cos_theta, refraction_ratio) > smp.get_1d();
+            if (reflected)
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, refraction_ratio);
 
             scattered = ray(rec.p, direction, r_in.time());
+            specular_differentials(r_in, rec, reflected, refraction_ratio, scattered);
             return true;
         }
 
@@ -179,48 +298,128 @@ class dielectric : public material {
 };
 
 
-class diffuse_light : public material {
+class diffuse_light final : public material {
     /******************************
         光照材质
     ******************************/
     public:
-        diffuse_light(shared_ptr<texture> a) : emit(a) {}
-        diffuse_light(color c) : emit(make_shared<solid_color>(c)) {}
+        diffuse_light(shared_ptr<texture> a) : material(material_type::diffuse_light), emit(a) {}
+        diffuse_light(color c) : material(material_type::diffuse_light), emit(c) {}
 
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const override {
+        bool scatter(
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+            sampler& smp
+        ) const {
             return false;
         }
 
-        virtual color emitted(double u, double v, const point3& p) const override {
+        color emitted(double u, double v, const point3& p, const texture_footprint& footprint) const {
             // 命中后返回贴图值
-            return emit->value(u, v, p);
+            return emit.value(u, v, p, footprint);
         }
 
     public:
-        shared_ptr<texture> emit;
+        compiled_texture emit;
 };
 
 
-class isotropic : public material {
+class isotropic final : public material {
     /******************************
         各项同性的
     ******************************/
     public:
-        isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
-        isotropic(shared_ptr<texture> a) : albedo(a) {}
+        isotropic(color c) : material(material_type::isotropic), albedo(c) {}
+        isotropic(shared_ptr<texture> a) : material(material_type::isotropic), albedo(a) {}
+
+        bool scatter(
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+            sampler& smp
+        ) const {
+            auto xi = smp.get_2d();
+            return scatter_to(r_in, rec, sample_uniform_sphere(xi.x(), xi.y()), attenuation, scattered);
+        }
 
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
-        ) const override {
-            scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
-            attenuation = albedo->value(rec.u, rec.v, rec.p);
+        bool scatter_to(
+            const ray& r_in, const hit_record& rec, const vec3& direction, color& attenuation, ray& scattered
+        ) const {
+            scattered = ray(rec.p, direction, r_in.time());
+            attenuation = albedo.value(rec.u, rec.v, rec.p);
             return true;
         }
 
+        // 各向同性的方向与法线无关
+        static void sample_n(int n, const double* u1, const double* u2, const double* nx, const double* ny,
+                             const double* nz, double* x, double* y, double* z) {
+            sample_uniform_sphere_n(n, u1, u2, x, y, z);
+        }
+
+        color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return albedo.value(rec.u, rec.v, rec.p) * uniform_sphere_pdf();
+        }
+
+        double pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+            return uniform_sphere_pdf();
+        }
+
     public:
-        shared_ptr<texture> albedo;
+        compiled_texture albedo;
 };
 
+// 按材质种类分发，只转到定义了该函数的材质，其余种类直接返回默认值
+inline color material::emitted(double u, double v, const point3& p, const texture_footprint& footprint) const {
+    switch (type) {
+        case material_type::diffuse_light:
+            return static_cast<const diffuse_light*>(this)->emitted(u, v, p, footprint);
+        case material_type::sky:
+            return static_cast<const sky*>(this)->emitted(u, v, p, footprint);
+        default:
+            return color(0,0,0);
+    }
+}
+
+inline color material::eval(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+    switch (type) {
+        case material_type::lambertian:
+            return static_cast<const lambertian*>(this)->eval(r_in, rec, direction);
+        case material_type::BRDF:
+            return static_cast<const BRDF*>(this)->eval(r_in, rec, direction);
+        case material_type::isotropic:
+            return static_cast<const isotropic*>(this)->eval(r_in, rec, direction);
+        default:
+            return color(0,0,0);
+    }
+}
+
+inline double material::pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const {
+    switch (type) {
+        case material_type::lambertian:
+            return static_cast<const lambertian*>(this)->pdf(r_in, rec, direction);
+        case material_type::BRDF:
+            return static_cast<const BRDF*>(this)->pdf(r_in, rec, direction);
+        case material_type::isotropic:
+            return static_cast<const isotropic*>(this)->pdf(r_in, rec, direction);
+        default:
+            return 0;
+    }
+}
+
+inline bool material::scatter(
+    const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& smp
+) const {
+    switch (type) {
+        case material_type::lambertian:
+            return static_cast<const lambertian*>(this)->scatter(r_in, rec, attenuation, scattered, smp);
+        case material_type::metal:
+            return static_cast<const metal*>(this)->scatter(r_in, rec, attenuation, scattered, smp);
+        case material_type::dielectric:
+            return static_cast<const dielectric*>(this)->scatter(r_in, rec, attenuation, scattered, smp);
+        case material_type::BRDF:
+            return static_cast<const BRDF*>(this)->scatter(r_in, rec, attenuation, scattered, smp);
+        case material_type::isotropic:
+            return static_cast<const isotropic*>(this)->scatter(r_in, rec, attenuation, scattered, smp);
+        default:
+            return false;
+    }
+}
+
 #endif
@@ -8,29 +8,42 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "material.h"
 #include "OBJ_Loader.hpp"
 
 
 class triangle : public hittable {
 public:
-    triangle() {}
+    triangle() : hittable(unnumbered()) {}
 
     triangle(point3 v0, point3 v1, point3 v2, shared_ptr<material> m)
-            : v0(v0), v1(v1), v2(v2), mat_ptr(m){
+            : hittable(unnumbered()), v0(v0), v1(v1), v2(v2), mat_ptr(m){
         e1 = v1 - v0;
         e2 = v2 - v0;
         normal = normalize(cross(e1, e2));
         area = cross(e1, e2).length() / 2;
+        // 贴图坐标为重心坐标 (u, v)
+        dpdu = e1;
+        dpdv = e2;
     }
 
     // 使用三角面顶点坐标，发现坐标，贴图坐标和材质类型初始化可碰撞对象。
     triangle(point3 v0, point3 v1, point3 v2, point3 n0, point3 n1, point3 n2, vec3 t0, vec3 t1, vec3 t2, shared_ptr<material> m)
-            : v0(v0), v1(v1), v2(v2), n0(n0), n1(n1), n2(n2), t0(t0), t1(t1), t2(t2), mat_ptr(m){
+            : hittable(unnumbered()), v0(v0), v1(v1), v2(v2), n0(n0), n1(n1), n2(n2), t0(t0), t1(t1), t2(t2), mat_ptr(m){
         e1 = v1 - v0;
         e2 = v2 - v0;
         has_normal = true;
         normal = normalize(cross(e1, e2));
         area = cross(e1, e2).length() / 2;
+
+        // 由三个顶点的贴图坐标之差解出位置对贴图坐标的导数，贴图坐标退化时为 0
+        vec3 duv02 = t0 - t2, duv12 = t1 - t2;
+        vec3 dp02 = v0 - v2, dp12 = v1 - v2;
+        auto det = duv02.x() * duv12.y() - duv02.y() * duv12.x();
+        if (fabs(det) > 1e-12) {
+            dpdu = (duv12.y() * dp02 - duv02.y() * dp12) / det;
+            dpdv = (duv02.x() * dp12 - duv12.x() * dp02) / det;
+        }
     }
 
     virtual bool hit(
@@ -38,6 +51,16 @@ public:
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual double pdf_value(const point3& origin, const vec3& v) const override;
+
+    virtual vec3 random(const point3& origin, double u1, double u2) const override;
+
+    virtual double sample_surface(double u1, double u2, hit_record& rec) const override;
+
+    virtual double power() const override {
+        return luminance(mat_ptr->emitted(t0.x(), t0.y(), v0)) * area;
+    }
+
 public:
     // 顶点坐标
     point3 v0;
@@ -52,6 +75,8 @@ public:
     point3 t0, t1, t2;
     // 三角面垂直面法线方向
     point3 normal;
+    // 位置对贴图坐标的导数
+    vec3 dpdu, dpdv;
     // 三角面面积
     double area;
     // 存储的对应材质
@@ -86,7 +111,7 @@ bool triangle::hit(const ray &r, double t_min, double t_max, hit_record &rec) co
     v *= invDet;
     if(has_normal){
         // 法线插值
-        rec.normal = (1 - u - v) * n0 + u * n1 + v * n2;
+        rec.normal = normalize((1 - u - v) * n0 + u * n1 + v * n2);
         // 贴图坐标插值求解
         vec3 text_p = (1 - u - v) * t0 + u * t1 + v * t2;
         rec.u = text_p.x();
@@ -98,9 +123,13 @@ bool triangle::hit(const ray &r, double t_min, double t_max, hit_record &rec) co
     }
     rec.t = tnear;
     rec.p = r.at(rec.t);
+    rec.dpdu = dpdu;
+    rec.dpdv = dpdv;
     vec3 outward_normal = rec.normal;
     rec.set_face_normal(r, outward_normal);
+    rec.geometric_normal = dot(normal, rec.normal) < 0 ? -normal : normal;
     rec.mat_ptr = mat_ptr;
+    rec.object_id = object_id;
 
     return true;
 }
@@ -110,6 +139,11 @@ bool triangle::bounding_box(double time0, double time1, aabb& output_box) const
     for(int i=0; i<3; i++){
         min.e[i] = std::min(std::min(v0.e[i], v1.e[i]), v2.e[i]);
         max.e[i] = std::max(std::max(v0.e[i], v1.e[i]), v2.e[i]);
+        // 与 aarect 相同，与坐标平面平行的三角面在该维度上的宽度为 0，稍微扩大，BVH 与光源 BVH 的包围盒不退化
+        if (max.e[i] - min.e[i] < 0.0002) {
+            min.e[i] -= 0.0001;
+            max.e[i] += 0.0001;
+        }
     }
     output_box = aabb(
             min,
@@ -117,39 +151,92 @@ bool triangle::bounding_box(double time0, double time1, aabb& output_box) const
     return true;
 }
 
-shared_ptr<hittable> read_obj_model_triangle(const std::string& filename, shared_ptr<material> m, vec3 trans, vec3 rotation, vec3 scale){
+double triangle::pdf_value(const point3& origin, const vec3& v) const {
+    hit_record rec;
+    if (!this->hit(ray(origin, v), 0.001, infinity, rec))
+        return 0;
+
+    // 面积采样换算到立体角
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(dot(v, normal) / v.length());
+    return distance_squared / (cosine * area);
+}
+
+vec3 triangle::random(const point3& origin, double u1, double u2) const {
+    auto b = sample_uniform_triangle(u1, u2);
+    return v0 + b.y() * e1 + b.z() * e2 - origin;
+}
+
+double triangle::sample_surface(double u1, double u2, hit_record& rec) const {
+    // 三角形只有正面可以被光线命中，法线取几何法线
+    auto b = sample_uniform_triangle(u1, u2);
+    rec.p = v0 + b.y() * e1 + b.z() * e2;
+    rec.normal = normal;
+    if (has_normal) {
+        vec3 text_p = b.x() * t0 + b.y() * t1 + b.z() * t2;
+        rec.u = text_p.x();
+        rec.v = text_p.y();
+    } else {
+        rec.u = b.y();
+        rec.v = b.z();
+    }
+    rec.mat_ptr = mat_ptr;
+    return area;
+}
+
+// 读取 OBJ 文件中第一个网格的顶点，每 3 个顶点为一个三角面
+std::vector<objl::Vertex> read_obj_vertices(const std::string& filename){
     objl::Loader loader;
-    hittable_list mesh_tri;
     loader.LoadFile(filename);
-    std::vector<shared_ptr<hittable>> obj_list;
 
     // above !!;
     //assert(loader.LoadedMeshes.size() == 1);
-    auto mesh = loader.LoadedMeshes[0];
-    // 读取模型
-    std::cout << "model size: " << mesh.Vertices.size() / 3 << std::endl;
+    return loader.LoadedMeshes[0].Vertices;
+}
 
-    // 创建三角面碰撞对象
-    for (int i = 0; i < mesh.Vertices.size(); i += 3){
+// 按 scale 缩放顶点坐标，创建使用材质 m 的三角面碰撞对象
+hittable_list make_mesh_triangles(const std::vector<objl::Vertex>& vertices, shared_ptr<material> m, vec3 scale){
+    hittable_list mesh_tri;
+    for (int i = 0; i < vertices.size(); i += 3){
         // TODO: add trans & rotation
         mesh_tri.add(make_shared<triangle>(
-                        point3(mesh.Vertices[i+0].Position.X * scale.x(), mesh.Vertices[i+0].Position.Y * scale.y(), mesh.Vertices[i+0].Position.Z* scale.z()),
-                        point3(mesh.Vertices[i+1].Position.X * scale.x(), mesh.Vertices[i+1].Position.Y * scale.y(), mesh.Vertices[i+1].Position.Z* scale.z()),
-                        point3(mesh.Vertices[i+2].Position.X * scale.x(), mesh.Vertices[i+2].Position.Y * scale.y(), mesh.Vertices[i+2].Position.Z* scale.z()),
-                        point3(mesh.Vertices[i+0].Normal.X, mesh.Vertices[i+0].Normal.Y, mesh.Vertices[i+0].Normal.Z),
-                        point3(mesh.Vertices[i+1].Normal.X, mesh.Vertices[i+1].Normal.Y, mesh.Vertices[i+1].Normal.Z),
-                        point3(mesh.Vertices[i+2].Normal.X, mesh.Vertices[i+2].Normal.Y, mesh.Vertices[i+2].Normal.Z),
-                        point3(mesh.Vertices[i+0].TextureCoordinate.X, mesh.Vertices[i+0].TextureCoordinate.Y, 0),
-                        point3(mesh.Vertices[i+1].TextureCoordinate.X, mesh.Vertices[i+1].TextureCoordinate.Y, 0),
-                        point3(mesh.Vertices[i+2].TextureCoordinate.X, mesh.Vertices[i+2].TextureCoordinate.Y, 0),
+                        point3(vertices[i+0].Position.X * scale.x(), vertices[i+0].Position.Y * scale.y(), vertices[i+0].Position.Z* scale.z()),
+                        point3(vertices[i+1].Position.X * scale.x(), vertices[i+1].Position.Y * scale.y(), vertices[i+1].Position.Z* scale.z()),
+                        point3(vertices[i+2].Position.X * scale.x(), vertices[i+2].Position.Y * scale.y(), vertices[i+2].Position.Z* scale.z()),
+                        point3(vertices[i+0].Normal.X, vertices[i+0].Normal.Y, vertices[i+0].Normal.Z),
+                        point3(vertices[i+1].Normal.X, vertices[i+1].Normal.Y, vertices[i+1].Normal.Z),
+                        point3(vertices[i+2].Normal.X, vertices[i+2].Normal.Y, vertices[i+2].Normal.Z),
+                        point3(vertices[i+0].TextureCoordinate.X, vertices[i+0].TextureCoordinate.Y, 0),
+                        point3(vertices[i+1].TextureCoordinate.X, vertices[i+1].TextureCoordinate.Y, 0),
+                        point3(vertices[i+2].TextureCoordinate.X, vertices[i+2].TextureCoordinate.Y, 0),
                            m));
     }
+    return mesh_tri;
+}
+
+// 把建好 BVH 的网格绕 y 轴旋转后平移到场景中；lights 不为空时，发光材质的每个三角面都会以世界坐标加入光源列表
+shared_ptr<hittable> place_mesh(shared_ptr<hittable> mesh_bvh, const hittable_list& mesh_tri, vec3 trans, vec3 rotation,
+                                hittable_list* lights = nullptr){
+    if (lights && mesh_tri.power() > 0) {
+        for (const auto& tri : mesh_tri.objects)
+            lights->add(make_shared<translate>(make_shared<rotate_y>(tri, rotation.y()), trans));
+    }
 
     return make_shared<translate>(
-            make_shared<rotate_y>(
-                    make_shared<bvh_node>(mesh_tri, 0.0, 1.0), rotation.y()),
+            make_shared<rotate_y>(mesh_bvh, rotation.y()),
             vec3(trans));
+}
+
+// lights 不为空时，发光材质的每个三角面都会以世界坐标加入光源列表
+shared_ptr<hittable> read_obj_model_triangle(const std::string& filename, shared_ptr<material> m, vec3 trans, vec3 rotation, vec3 scale,
+                                             hittable_list* lights = nullptr){
+    auto vertices = read_obj_vertices(filename);
+    // 读取模型
+    std::cout << "model size: " << vertices.size() / 3 << std::endl;
 
+    // 创建三角面碰撞对象
+    auto mesh_tri = make_mesh_triangles(vertices, m, scale);
+    return place_mesh(make_shared<bvh_node>(mesh_tri, 0.0, 1.0), mesh_tri, trans, rotation, lights);
 }
 
 shared_ptr<hittable> read_obj_model_triangle_no_bvh(const std::string& filename, shared_ptr<material> m, vec3 trans, vec3 rotation, vec3 scale){
@@ -79,6 +79,7 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     vec3 outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mat_ptr;
+    rec.object_id = object_id;
 
     return true;
 }
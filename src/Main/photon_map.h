@@ -0,0 +1,305 @@
+//
+// Created by Qiuzhe on 2021/6/30.
+//
+
+#ifndef RTWEEKEND_PHOTON_MAP_H
+#define RTWEEKEND_PHOTON_MAP_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "environment.h"
+#include "hittable.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <vector>
+
+
+struct photon {
+    point3 p;
+    vec3 direction; // 光子的传播方向(单位向量)
+    color power;
+};
+
+
+class photon_map {
+    /******************************
+        焦散光子图：渲染前从光源与天空盒发射光子，沿镜面反射/折射链传播，
+        只在经过至少一次镜面散射后到达的第一个非镜面表面上存储(L S+ D 路径)，其余光子直接丢弃。
+        光子按边长为 2*radius 的网格单元哈希后排序存储，查询时只访问以着色点为中心、半径为 radius 的球覆盖的 2x2x2 个单元，
+        用 Epanechnikov 核估计该点的焦散出射亮度。
+        第 i 个光子使用 Sobol 序列的第 i 个样本，按块多线程发射后按块的顺序合并，结果与线程调度无关。
+        天空盒的光子只射向镜面物体：先用少量光子在整个场景上找出首次命中镜面的区域，再从该区域的包围球的投影圆盘上发射
+    ******************************/
+    public:
+        // photon_count 为发射的光子数，radius 为密度估计的半径，不大于 0 时取场景包围盒对角线的 0.25%
+        photon_map(int photon_count, double radius) : photon_count(photon_count), radius(radius) {}
+
+        void build(const environment& env, const hittable& world, const light_bvh& lights, int max_depth) {
+            aabb scene_box;
+            if (!world.bounding_box(0, 1, scene_box))
+                return;
+            scene_center = 0.5 * (scene_box.min() + scene_box.max());
+            scene_radius = 0.5 * (scene_box.max() - scene_box.min()).length();
+            if (radius <= 0)
+                radius = 0.005 * scene_radius;
+
+            if (env.importance_sampled())
+                find_specular_target(env, world);
+            // 光源与环境光都存在时各占一半光子，与光源采样的选择概率相同
+            p_env = target_radius <= 0 ? 0.0 : lights.empty() ? 1.0 : 0.5;
+            if (p_env <= 0 && lights.empty())
+                return;
+
+            std::vector<std::vector<photon>> chunks((photon_count + chunk_size - 1) / chunk_size);
+            auto prototype = make_sampler("sobol", photon_count);
+#pragma omp parallel num_threads(6)
+            {
+                auto smp = prototype->clone();
+#pragma omp for schedule(dynamic, 1)
+                for (int c = 0; c < static_cast<int>(chunks.size()); ++c) {
+                    int end = std::min((c + 1) * chunk_size, photon_count);
+                    for (int i = c * chunk_size; i < end; ++i)
+                        trace_photon(i, env, world, lights, max_depth, *smp, chunks[c]);
+                }
+            }
+
+            std::vector<photon> stored;
+            for (const auto& chunk : chunks)
+                stored.insert(stored.end(), chunk.begin(), chunk.end());
+            build_grid(stored);
+        }
+
+        // 命中点 rec 上沿 -r 方向出射的焦散亮度
+        color estimate(const ray& r, const hit_record& rec) const {
+            color sum(0, 0, 0);
+            if (photons.empty())
+                return sum;
+
+            const double radius_squared = radius * radius;
+            const double cell = 2 * radius;
+            int lo[3], hi[3];
+            for (int k = 0; k < 3; ++k) {
+                lo[k] = static_cast<int>(floor((rec.p[k] - radius) / cell));
+                hi[k] = static_cast<int>(floor((rec.p[k] + radius) / cell));
+            }
+
+            // 不同单元可能落入同一个哈希桶，每个桶只访问一次
+            size_t visited[8];
+            int visited_count = 0;
+            for (int x = lo[0]; x <= hi[0]; ++x) {
+                for (int y = lo[1]; y <= hi[1]; ++y) {
+                    for (int z = lo[2]; z <= hi[2]; ++z) {
+                        auto bucket = hash(x, y, z);
+                        if (std::find(visited, visited + visited_count, bucket) != visited + visited_count)
+                            continue;
+                        visited[visited_count++] = bucket;
+
+                        for (auto i = bucket_start[bucket]; i < bucket_start[bucket + 1]; ++i) {
+                            const auto& q = photons[i];
+                            auto offset = q.p - rec.p;
+                            auto distance_squared = offset.length_squared();
+                            // 圆盘形的核：离切平面过远的光子属于其他表面
+                            if (distance_squared >= radius_squared || fabs(dot(offset, rec.normal)) > 0.25 * radius)
+                                continue;
+                            auto cosine = -dot(q.direction, rec.normal);
+                            if (cosine <= 0)
+                                continue;
+                            // eval 为 BSDF * cos，光子密度已包含投影面积，除去 cos 只保留 BSDF
+                            auto f = rec.mat_ptr->eval(r, rec, -q.direction) / cosine;
+                            sum += f * q.power * (1 - distance_squared / radius_squared);
+                        }
+                    }
+                }
+            }
+            // Epanechnikov 核在圆盘上的归一化系数为 2/(pi r^2)
+            return sum * (2 / (pi * radius_squared));
+        }
+
+        // 光子是否来自光源列表；此时经镜面链命中发光物体的路径由光子图负责
+        bool emits_lights() const {
+            return p_env < 1 && !photons.empty();
+        }
+
+        // 光子是否来自天空盒；此时经镜面链射向环境光的路径由光子图负责
+        bool emits_environment() const {
+            return p_env > 0 && !photons.empty();
+        }
+
+        size_t size() const {
+            return photons.size();
+        }
+
+        double gather_radius() const {
+            return radius;
+        }
+
+    private:
+        void trace_photon(int index, const environment& env, const hittable& world, const light_bvh& lights,
+                          int max_depth, sampler& smp, std::vector<photon>& out) const {
+            smp.start_pixel_sample(0, 0, index);
+            ray r;
+            color power;
+            auto u = smp.get_1d();
+            if (u < p_env) {
+                if (!emit_environment(env, u / p_env, smp, r, power))
+                    return;
+                power /= p_env;
+            } else {
+                if (!emit_light(lights, (u - p_env) / (1 - p_env), smp, r, power))
+                    return;
+                power /= 1 - p_env;
+            }
+            power /= photon_count;
+
+            bool specular = false;
+            for (int depth = 0; depth < max_depth; ++depth) {
+                hit_record rec;
+                if (!world.hit(r, 0.001, infinity, rec))
+                    return;
+
+                ray scattered;
+                color attenuation;
+                if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered, smp))
+                    return;
+                if (rec.mat_ptr->pdf(r, rec, scattered.direction()) > 0) {
+                    // 非镜面表面：只保留经过镜面链的光子
+                    if (specular)
+                        out.push_back(photon{rec.p, unit_vector(r.direction()), power});
+                    return;
+                }
+
+                // 按衰减做轮盘赌，存活的光子功率保持不变
+                specular = true;
+                auto survive = fmin(fmax(attenuation.x(), fmax(attenuation.y(), attenuation.z())), 1.0);
+                if (smp.get_1d() >= survive)
+                    return;
+                power = power * attenuation / survive;
+                r = scattered;
+            }
+        }
+
+        // 按功率选择光源并在其表面上采样发射位置与方向，光子功率为 Le * cos / (面积 pdf * 方向 pdf)
+        bool emit_light(const light_bvh& lights, double u, sampler& smp, ray& r, color& power) const {
+            hit_record rec;
+            vec3 direction;
+            double pdf_area, pdf_direction;
+            auto xi_position = smp.get_2d();
+            auto xi_direction = smp.get_2d();
+            if (!lights.sample_emission(u, xi_position, xi_direction, rec, direction, pdf_area, pdf_direction))
+                return false;
+
+            auto cosine = fabs(dot(rec.normal, direction));
+            power = rec.mat_ptr->emitted(rec.u, rec.v, rec.p) * (cosine / (pdf_area * pdf_direction));
+            r = ray(rec.p, direction);
+            return max_component(power) > 0;
+        }
+
+        // 按环境光的分布采样方向 w，光子从场景外沿 -w 射向镜面区域的包围球，起点在垂直于 w 的圆盘上均匀分布
+        bool emit_environment(const environment& env, double u, sampler& smp, ray& r, color& power) const {
+            auto xi = smp.get_2d();
+            auto w = unit_vector(env.sample(u, xi.x(), xi.y()));
+            auto pdf = env.pdf(w);
+            if (pdf <= 0)
+                return false;
+
+            xi = smp.get_2d();
+            auto disk = sample_uniform_disk_concentric(xi.x(), xi.y());
+            auto origin = target_center + local_to_world(w, disk * target_radius)
+                          + w * (target_radius + 2 * scene_radius);
+            r = ray(origin, -w);
+            power = env.value(ray(origin, w)) * (pi * target_radius * target_radius / pdf);
+            return max_component(power) > 0;
+        }
+
+        // 天空盒的光子在整个场景的圆盘上发射时大多射不到镜面物体。先发射 pilot_count 个光子，
+        // 以首次命中镜面的点的包围球作为正式发射的目标
+        void find_specular_target(const environment& env, const hittable& world) {
+            target_center = scene_center;
+            target_radius = scene_radius;
+            auto smp = make_sampler("sobol", pilot_count, 1);
+            point3 lo(infinity, infinity, infinity), hi(-infinity, -infinity, -infinity);
+            for (int i = 0; i < pilot_count; ++i) {
+                smp->start_pixel_sample(0, 0, i);
+                ray r;
+                color power;
+                if (!emit_environment(env, smp->get_1d(), *smp, r, power))
+                    continue;
+                hit_record rec;
+                ray scattered;
+                color attenuation;
+                if (!world.hit(r, 0.001, infinity, rec) ||
+                    !rec.mat_ptr->scatter(r, rec, attenuation, scattered, *smp) ||
+                    rec.mat_ptr->pdf(r, rec, scattered.direction()) > 0)
+                    continue;
+                for (int k = 0; k < 3; ++k) {
+                    lo[k] = fmin(lo[k], rec.p[k]);
+                    hi[k] = fmax(hi[k], rec.p[k]);
+                }
+            }
+            if (lo.x() > hi.x()) {
+                target_radius = 0;
+                return;
+            }
+            // 首次命中点只覆盖镜面物体朝外的一侧，包围球适当放大
+            target_center = 0.5 * (lo + hi);
+            target_radius = 0.6 * (hi - lo).length() + radius;
+        }
+
+        // 按哈希桶做计数排序，同一个桶内的光子连续存储
+        void build_grid(const std::vector<photon>& stored) {
+            size_t table_size = 1;
+            while (table_size < stored.size())
+                table_size <<= 1;
+            table_mask = table_size - 1;
+
+            std::vector<size_t> buckets(stored.size());
+            bucket_start.assign(table_size + 1, 0);
+            const double cell = 2 * radius;
+            for (size_t i = 0; i < stored.size(); ++i) {
+                buckets[i] = hash(static_cast<int>(floor(stored[i].p.x() / cell)),
+                                  static_cast<int>(floor(stored[i].p.y() / cell)),
+                                  static_cast<int>(floor(stored[i].p.z() / cell)));
+                bucket_start[buckets[i] + 1] += 1;
+            }
+            for (size_t b = 0; b < table_size; ++b)
+                bucket_start[b + 1] += bucket_start[b];
+
+            photons.resize(stored.size());
+            std::vector<size_t> next(bucket_start.begin(), bucket_start.end() - 1);
+            for (size_t i = 0; i < stored.size(); ++i)
+                photons[next[buckets[i]]++] = stored[i];
+        }
+
+        size_t hash(int x, int y, int z) const {
+            auto h = (static_cast<uint32_t>(x) * 73856093u) ^ (static_cast<uint32_t>(y) * 19349663u) ^
+                     (static_cast<uint32_t>(z) * 83492791u);
+            return h & table_mask;
+        }
+
+        static double max_component(const color& c) {
+            return fmax(c.x(), fmax(c.y(), c.z()));
+        }
+
+    private:
+        static const int chunk_size = 4096;
+        static const int pilot_count = 1 << 16;
+
+        int photon_count;
+        double radius;
+        double p_env = 0; // 光子从天空盒发射的概率
+
+        point3 scene_center;
+        double scene_radius = 0;
+        point3 target_center; // 天空盒光子射向的镜面区域
+        double target_radius = 0;
+
+        std::vector<photon> photons;
+        std::vector<size_t> bucket_start; // 第 b 个桶的光子为 photons[bucket_start[b], bucket_start[b+1])
+        size_t table_mask = 0;
+};
+
+#endif //RTWEEKEND_PHOTON_MAP_H
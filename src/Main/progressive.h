@@ -0,0 +1,114 @@
+//
+// Created by Qiuzhe on 2021/6/26.
+//
+
+#ifndef RTWEEKEND_PROGRESSIVE_H
+#define RTWEEKEND_PROGRESSIVE_H
+
+#include "rtweekend.h"
+
+#include "adaptive.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <vector>
+
+
+// 解析时间预算："30s"、"2m"、"500ms"、"1h"，不带单位时按秒计；格式错误返回负数
+inline double parse_duration(const std::string& text) {
+    char* end = nullptr;
+    auto value = strtod(text.c_str(), &end);
+    if (end == text.c_str() || value < 0)
+        return -1;
+
+    std::string unit(end);
+    if (unit.empty() || unit == "s")
+        return value;
+    if (unit == "ms")
+        return value / 1000;
+    if (unit == "m" || unit == "min")
+        return value * 60;
+    if (unit == "h")
+        return value * 3600;
+    return -1;
+}
+
+
+class progressive_render {
+    /******************************
+        渐进式渲染的停止条件：每一遍为整幅图像的每个像素追加一个样本，累积在 framebuffer 中，
+        到达截止时间、图像噪声(各像素显示空间标准误差的均方根)低于目标值、达到样本上限或收到 Ctrl-C 时停止。
+        截止时间在像素粒度上检查，最后一遍可以只完成一部分像素，输出时按每个像素实际的样本数归一化。
+    ******************************/
+    public:
+        progressive_render(int pixel_count, double start, double time_budget, double target_noise, int max_spp)
+            : deadline(time_budget > 0 ? start + time_budget : infinity), target_noise(target_noise),
+              max_spp(max_spp > 0 ? max_spp : std::numeric_limits<int>::max()) {
+            if (target_noise > 0)
+                statistics.resize(pixel_count);
+            interrupted() = 0;
+            std::signal(SIGINT, [](int) { interrupted() = 1; });
+        }
+
+        ~progressive_render() {
+            std::signal(SIGINT, SIG_DFL);
+        }
+
+        // 当前时刻是否应当放弃剩余的像素
+        bool expired(double now) const {
+            return now >= deadline || interrupted();
+        }
+
+        void add(int index, const color& sample) {
+            if (!statistics.empty())
+                statistics[index].add(luminance(sample));
+        }
+
+        // 所有像素误差的均方根；未统计噪声时返回 0
+        double noise() const {
+            if (statistics.empty())
+                return 0;
+            double sum = 0;
+            for (const auto& s : statistics)
+                sum += s.error() * s.error();
+            return sqrt(sum / statistics.size());
+        }
+
+        // 一遍结束后判断是否继续，passes 为已完成的遍数
+        bool finished(int passes, double now) {
+            if (expired(now)) {
+                reason = interrupted() ? "interrupted" : "deadline";
+                return true;
+            }
+            if (passes >= max_spp) {
+                reason = "max spp";
+                return true;
+            }
+            if (target_noise > 0 && passes >= min_passes && noise() <= target_noise) {
+                reason = "target noise";
+                return true;
+            }
+            return false;
+        }
+
+    public:
+        const char* reason = "";
+
+    private:
+        static volatile std::sig_atomic_t& interrupted() {
+            static volatile std::sig_atomic_t flag = 0;
+            return flag;
+        }
+
+    private:
+        static const int min_passes = 4; // 样本太少时方差估计不可靠
+
+        double deadline;
+        double target_noise;
+        int max_spp;
+        std::vector<pixel_statistics> statistics;
+};
+
+#endif //RTWEEKEND_PROGRESSIVE_H
@@ -0,0 +1,258 @@
+//
+// Created by Qiuzhe on 2021/7/2.
+//
+
+#ifndef RTWEEKEND_RADIANCE_CACHE_H
+#define RTWEEKEND_RADIANCE_CACHE_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "hittable.h"
+#include "material.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+// 填充缓存的路径上的一个非镜面顶点
+struct cache_vertex {
+    point3 p;
+    vec3 normal;
+    int material_id;
+    color throughput; // 到达该顶点时路径的累计衰减
+    color radiance;   // 到该顶点的光源采样为止路径已累计的亮度
+};
+
+
+class radiance_cache {
+    /******************************
+        世界空间的辐射缓存：按 (网格单元, 法线最接近的坐标轴方向, 材质) 哈希，存储非镜面顶点向上一个顶点散射的间接光照，
+        不含该顶点自身的发光与光源采样。渲染前用 fill_samples 个样本的路径追踪填充：一条路径结束后，
+        某个顶点之后累计的亮度除以到达该顶点时的 throughput 即为该顶点的间接光照。
+        渲染时路径在第 depth 次非镜面散射之后的顶点上做完光源采样，用周围 8 个单元中心的三线性插值结束路径，省去之后的弹射。
+        偏差由单元大小与 depth 控制：单元越大、depth 越小越快，漏光与模糊越明显；样本数不足 min_samples 的单元视为缺失，路径照常继续
+    ******************************/
+    public:
+        // depth 为路径在缓存中结束之前的非镜面散射次数(至少为 1)，cell_size 不大于 0 时取场景包围盒对角线的 1%
+        radiance_cache(int depth, double cell_size, int fill_samples)
+            : depth(std::max(depth, 1)), cell_size(cell_size), fill_samples(std::max(fill_samples, 1)) {}
+
+        // trace(i, j, s, smp, path) 追踪像素 (i, j) 的第 s 个样本，返回亮度并在 path 中记录各非镜面顶点
+        template <typename Trace>
+        void build(const hittable& world, int width, int height, const sampler& prototype, Trace trace) {
+            aabb box;
+            if (!world.bounding_box(0, 1, box))
+                return;
+            if (cell_size <= 0)
+                cell_size = 0.01 * (box.max() - box.min()).length();
+
+            // 每行的样本在填充时按单元合并到该行的表中，最后按行的顺序合并，结果与线程调度无关
+            std::vector<entry_table> rows(height);
+#pragma omp parallel num_threads(6)
+            {
+                auto smp = prototype.clone();
+                std::vector<cache_vertex> path;
+#pragma omp for schedule(dynamic, 1)
+                for (int j = 0; j < height; ++j) {
+                    for (int i = 0; i < width; ++i) {
+                        for (int s = 0; s < fill_samples; ++s) {
+                            path.clear();
+                            auto total = trace(i, j, s, *smp, path);
+                            for (const auto& v : path)
+                                add_sample(v, total, rows[j]);
+                        }
+                    }
+                }
+            }
+
+            size_t total = 0;
+            for (const auto& row : rows)
+                total += row.size();
+            table = entry_table();
+            table.reserve(total);
+            for (const auto& row : rows)
+                row.merge_into(table);
+        }
+
+        // 命中点 rec 向 -r 方向散射的间接光照；周围的单元都缺失时返回 false
+        bool lookup(const hit_record& rec, color& radiance) const {
+            if (table.empty())
+                return false;
+            int axis = normal_axis(rec.normal);
+            int material = rec.mat_ptr->id;
+
+            // 以单元中心为格点做三线性插值，缺失的格点不参与，权重重新归一化
+            double f[3];
+            int base[3];
+            for (int k = 0; k < 3; ++k) {
+                auto x = rec.p[k] / cell_size - 0.5;
+                base[k] = static_cast<int>(floor(x));
+                f[k] = x - base[k];
+            }
+            color sum(0, 0, 0);
+            double weight = 0;
+            for (int corner = 0; corner < 8; ++corner) {
+                int c[3];
+                double w = 1;
+                for (int k = 0; k < 3; ++k) {
+                    int bit = (corner >> k) & 1;
+                    c[k] = base[k] + bit;
+                    w *= bit ? f[k] : 1 - f[k];
+                }
+                if (w <= 0)
+                    continue;
+                const auto* e = table.find(pack(c[0], c[1], c[2], axis), material);
+                if (!e || e->count < min_samples)
+                    continue;
+                sum += w * e->value / e->count;
+                weight += w;
+            }
+            if (weight <= 0)
+                return false;
+            radiance = sum / weight;
+            return true;
+        }
+
+        int terminate_depth() const {
+            return depth;
+        }
+
+        double cell() const {
+            return cell_size;
+        }
+
+        size_t size() const {
+            return table.size();
+        }
+
+    private:
+        static const uint64_t empty_key = ~0ULL;
+
+        struct cache_entry {
+            uint64_t key = empty_key;     // 单元坐标与法线方向
+            int material = 0;             // 完整的材质编号，与 key 一起比较
+            color value = color(0, 0, 0); // 样本之和
+            int count = 0;
+        };
+
+        class entry_table {
+            /******************************
+                开放寻址的哈希表，线性探测，相同 (key, 材质) 的样本合并为一项，装载率超过一半时容量加倍
+            ******************************/
+            public:
+                void reserve(size_t n) {
+                    size_t capacity = 16;
+                    while (capacity < 2 * n)
+                        capacity <<= 1;
+                    if (capacity > slots.size())
+                        rehash(capacity);
+                }
+
+                void add(const cache_entry& s) {
+                    if (2 * (count + 1) > slots.size())
+                        rehash(std::max<size_t>(16, 2 * slots.size()));
+                    auto& e = slots[probe(s.key, s.material)];
+                    if (e.key == empty_key) {
+                        e.key = s.key;
+                        e.material = s.material;
+                        count += 1;
+                    }
+                    e.value += s.value;
+                    e.count += s.count;
+                }
+
+                const cache_entry* find(uint64_t key, int material) const {
+                    if (slots.empty())
+                        return nullptr;
+                    const auto& e = slots[probe(key, material)];
+                    return e.key == empty_key ? nullptr : &e;
+                }
+
+                // 按槽位顺序加入 other，顺序只取决于本表的内容
+                void merge_into(entry_table& other) const {
+                    for (const auto& e : slots)
+                        if (e.key != empty_key)
+                            other.add(e);
+                }
+
+                size_t size() const {
+                    return count;
+                }
+
+                bool empty() const {
+                    return count == 0;
+                }
+
+            private:
+                // (key, material) 所在的槽位，不存在时为应插入的空槽位
+                size_t probe(uint64_t key, int material) const {
+                    auto h = key ^ (static_cast<uint64_t>(static_cast<uint32_t>(material)) * 0x9E3779B97F4A7C15ULL);
+                    h ^= h >> 33;
+                    h *= 0xff51afd7ed558ccdULL;
+                    h ^= h >> 33;
+                    auto mask = slots.size() - 1;
+                    auto i = static_cast<size_t>(h) & mask;
+                    while (slots[i].key != empty_key && (slots[i].key != key || slots[i].material != material))
+                        i = (i + 1) & mask;
+                    return i;
+                }
+
+                void rehash(size_t capacity) {
+                    std::vector<cache_entry> old(capacity);
+                    old.swap(slots);
+                    count = 0;
+                    for (const auto& e : old)
+                        if (e.key != empty_key)
+                            add(e);
+                }
+
+            private:
+                std::vector<cache_entry> slots;
+                size_t count = 0;
+        };
+
+        // 顶点之后累计的亮度按通道除以 throughput
+        void add_sample(const cache_vertex& v, const color& total, entry_table& out) const {
+            color value;
+            for (int k = 0; k < 3; ++k)
+                value[k] = v.throughput[k] > 0 ? fmax(total[k] - v.radiance[k], 0.0) / v.throughput[k] : 0;
+            if (value.x() != value.x() || value.y() != value.y() || value.z() != value.z())
+                return;
+            cache_entry e;
+            e.key = pack(static_cast<int>(floor(v.p.x() / cell_size)), static_cast<int>(floor(v.p.y() / cell_size)),
+                         static_cast<int>(floor(v.p.z() / cell_size)), normal_axis(v.normal));
+            e.material = v.material_id;
+            e.value = value;
+            e.count = 1;
+            out.add(e);
+        }
+
+        // 单元坐标各 17 位，法线方向 3 位；材质编号不压缩，单独存放在表项中
+        static uint64_t pack(int x, int y, int z, int axis) {
+            auto field = [](int c) { return static_cast<uint64_t>(c + (1 << 16)) & 0x1FFFF; };
+            return (field(x) << 37) | (field(y) << 20) | (field(z) << 3) | static_cast<uint64_t>(axis);
+        }
+
+        // 法线最接近的坐标轴方向，0-5 依次为 +x -x +y -y +z -z
+        static int normal_axis(const vec3& n) {
+            int k = 0;
+            for (int i = 1; i < 3; ++i)
+                if (fabs(n[i]) > fabs(n[k]))
+                    k = i;
+            return 2 * k + (n[k] < 0 ? 1 : 0);
+        }
+
+    private:
+        static const int min_samples = 4;
+
+        int depth;
+        double cell_size;
+        int fill_samples;
+
+        entry_table table;
+};
+
+#endif //RTWEEKEND_RADIANCE_CACHE_H
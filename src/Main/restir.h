@@ -0,0 +1,359 @@
+//
+// Created by Qiuzhe on 2021/6/24.
+//
+
+#ifndef RTWEEKEND_RESTIR_H
+#define RTWEEKEND_RESTIR_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "environment.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "sampler.h"
+
+#include <vector>
+
+
+// 光源上的一个采样点；环境光的采样点位于无穷远，position 存放方向
+struct light_sample {
+    point3 position;
+    vec3 normal;
+    color emission;
+    bool at_infinity = false;
+    const hittable* light = nullptr;
+};
+
+
+struct reservoir {
+    /******************************
+        加权蓄水池采样：依次输入带权重的候选样本，只保留一个，
+        每个候选被保留的概率与其权重成正比
+    ******************************/
+    light_sample y;
+    double w_sum = 0; // 权重之和
+    double M = 0;     // 已经输入的候选数
+    double W = 0;     // 保留样本的无偏贡献权重
+
+    bool update(const light_sample& sample, double w, double u) {
+        w_sum += w;
+        M += 1;
+        if (w > 0 && u * w_sum < w) {
+            y = sample;
+            return true;
+        }
+        return false;
+    }
+};
+
+
+// 路径上第一个非镜面顶点(经过镜面反射/折射的链后)，即做直接光照的着色点
+struct restir_surface {
+    bool valid = false;
+    ray r;
+    hit_record rec;
+    color throughput;
+    double depth = 0;  // 从相机出发的路径长度，用于邻域筛选
+};
+
+
+struct restir_options {
+    int candidates = 32;        // 每像素初始候选光源样本数
+    int spatial_neighbors = 5;  // 空间复用的邻域像素数
+    double spatial_radius = 10; // 空间复用的邻域半径(像素)
+    int temporal_history = 20;  // 时间复用时历史 M 的上限(当前 M 的倍数)
+    bool temporal = true;
+};
+
+
+class restir {
+    /******************************
+        基于蓄水池重采样(ReSTIR)的直接光照：
+        1. 每像素从光源 BVH / 环境光生成若干候选样本，按未遮挡的贡献做重采样(RIS)，保留一个并检查可见性；
+        2. 与上一帧同一像素的蓄水池合并(时间复用)；
+        3. 与屏幕空间邻域中几何相近的像素合并(空间复用)；
+        4. 用最终保留的样本发出阴影光线着色。
+        光源样本在面积测度下定义，不同像素之间可以直接复用；合并时用广义 balance heuristic 加权，
+        并按法线、深度与材质筛选邻域。每一帧为每个像素贡献一个样本。
+    ******************************/
+    public:
+        restir(int width, int height, restir_options opt = restir_options())
+            : image_width(width), image_height(height), options(opt),
+              surfaces(width * height), reservoirs(width * height),
+              prev_surfaces(width * height), prev_reservoirs(width * height), emitted(width * height) {}
+
+        void render_frame(
+                const camera& cam, const environment& env, const hittable& world, const light_bvh& lights,
+                int max_depth, const sampler& pixel_sampler, int frame, std::vector<color>& framebuffer) {
+
+            // 初始候选、可见性检查与时间复用
+#pragma omp parallel num_threads(6)
+            {
+                auto smp = pixel_sampler.clone();
+                // 每个线程复用的合并缓冲，避免每个像素分配
+                std::vector<reservoir> sources;
+                std::vector<const restir_surface*> sources_surface;
+#pragma omp for collapse(2) schedule(dynamic, 8)
+                for (int j = image_height - 1; j >= 0; j--) {
+                    for (int i = 0; i < image_width; ++i) {
+                        auto index = (image_height - j - 1) * image_width + i;
+                        smp->start_pixel_sample(i, j, frame);
+                        auto jitter = smp->get_2d();
+                        auto u = (i + jitter.x()) / (image_width - 1);
+                        auto v = (j + jitter.y()) / (image_height - 1);
+                        auto& s = surfaces[index];
+                        emitted[index] = trace_surface(cam.get_ray(u, v, *smp), env, world, max_depth, *smp, s);
+
+                        uint32_t rng = hash_combine(hash_combine(frame, i), j);
+                        reservoir r;
+                        if (s.valid)
+                            r = initial_candidates(s, env, world, lights, *smp, rng);
+                        if (options.temporal && frame > 0 && s.valid && similar(s, prev_surfaces[index])) {
+                            auto prev = prev_reservoirs[index];
+                            prev.M = fmin(prev.M, options.temporal_history * r.M);
+                            sources.assign({r, prev});
+                            sources_surface.assign({&s, &prev_surfaces[index]});
+                            r = combine(s, sources, sources_surface, rng);
+                        }
+                        reservoirs[index] = r;
+                    }
+                }
+            }
+
+            // 空间复用与着色
+#pragma omp parallel num_threads(6)
+            {
+                std::vector<reservoir> sources;
+                std::vector<const restir_surface*> sources_surface;
+#pragma omp for collapse(2) schedule(dynamic, 8)
+                for (int j = image_height - 1; j >= 0; j--) {
+                    for (int i = 0; i < image_width; ++i) {
+                        auto index = (image_height - j - 1) * image_width + i;
+                        const auto& s = surfaces[index];
+                        auto r = reservoirs[index];
+                        if (!s.valid) {
+                            framebuffer[index] += emitted[index];
+                            continue;
+                        }
+
+                        uint32_t rng = hash_combine(hash_combine(frame, i), j) ^ 0x5bd1e995;
+                        sources.assign(1, r);
+                        sources_surface.assign(1, &s);
+                        for (int k = 0; k < options.spatial_neighbors; ++k) {
+                            auto offset = options.spatial_radius * sample_uniform_disk_concentric(next(rng), next(rng));
+                            int qi = static_cast<int>(i + offset.x());
+                            int qj = static_cast<int>(j + offset.y());
+                            if (qi < 0 || qi >= image_width || qj < 0 || qj >= image_height || (qi == i && qj == j))
+                                continue;
+                            auto q = (image_height - qj - 1) * image_width + qi;
+                            if (!similar(s, surfaces[q]))
+                                continue;
+                            sources.push_back(reservoirs[q]);
+                            sources_surface.push_back(&surfaces[q]);
+                        }
+                        if (sources.size() > 1)
+                            r = combine(s, sources, sources_surface, rng);
+                        framebuffer[index] += emitted[index] + s.throughput * shade(s, r, world);
+                    }
+                }
+            }
+
+            // 时间复用只保留空间复用之前的结果，避免相邻像素之间的相关性逐帧累积
+            std::swap(surfaces, prev_surfaces);
+            std::swap(reservoirs, prev_reservoirs);
+        }
+
+    private:
+        static double next(uint32_t& rng) {
+            rng = mix_bits(static_cast<uint64_t>(rng) + 0x9e3779b97f4a7c15ULL);
+            return u32_to_unit(rng);
+        }
+
+        // 追踪相机光线直到第一个非镜面顶点，返回沿途直接看到的发光值
+        static color trace_surface(
+                ray r, const environment& env, const hittable& world, int max_depth, sampler& smp,
+                restir_surface& s) {
+            s.valid = false;
+            s.depth = 0;
+            color throughput(1, 1, 1);
+            color radiance(0, 0, 0);
+            for (int depth = 0; depth < max_depth; ++depth) {
+                hit_record rec;
+                if (!world.hit(r, 0.001, infinity, rec))
+                    return radiance + throughput * env.value(r);
+
+                if (rec.mat_ptr->emissive())
+                    radiance += throughput * rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+                s.depth += rec.t * r.direction().length();
+
+                ray scattered;
+                color attenuation;
+                if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered, smp))
+                    return radiance;
+                if (rec.mat_ptr->pdf(r, rec, scattered.direction()) > 0) {
+                    s.valid = true;
+                    s.r = r;
+                    s.rec = rec;
+                    s.throughput = throughput;
+                    return radiance;
+                }
+                throughput = throughput * attenuation;
+                r = scattered;
+            }
+            return radiance;
+        }
+
+        // 目标函数：不考虑遮挡时样本 y 对着色点的贡献(面积测度)，取亮度作为重采样权重
+        static double target(const restir_surface& s, const light_sample& y, color& contribution) {
+            auto direction = y.at_infinity ? y.position : y.position - s.rec.p;
+            auto f = s.rec.mat_ptr->eval(s.r, s.rec, direction);
+            contribution = f * y.emission;
+            if (!y.at_infinity) {
+                auto distance_squared = direction.length_squared();
+                contribution *= fabs(dot(y.normal, direction)) / (distance_squared * sqrt(distance_squared));
+            }
+            return fmax(0.0, luminance(contribution));
+        }
+
+        static double target(const restir_surface& s, const light_sample& y) {
+            color contribution;
+            return target(s, y, contribution);
+        }
+
+        // 在环境光或光源 BVH 上采样一个光源样本，pdf 为其概率密度(光源上为面积测度，环境光为立体角)
+        static light_sample sample_light(
+                const restir_surface& s, const environment& env, const light_bvh& lights, sampler& smp,
+                double& pdf) {
+            light_sample y;
+            pdf = 0;
+            auto p_env = environment_selection_probability(env, lights);
+            auto u = smp.get_1d();
+            auto xi = smp.get_2d();
+            const auto& p = s.rec.p;
+
+            if (u < p_env) {
+                auto direction = unit_vector(env.sample(u / p_env, xi.x(), xi.y()));
+                y.position = direction;
+                y.at_infinity = true;
+                y.emission = env.value(ray(p, direction, s.r.time()));
+                pdf = p_env * env.pdf(direction);
+                return y;
+            }
+
+            u = (u - p_env) / (1 - p_env);
+            double pmf;
+            const auto& light = lights.light(lights.sample(p, u, pmf));
+            auto direction = light->random(p, xi.x(), xi.y());
+            hit_record rec;
+            if (!light->hit(ray(p, direction, s.r.time()), 0.001, infinity, rec))
+                return y;
+
+            y.position = rec.p;
+            y.normal = rec.normal;
+            y.light = light.get();
+            y.emission = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+            // 立体角密度换算到面积测度
+            auto to_light = rec.p - p;
+            auto distance_squared = to_light.length_squared();
+            auto cosine = fabs(dot(rec.normal, to_light)) / sqrt(distance_squared);
+            pdf = (1 - p_env) * pmf * light->pdf_value(p, direction) * cosine / distance_squared;
+            return y;
+        }
+
+        reservoir initial_candidates(
+                const restir_surface& s, const environment& env, const hittable& world, const light_bvh& lights,
+                sampler& smp, uint32_t& rng) const {
+            reservoir r;
+            if (!has_light_sampling(env, lights))
+                return r;
+
+            for (int k = 0; k < options.candidates; ++k) {
+                double pdf;
+                auto y = sample_light(s, env, lights, smp, pdf);
+                r.update(y, pdf > 0 ? target(s, y) / pdf : 0, next(rng));
+            }
+            auto p_hat = target(s, r.y);
+            r.W = p_hat > 0 ? r.w_sum / (r.M * p_hat) : 0;
+            // 可见性复用：被遮挡的样本不再参与后续的复用
+            if (r.W > 0 && !visible(s, r.y, world))
+                r.W = 0;
+            return r;
+        }
+
+        // 把多个蓄水池合并到着色点 s 上，各样本按 s 处的目标函数重新加权。
+        // 重采样权重使用广义 balance heuristic：m_i(y) = M_i p_i(y) / sum_j M_j p_j(y)，
+        // 邻域与 s 的目标函数差异较大时不会产生过大的权重
+        static reservoir combine(
+                const restir_surface& s, const std::vector<reservoir>& sources,
+                const std::vector<const restir_surface*>& sources_surface, uint32_t& rng) {
+            reservoir result;
+            auto M = 0.0;
+            for (size_t i = 0; i < sources.size(); ++i) {
+                const auto& r = sources[i];
+                M += r.M;
+                if (r.W <= 0) {
+                    result.update(r.y, 0, next(rng));
+                    continue;
+                }
+                auto numerator = 0.0;
+                auto denominator = 0.0;
+                for (size_t k = 0; k < sources.size(); ++k) {
+                    auto p = sources[k].M * source_target(*sources_surface[k], r.y);
+                    denominator += p;
+                    if (k == i)
+                        numerator = p;
+                }
+                auto mis = denominator > 0 ? numerator / denominator : 0;
+                result.update(r.y, mis * target(s, r.y) * r.W, next(rng));
+            }
+            result.M = M;
+            auto p_hat = target(s, result.y);
+            result.W = p_hat > 0 ? result.w_sum / p_hat : 0;
+            return result;
+        }
+
+        // 着色点 s 处的目标函数，s 处无法采样到 y(例如单面光源的背面)时为 0
+        static double source_target(const restir_surface& s, const light_sample& y) {
+            auto p_hat = target(s, y);
+            if (p_hat <= 0 || y.at_infinity)
+                return p_hat;
+            hit_record rec;
+            return y.light->hit(ray(s.rec.p, y.position - s.rec.p, s.r.time()), 0.001, 1.001, rec) ? p_hat : 0;
+        }
+
+        static bool similar(const restir_surface& a, const restir_surface& b) {
+            return b.valid
+                   && dot(a.rec.normal, b.rec.normal) > 0.9
+                   && fabs(a.depth - b.depth) < 0.1 * a.depth
+                   && a.rec.mat_ptr == b.rec.mat_ptr;
+        }
+
+        static bool visible(const restir_surface& s, const light_sample& y, const hittable& world) {
+            hit_record rec;
+            if (y.at_infinity)
+                return !world.hit(ray(s.rec.p, y.position, s.r.time()), 0.001, infinity, rec);
+            return !world.hit(ray(s.rec.p, y.position - s.rec.p, s.r.time()), 0.001, 0.999, rec);
+        }
+
+        static color shade(const restir_surface& s, const reservoir& r, const hittable& world) {
+            color contribution;
+            if (r.W <= 0 || target(s, r.y, contribution) <= 0 || !visible(s, r.y, world))
+                return color(0, 0, 0);
+            return contribution * r.W;
+        }
+
+    private:
+        int image_width;
+        int image_height;
+        restir_options options;
+        std::vector<restir_surface> surfaces;
+        std::vector<reservoir> reservoirs;
+        std::vector<restir_surface> prev_surfaces;
+        std::vector<reservoir> prev_reservoirs;
+        std::vector<color> emitted;    // 本帧相机光线路径上直接看到的发光，每个像素在第一遍中重写
+};
+
+#endif //RTWEEKEND_RESTIR_H
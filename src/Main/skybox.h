@@ -9,6 +9,8 @@
 #include "aarect.h"
 #include "hittable_list.h"
 
+#include <array>
+
 
 class sky_box : public hittable  {
 public:
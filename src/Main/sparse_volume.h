@@ -0,0 +1,378 @@
+//
+// Created by Qiuzhe on 2021/7/5.
+//
+
+#ifndef RTWEEKEND_SPARSE_VOLUME_H
+#define RTWEEKEND_SPARSE_VOLUME_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "heterogeneous_medium.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+class sparse_grid {
+    /******************************
+        稀疏体素网格(类似 VDB 的三层结构)：8^3 个体素组成叶子块，16^3 个叶子块组成内部节点(128^3 个体素)，
+        顶层为覆盖整个定义域的内部节点下标数组。只有含非零体素的叶子块分配存储，其余体素为 0，
+        1024^3 的定义域顶层只有 8^3 个下标，内存只与非空的叶子块数量有关。
+        内部节点为每个叶子位置记录三线性插值在其中可能取到的最大值(自身与 26 个相邻叶子块的最大值)，
+        顶层记录各内部节点的最大值，用于分层 DDA 跳过空白区域。
+        文件格式(小端)："SVOL"、int32 版本号 1、int32 nx ny nz、int32 叶子块数，
+        之后每个叶子块为 int32 的叶子坐标 (x/8, y/8, z/8) 与 512 个 float，x 变化最快
+    ******************************/
+    public:
+        static const int leaf_dim = 8; // 叶子块每边的体素数
+        static const int node_dim = 16; // 内部节点每边的叶子块数
+        static const int node_voxels = leaf_dim * node_dim; // 内部节点每边的体素数
+        static const int max_dim = 1 << 16; // 读入文件时允许的每轴最大体素数
+
+        sparse_grid(int nx, int ny, int nz) {
+            dims[0] = nx;
+            dims[1] = ny;
+            dims[2] = nz;
+            for (int k = 0; k < 3; ++k) {
+                leaf_res[k] = (dims[k] + leaf_dim - 1) / leaf_dim;
+                top_res[k] = (dims[k] + node_voxels - 1) / node_voxels;
+            }
+            top.assign(static_cast<size_t>(top_res[0]) * top_res[1] * top_res[2], -1);
+            top_majorants.assign(top.size(), 0.0f);
+        }
+
+        static shared_ptr<sparse_grid> load(const std::string& filename) {
+            std::ifstream in(filename, std::ios::binary);
+            char magic[4];
+            int32_t header[5];
+            if (!in.read(magic, 4) || memcmp(magic, "SVOL", 4) != 0 ||
+                !in.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != 1) {
+                std::cerr << "ERROR: Could not load sparse volume file '" << filename << "'.\n";
+                return nullptr;
+            }
+
+            // 定义域每轴必须为正且不超过 max_dim，叶子块数不能为负
+            for (int k = 1; k <= 3; ++k) {
+                if (header[k] <= 0 || header[k] > max_dim) {
+                    std::cerr << "ERROR: Invalid dimensions in sparse volume file '" << filename << "'.\n";
+                    return nullptr;
+                }
+            }
+            if (header[4] < 0) {
+                std::cerr << "ERROR: Invalid leaf count in sparse volume file '" << filename << "'.\n";
+                return nullptr;
+            }
+
+            auto grid = make_shared<sparse_grid>(header[1], header[2], header[3]);
+            for (int i = 0; i < header[4]; ++i) {
+                int32_t coord[3];
+                leaf_node data;
+                if (!in.read(reinterpret_cast<char*>(coord), sizeof(coord)) ||
+                    !in.read(reinterpret_cast<char*>(data.values), sizeof(data.values))) {
+                    std::cerr << "ERROR: Truncated sparse volume file '" << filename << "'.\n";
+                    return nullptr;
+                }
+                for (int k = 0; k < 3; ++k) {
+                    if (coord[k] < 0 || coord[k] >= grid->leaf_res[k]) {
+                        std::cerr << "ERROR: Leaf outside the grid in sparse volume file '" << filename << "'.\n";
+                        return nullptr;
+                    }
+                }
+                grid->leaves[grid->find_or_add_leaf(coord[0], coord[1], coord[2])] = data;
+            }
+            grid->update_majorants();
+            return grid;
+        }
+
+        bool save(const std::string& filename) const {
+            std::ofstream out(filename, std::ios::binary);
+            int32_t header[5] = {1, dims[0], dims[1], dims[2], static_cast<int32_t>(leaves.size())};
+            out.write("SVOL", 4);
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            for (size_t i = 0; i < leaves.size(); ++i) {
+                out.write(reinterpret_cast<const char*>(leaf_coords[i].c), sizeof(leaf_coords[i].c));
+                out.write(reinterpret_cast<const char*>(leaves[i].values), sizeof(leaves[i].values));
+            }
+            return static_cast<bool>(out);
+        }
+
+        // 写入体素值，0 不会分配新的叶子块；写完后需要调用 update_majorants
+        void set(int x, int y, int z, float value) {
+            if (x < 0 || y < 0 || z < 0 || x >= dims[0] || y >= dims[1] || z >= dims[2])
+                return;
+            int leaf = find_leaf(x / leaf_dim, y / leaf_dim, z / leaf_dim);
+            if (leaf < 0) {
+                if (value == 0)
+                    return;
+                leaf = find_or_add_leaf(x / leaf_dim, y / leaf_dim, z / leaf_dim);
+            }
+            leaves[leaf].values[voxel_offset(x, y, z)] = value;
+        }
+
+        float value(int x, int y, int z) const {
+            if (x < 0 || y < 0 || z < 0 || x >= dims[0] || y >= dims[1] || z >= dims[2])
+                return 0;
+            int leaf = find_leaf(x / leaf_dim, y / leaf_dim, z / leaf_dim);
+            return leaf < 0 ? 0 : leaves[leaf].values[voxel_offset(x, y, z)];
+        }
+
+        // 体素坐标 (体素 i 的中心为 i + 0.5) 上的三线性插值
+        double interpolate(const vec3& g) const {
+            int base[3];
+            double f[3];
+            bool same_leaf = true;
+            for (int k = 0; k < 3; ++k) {
+                auto x = g[k] - 0.5;
+                base[k] = static_cast<int>(floor(x));
+                f[k] = x - base[k];
+                same_leaf = same_leaf && base[k] >= 0 && base[k] + 1 < dims[k] && (base[k] % leaf_dim) != leaf_dim - 1;
+            }
+
+            // 8 个体素通常在同一个叶子块中，只查找一次
+            if (same_leaf) {
+                int leaf = find_leaf(base[0] / leaf_dim, base[1] / leaf_dim, base[2] / leaf_dim);
+                if (leaf < 0)
+                    return 0;
+                const float* v = leaves[leaf].values + voxel_offset(base[0], base[1], base[2]);
+                const int dy = leaf_dim, dz = leaf_dim * leaf_dim;
+                auto x00 = v[0] + f[0] * (v[1] - v[0]);
+                auto x10 = v[dy] + f[0] * (v[dy + 1] - v[dy]);
+                auto x01 = v[dz] + f[0] * (v[dz + 1] - v[dz]);
+                auto x11 = v[dz + dy] + f[0] * (v[dz + dy + 1] - v[dz + dy]);
+                auto y0 = x00 + f[1] * (x10 - x00);
+                auto y1 = x01 + f[1] * (x11 - x01);
+                return y0 + f[2] * (y1 - y0);
+            }
+
+            auto sum = 0.0;
+            for (int corner = 0; corner < 8; ++corner) {
+                auto w = 1.0;
+                int c[3];
+                for (int k = 0; k < 3; ++k) {
+                    int bit = (corner >> k) & 1;
+                    c[k] = base[k] + bit;
+                    w *= bit ? f[k] : 1 - f[k];
+                }
+                if (w > 0)
+                    sum += w * value(c[0], c[1], c[2]);
+            }
+            return sum;
+        }
+
+        // 由叶子块的最大值计算各层的上界
+        void update_majorants() {
+            for (auto& node : internals)
+                std::fill(node.majorant, node.majorant + node_leaves, 0.0f);
+            for (size_t i = 0; i < leaves.size(); ++i) {
+                auto m = *std::max_element(leaves[i].values, leaves[i].values + leaf_voxels);
+                if (m <= 0)
+                    continue;
+                const auto& c = leaf_coords[i].c;
+                for (int dz = -1; dz <= 1; ++dz)
+                    for (int dy = -1; dy <= 1; ++dy)
+                        for (int dx = -1; dx <= 1; ++dx) {
+                            int x = c[0] + dx, y = c[1] + dy, z = c[2] + dz;
+                            if (x < 0 || y < 0 || z < 0 || x >= leaf_res[0] || y >= leaf_res[1] || z >= leaf_res[2])
+                                continue;
+                            auto& slot = internals[find_or_add_node(x, y, z)].majorant[leaf_slot(x, y, z)];
+                            slot = fmax(slot, m);
+                        }
+            }
+            for (size_t i = 0; i < top.size(); ++i)
+                top_majorants[i] = top[i] < 0 ? 0.0f
+                        : *std::max_element(internals[top[i]].majorant, internals[top[i]].majorant + node_leaves);
+        }
+
+        // 分层 DDA：先在顶层逐个访问内部节点，上界为 0 的直接跳过，再在节点内逐个访问叶子位置。
+        // r 为体素坐标中的光线，visit(t_enter, t_exit, majorant) 返回 false 时停止
+        template <typename Visit>
+        void traverse(const ray& r, double t0, double t1, Visit visit) const {
+            const double node_cell[3] = {node_voxels, node_voxels, node_voxels};
+            const double leaf_cell[3] = {leaf_dim, leaf_dim, leaf_dim};
+            const int leaves_per_node[3] = {node_dim, node_dim, node_dim};
+            grid_traverse(r, t0, t1, point3(0, 0, 0), node_cell, top_res, [&](const int n[3], double ta, double tb) {
+                auto index = top_index(n[0], n[1], n[2]);
+                if (top_majorants[index] <= 0)
+                    return true;
+                const auto& node = internals[top[index]];
+                auto origin = point3(n[0], n[1], n[2]) * node_voxels;
+                bool more = true;
+                grid_traverse(r, ta, tb, origin, leaf_cell, leaves_per_node, [&](const int l[3], double la, double lb) {
+                    more = visit(la, lb, node.majorant[(l[2] * node_dim + l[1]) * node_dim + l[0]]);
+                    return more;
+                });
+                return more;
+            });
+        }
+
+        int dim(int k) const {
+            return dims[k];
+        }
+
+        size_t leaf_count() const {
+            return leaves.size();
+        }
+
+        size_t memory() const {
+            return leaves.size() * (sizeof(leaf_node) + sizeof(leaf_coord)) + internals.size() * sizeof(internal_node)
+                   + top.size() * (sizeof(int) + sizeof(float));
+        }
+
+    private:
+        static const int leaf_voxels = leaf_dim * leaf_dim * leaf_dim;
+        static const int node_leaves = node_dim * node_dim * node_dim;
+
+        struct leaf_node {
+            float values[leaf_voxels] = {};
+        };
+
+        struct leaf_coord {
+            int32_t c[3];
+        };
+
+        struct internal_node {
+            int child[node_leaves]; // 叶子块在 leaves 中的下标，-1 表示空
+            float majorant[node_leaves]; // 各叶子位置上插值结果的上界
+        };
+
+        static int voxel_offset(int x, int y, int z) {
+            return ((z % leaf_dim) * leaf_dim + (y % leaf_dim)) * leaf_dim + (x % leaf_dim);
+        }
+
+        // 叶子坐标在所属内部节点中的位置
+        static int leaf_slot(int x, int y, int z) {
+            return ((z % node_dim) * node_dim + (y % node_dim)) * node_dim + (x % node_dim);
+        }
+
+        size_t top_index(int x, int y, int z) const {
+            return (static_cast<size_t>(z) * top_res[1] + y) * top_res[0] + x;
+        }
+
+        int find_leaf(int x, int y, int z) const {
+            int node = top[top_index(x / node_dim, y / node_dim, z / node_dim)];
+            return node < 0 ? -1 : internals[node].child[leaf_slot(x, y, z)];
+        }
+
+        // 叶子坐标所在的内部节点，不存在时分配
+        int find_or_add_node(int x, int y, int z) {
+            auto& node = top[top_index(x / node_dim, y / node_dim, z / node_dim)];
+            if (node < 0) {
+                node = static_cast<int>(internals.size());
+                internals.emplace_back();
+                std::fill(internals.back().child, internals.back().child + node_leaves, -1);
+                std::fill(internals.back().majorant, internals.back().majorant + node_leaves, 0.0f);
+            }
+            return node;
+        }
+
+        int find_or_add_leaf(int x, int y, int z) {
+            auto& child = internals[find_or_add_node(x, y, z)].child[leaf_slot(x, y, z)];
+            if (child < 0) {
+                child = static_cast<int>(leaves.size());
+                leaves.emplace_back();
+                leaf_coords.push_back(leaf_coord{{x, y, z}});
+            }
+            return child;
+        }
+
+    private:
+        int dims[3];
+        int leaf_res[3]; // 各轴的叶子块数
+        int top_res[3]; // 各轴的内部节点数
+        std::vector<int> top; // 内部节点在 internals 中的下标，-1 表示空
+        std::vector<float> top_majorants;
+        std::vector<internal_node> internals;
+        std::vector<leaf_node> leaves;
+        std::vector<leaf_coord> leaf_coords;
+};
+
+
+class sparse_volume : public hittable {
+    /******************************
+        稀疏体素网格表示的参与介质：网格的定义域映射到包围盒 bounds，体素值乘以 scale 为消光系数，散射为各向同性。
+        光线变换到体素坐标后沿网格做分层 DDA，以叶子位置的上界做 delta tracking / ratio tracking，与 heterogeneous_medium 相同
+    ******************************/
+    public:
+        sparse_volume(const aabb& bounds, shared_ptr<sparse_grid> grid, double scale, shared_ptr<texture> albedo)
+            : bounds(bounds), grid(grid), scale(scale), phase_function(make_shared<isotropic>(albedo)) {
+            for (int k = 0; k < 3; ++k)
+                voxel_size[k] = (bounds.max()[k] - bounds.min()[k]) / grid->dim(k);
+        }
+
+        sparse_volume(const aabb& bounds, shared_ptr<sparse_grid> grid, double scale, color albedo)
+            : sparse_volume(bounds, grid, scale, make_shared<solid_color>(albedo)) {}
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            double t0 = t_min, t1 = t_max, t_hit;
+            if (!clip_to_box(bounds, r, t0, t1))
+                return false;
+            auto local = to_voxel(r);
+            auto segments = [&](auto visit) {
+                grid->traverse(local, t0, t1, [&](double a, double b, double majorant) {
+                    return visit(a, b, scale * majorant);
+                });
+            };
+            auto sigma = [this](const point3& p) { return scale * grid->interpolate(to_voxel(p)); };
+            if (!delta_tracking(r, segments, sigma, t_hit))
+                return false;
+            set_medium_record(r, t_hit, phase_function, object_id, rec);
+            return true;
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = bounds;
+            return true;
+        }
+
+        virtual bool hit_surface(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return false;
+        }
+
+        virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+            double t0 = t_min, t1 = t_max;
+            if (!clip_to_box(bounds, r, t0, t1))
+                return 1.0;
+            auto local = to_voxel(r);
+            auto segments = [&](auto visit) {
+                grid->traverse(local, t0, t1, [&](double a, double b, double majorant) {
+                    return visit(a, b, scale * majorant);
+                });
+            };
+            auto sigma = [this](const point3& p) { return scale * grid->interpolate(to_voxel(p)); };
+            return ratio_tracking(r, segments, sigma);
+        }
+
+        virtual bool has_media() const override {
+            return true;
+        }
+
+    private:
+        vec3 to_voxel(const point3& p) const {
+            auto d = p - bounds.min();
+            return vec3(d.x() / voxel_size[0], d.y() / voxel_size[1], d.z() / voxel_size[2]);
+        }
+
+        // 体素坐标中的光线，参数 t 与世界坐标中相同
+        ray to_voxel(const ray& r) const {
+            auto d = r.direction();
+            return ray(to_voxel(r.origin()), vec3(d.x() / voxel_size[0], d.y() / voxel_size[1], d.z() / voxel_size[2]),
+                       r.time());
+        }
+
+    private:
+        aabb bounds;
+        shared_ptr<sparse_grid> grid;
+        double scale;
+        shared_ptr<material> phase_function;
+        double voxel_size[3];
+};
+
+#endif //RTWEEKEND_SPARSE_VOLUME_H
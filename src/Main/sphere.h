@@ -4,6 +4,7 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "material.h"
 
 
 class sphere : public hittable {
@@ -18,11 +19,38 @@ class sphere : public hittable {
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual double pdf_value(const point3& origin, const vec3& v) const override;
+
+        virtual vec3 random(const point3& origin, double u1, double u2) const override;
+
+        virtual double sample_surface(double u1, double u2, hit_record& rec) const override {
+            rec.normal = sample_uniform_sphere(u1, u2);
+            rec.p = center + radius * rec.normal;
+            get_sphere_uv(rec.normal, rec.u, rec.v);
+            rec.mat_ptr = mat_ptr;
+            return 4 * pi * radius * radius;
+        }
+
+        virtual double power() const override {
+            return luminance(mat_ptr->emitted(0.5, 0.5, center)) * 4 * pi * radius * radius;
+        }
+
     public:
         point3 center;
         double radius;
         shared_ptr<material> mat_ptr;
 
+        // 单位球面上 p 点处位置对 get_sphere_uv 的贴图坐标的导数，两极处 dpdv 的方向不确定，两者都取 0
+        static void get_sphere_partials(const point3& p, vec3& dpdu, vec3& dpdv) {
+            auto sin_theta = sqrt(p.x()*p.x() + p.z()*p.z());
+            if (sin_theta < 1e-6) {
+                dpdu = dpdv = vec3(0, 0, 0);
+                return;
+            }
+            dpdu = 2*pi * vec3(p.z(), 0, -p.x());
+            dpdv = pi * vec3(-p.y()*p.x() / sin_theta, sin_theta, -p.y()*p.z() / sin_theta);
+        }
+
     private:
         static void get_sphere_uv(const point3& p, double& u, double& v) {
             // p: a given point on the sphere of radius one, centered at the origin.
@@ -49,6 +77,30 @@ bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
 }
 
 
+double sphere::pdf_value(const point3& origin, const vec3& v) const {
+    hit_record rec;
+    if (!this->hit(ray(origin, v), 0.001, infinity, rec))
+        return 0;
+
+    // 球外按球所张的圆锥均匀采样，球内退化为均匀球面采样
+    auto distance_squared = (center - origin).length_squared();
+    if (distance_squared <= radius*radius)
+        return uniform_sphere_pdf();
+    auto cos_theta_max = sqrt(1 - radius*radius/distance_squared);
+    return uniform_cone_pdf(cos_theta_max);
+}
+
+
+vec3 sphere::random(const point3& origin, double u1, double u2) const {
+    vec3 direction = center - origin;
+    auto distance_squared = direction.length_squared();
+    if (distance_squared <= radius*radius)
+        return sample_uniform_sphere(u1, u2);
+    auto cos_theta_max = sqrt(1 - radius*radius/distance_squared);
+    return local_to_world(unit_vector(direction), sample_uniform_cone(u1, u2, cos_theta_max));
+}
+
+
 bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
@@ -72,7 +124,11 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
+    get_sphere_partials(outward_normal, rec.dpdu, rec.dpdv);
+    rec.dpdu *= radius;
+    rec.dpdv *= radius;
     rec.mat_ptr = mat_ptr;
+    rec.object_id = object_id;
 
     return true;
 }
@@ -144,7 +200,12 @@ bool inner_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec
     vec3 outward_normal = (center - rec.p ) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
+    // 贴图坐标取自 center - p 方向，位置随贴图坐标的变化与外表面相反
+    sphere::get_sphere_partials(outward_normal, rec.dpdu, rec.dpdv);
+    rec.dpdu *= -radius;
+    rec.dpdv *= -radius;
     rec.mat_ptr = mat_ptr;
+    rec.object_id = object_id;
 
     return true;
 }
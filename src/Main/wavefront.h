@@ -0,0 +1,485 @@
+//
+// Created by Qiuzhe on 2021/6/29.
+//
+
+#ifndef RTWEEKEND_WAVEFRONT_H
+#define RTWEEKEND_WAVEFRONT_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "environment.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "light_bvh.h"
+#include "material.h"
+#include "sampler.h"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+
+class wavefront {
+    /******************************
+        波前路径追踪：一次生成 batch_size 条相机光线，按弹射逐层推进。每一层分为四个阶段：
+        1. 求交：所有活动路径的光线与场景求交，未命中的路径计入环境光后结束；
+        2. 排序：命中点按材质类型(同类型内按材质)做计数排序，同一材质的命中点在队列中相邻；
+        3. 着色：排序后的队列按材质切成不超过 shade_chunk 条的段，每段按材质类型标记调用该材质的着色函数；
+           朗博、BRDF、各向同性材质整段用 sample_n 批量生成散射方向，其余材质逐条 scatter，
+           非镜面顶点生成阴影光线放入阴影队列，俄罗斯轮盘赌；
+        4. 阴影：追踪阴影队列，把光源采样的贡献加到对应路径上。
+        存活的路径被压缩进下一层的队列。估计量与 ray_color 相同，每条路径保存采样器维度，
+        各阶段恢复后按相同顺序取样，同一采样器下两种积分器得到的图像一致。
+        reorder_buffer > 0 时，次级光线在求交前按 起点与方向量化后的 Morton 码 排序，每 reorder_buffer 条光线为一组，
+        使相邻处理的光线访问相近的 BVH 节点与三角形。
+    ******************************/
+    public:
+        wavefront(int batch_size = 1 << 16, int reorder_buffer = 0)
+            : batch_size(batch_size), reorder_buffer(reorder_buffer) {}
+
+        // 为每个像素追加第 [first, first + count) 个样本，结果累加到 framebuffer 与 sample_count；
+        // du,dv 为相机光线微分的屏幕坐标间距(与 main.cc 中逐像素渲染相同)，为 0 时不做贴图滤波
+        void render(const camera& cam, const environment& env, const hittable& world, const light_bvh& lights,
+                    int max_depth, const sampler& prototype, int width, int height, int first, int count,
+                    std::vector<color>& framebuffer, std::vector<int>& sample_count, double du = 0, double dv = 0) {
+            const long pixels = static_cast<long>(width) * height;
+            const long total = pixels * count;
+            if (!world.bounding_box(0, 1, scene_box))
+                scene_box = aabb(point3(-1, -1, -1), point3(1, 1, 1));
+            for (long begin = 0; begin < total; begin += batch_size) {
+                int n = static_cast<int>(std::min<long>(batch_size, total - begin));
+                generate(cam, prototype, width, height, first, begin, n, du, dv);
+                for (int depth = 0; depth < max_depth && !queue.empty(); ++depth) {
+                    if (depth > 0 && reorder_buffer > 0)
+                        reorder();
+                    intersect(env, lights, world);
+                    sort_by_material();
+                    shade(env, lights, prototype, depth, depth + 1 >= max_depth);
+                    trace_shadows(env, world);
+                    queue.swap(next_queue);
+                }
+
+                // 同一像素的多个样本可能在同一批内，累加串行进行
+                for (const auto& p : paths) {
+                    framebuffer[p.pixel] += p.radiance;
+                    sample_count[p.pixel] += 1;
+                }
+            }
+        }
+
+        // 输出各阶段的累计耗时
+        void report() const {
+            printf("Wavefront (batch %d, reorder %d) : generate %.3fs, reorder %.3fs, intersect %.3fs, sort %.3fs, "
+                   "shade %.3fs, shadow %.3fs\n", batch_size, reorder_buffer, timing[0], timing[5], timing[1], timing[2],
+                   timing[3], timing[4]);
+        }
+
+    private:
+        struct path_state {
+            ray r;
+            color throughput;
+            color radiance;
+            point3 prev_p;
+            double prev_pdf;  // 上一次 BSDF 采样的 pdf，0 表示镜面或相机光线
+            int pixel;        // framebuffer 下标
+            int px, py;       // 采样器使用的像素坐标(py 从图像底部计)
+            int sample;       // 像素内的样本序号
+            int dimension;    // 采样器已使用的维度数
+        };
+
+        struct shadow_ray {
+            ray r;
+            color weight;     // throughput * BSDF * MIS 权重 / pdf
+            int path;
+        };
+
+        static const int shade_chunk = 64;
+
+        // sorted 中 [begin, end) 的路径命中同一材质
+        struct shade_run {
+            const material* mat;
+            int begin, end;
+        };
+
+        struct shade_context {
+            const environment& env;
+            const light_bvh& lights;
+            bool light_sampling;
+            bool last;
+            int depth;
+        };
+
+        // 批量着色时每个线程的样本值、法线与方向数组(SoA)
+        struct shade_scratch {
+            double u1[shade_chunk], u2[shade_chunk];
+            double nx[shade_chunk], ny[shade_chunk], nz[shade_chunk];
+            double x[shade_chunk], y[shade_chunk], z[shade_chunk];
+            int dimension[shade_chunk];
+        };
+
+        // 批次内第 k 条路径对应样本 first + (begin + k) / pixels，像素 (begin + k) % pixels
+        void generate(const camera& cam, const sampler& prototype, int width, int height, int first, long begin, int n,
+                      double du, double dv) {
+            auto start = omp_get_wtime();
+            const long pixels = static_cast<long>(width) * height;
+            paths.resize(n);
+            hits.resize(n);
+            hit_flags.resize(n);
+            queue.resize(n);
+            camera_samples.resize(7 * static_cast<size_t>(n));
+            camera_rays.resize(n);
+            // 屏幕坐标、镜头与快门时间的样本值，以及 get_rays 的临时数组，各占 n 个元素
+            double* s = camera_samples.data();
+            double* t = s + n;
+            double* lens_u = t + n;
+            double* lens_v = lens_u + n;
+            double* time_u = lens_v + n;
+            double* lens_x = time_u + n;
+            double* lens_y = lens_x + n;
+
+#pragma omp parallel num_threads(6)
+            {
+                auto smp = prototype.clone();
+#pragma omp for schedule(static)
+                for (int k = 0; k < n; ++k) {
+                    auto id = begin + k;
+                    auto& p = paths[k];
+                    p.sample = first + static_cast<int>(id / pixels);
+                    p.pixel = static_cast<int>(id % pixels);
+                    p.px = p.pixel % width;
+                    p.py = height - 1 - p.pixel / width;
+
+                    // 维度的使用顺序与 main.cc 中的逐像素渲染一致：像素抖动、镜头、快门时间
+                    smp->start_pixel_sample(p.px, p.py, p.sample);
+                    auto jitter = smp->get_2d();
+                    auto lens = smp->get_2d();
+                    s[k] = (p.px + jitter.x()) / (width - 1);
+                    t[k] = (p.py + jitter.y()) / (height - 1);
+                    lens_u[k] = lens.x();
+                    lens_v[k] = lens.y();
+                    time_u[k] = smp->get_1d();
+                    p.dimension = smp->current_dimension();
+                    queue[k] = k;
+                }
+            }
+
+            cam.get_rays(n, s, t, lens_u, lens_v, time_u, du, dv, lens_x, lens_y, camera_rays.data());
+            for (int k = 0; k < n; ++k) {
+                auto& p = paths[k];
+                p.r = camera_rays[k];
+                p.throughput = color(1, 1, 1);
+                p.radiance = color(0, 0, 0);
+                p.prev_pdf = 0;
+            }
+            timing[0] += omp_get_wtime() - start;
+        }
+
+        // 次级光线重排：每 reorder_buffer 条光线按 Morton 码排序
+        void reorder() {
+            auto start = omp_get_wtime();
+            const int n = static_cast<int>(queue.size());
+            keys.resize(n);
+#pragma omp parallel for schedule(static) num_threads(6)
+            for (int k = 0; k < n; ++k)
+                keys[k] = std::make_pair(ray_key(paths[queue[k]].r), queue[k]);
+
+            const int groups = (n + reorder_buffer - 1) / reorder_buffer;
+#pragma omp parallel for schedule(dynamic, 1) num_threads(6)
+            for (int g = 0; g < groups; ++g) {
+                auto first = keys.begin() + static_cast<long>(g) * reorder_buffer;
+                auto last = keys.begin() + std::min(n, (g + 1) * reorder_buffer);
+                std::sort(first, last);
+            }
+            for (int k = 0; k < n; ++k)
+                queue[k] = keys[k].second;
+            timing[5] += omp_get_wtime() - start;
+        }
+
+        // 排序键：高 48 位为起点在场景包围盒内量化后的 3 x 16 位 Morton 码，低 16 位为方向八面体映射后的 2 x 8 位 Morton 码
+        uint64_t ray_key(const ray& r) const {
+            auto extent = scene_box.max() - scene_box.min();
+            uint32_t q[3];
+            for (int a = 0; a < 3; ++a) {
+                auto x = extent[a] > 0 ? (r.origin()[a] - scene_box.min()[a]) / extent[a] : 0.0;
+                q[a] = static_cast<uint32_t>(clamp(x, 0.0, 1.0) * 65535.0);
+            }
+            uint64_t origin_code = spread3(q[0]) | (spread3(q[1]) << 1) | (spread3(q[2]) << 2);
+
+            // 八面体映射把单位方向展开到 [-1,1]^2
+            auto d = r.direction() / (fabs(r.direction().x()) + fabs(r.direction().y()) + fabs(r.direction().z()));
+            auto u = d.x(), v = d.y();
+            if (d.z() < 0) {
+                u = (1 - fabs(d.y())) * (d.x() >= 0 ? 1 : -1);
+                v = (1 - fabs(d.x())) * (d.y() >= 0 ? 1 : -1);
+            }
+            auto du = static_cast<uint32_t>(clamp(0.5 * u + 0.5, 0.0, 1.0) * 255.0);
+            auto dv = static_cast<uint32_t>(clamp(0.5 * v + 0.5, 0.0, 1.0) * 255.0);
+            uint64_t direction_code = spread2(du) | (spread2(dv) << 1);
+
+            return (origin_code << 16) | direction_code;
+        }
+
+        // 把 16 位整数的各位间隔两个 0 展开
+        static uint64_t spread3(uint32_t x) {
+            uint64_t v = x & 0xffff;
+            v = (v | (v << 16)) & 0x0000ff0000ffull;
+            v = (v | (v << 8)) & 0x00f00f00f00full;
+            v = (v | (v << 4)) & 0x0c30c30c30c3ull;
+            v = (v | (v << 2)) & 0x249249249249ull;
+            return v;
+        }
+
+        // 把 8 位整数的各位间隔一个 0 展开
+        static uint64_t spread2(uint32_t x) {
+            uint64_t v = x & 0xff;
+            v = (v | (v << 4)) & 0x0f0full;
+            v = (v | (v << 2)) & 0x3333ull;
+            v = (v | (v << 1)) & 0x5555ull;
+            return v;
+        }
+
+        // 阶段 1：求交，未命中的路径计入环境光
+        void intersect(const environment& env, const light_bvh& lights, const hittable& world) {
+            auto start = omp_get_wtime();
+            const int n = static_cast<int>(queue.size());
+#pragma omp parallel for schedule(dynamic, 64) num_threads(6)
+            for (int k = 0; k < n; ++k) {
+                auto& p = paths[queue[k]];
+                hit_flags[queue[k]] = world.hit(p.r, 0.001, infinity, hits[queue[k]]);
+                // 相机光线与镜面链上的光线带有微分，用于贴图滤波
+                if (hit_flags[queue[k]])
+                    hits[queue[k]].compute_differentials(p.r);
+                if (!hit_flags[queue[k]]) {
+                    auto background = env.value(p.r);
+                    if (p.prev_pdf > 0 && env.importance_sampled())
+                        background *= power_heuristic(p.prev_pdf, light_pdf(env, lights, p.prev_p, p.r.direction()));
+                    p.radiance += p.throughput * background;
+                }
+            }
+            timing[1] += omp_get_wtime() - start;
+        }
+
+        // 阶段 2：按 (材质类型, 材质编号) 对命中的路径做计数排序，结果存入 sorted
+        void sort_by_material() {
+            auto start = omp_get_wtime();
+            sorted.clear();
+            materials.clear();
+            for (auto k : queue) {
+                if (!hit_flags[k])
+                    continue;
+                auto id = hits[k].mat_ptr->id;
+                if (id >= static_cast<int>(bucket_of.size()))
+                    bucket_of.resize(id + 1, -1);
+                if (bucket_of[id] < 0) {
+                    bucket_of[id] = static_cast<int>(materials.size());
+                    materials.push_back(hits[k].mat_ptr.get());
+                }
+            }
+
+            // 材质按类型排列，同类型的材质相邻
+            std::vector<int> order(materials.size());
+            for (size_t m = 0; m < order.size(); ++m)
+                order[m] = static_cast<int>(m);
+            std::sort(order.begin(), order.end(), [&](int a, int b) {
+                auto ta = materials[a]->type, tb = materials[b]->type;
+                return ta != tb ? ta < tb : materials[a]->id < materials[b]->id;
+            });
+            std::vector<int> offset(materials.size() + 1, 0);
+            std::vector<int> rank(materials.size());
+            for (size_t r = 0; r < order.size(); ++r)
+                rank[order[r]] = static_cast<int>(r);
+
+            for (auto k : queue)
+                if (hit_flags[k])
+                    offset[rank[bucket_of[hits[k].mat_ptr->id]] + 1] += 1;
+            for (size_t r = 1; r < offset.size(); ++r)
+                offset[r] += offset[r - 1];
+            sorted.resize(offset.back());
+            for (auto k : queue)
+                if (hit_flags[k])
+                    sorted[offset[rank[bucket_of[hits[k].mat_ptr->id]]]++] = k;
+
+            // 此时 offset[r] 为第 r 个材质在 sorted 中的结尾；每个材质的路径切成不超过 shade_chunk 条的段
+            runs.clear();
+            for (size_t r = 0; r < order.size(); ++r) {
+                int begin = r == 0 ? 0 : offset[r - 1];
+                for (int b = begin; b < offset[r]; b += shade_chunk)
+                    runs.push_back(shade_run{materials[order[r]], b, std::min(offset[r], b + shade_chunk)});
+            }
+
+            for (auto m : materials)
+                bucket_of[m->id] = -1;
+            timing[2] += omp_get_wtime() - start;
+        }
+
+        // 阶段 3：着色，生成阴影光线与下一层的光线；last 为最后一次弹射，此时光源采样不做 MIS。
+        // 每一段路径命中同一材质，按材质的类型标记转到该材质的着色函数：
+        // 朗博、BRDF、各向同性材质先取出整段的样本值，用批量版本的映射一次生成散射方向，再逐条完成着色；
+        // 其余材质(镜面、发光)逐条调用，但同一段内不再按类型分发
+        void shade(const environment& env, const light_bvh& lights, const sampler& prototype, int depth, bool last) {
+            auto start = omp_get_wtime();
+            const int n = static_cast<int>(sorted.size());
+            shade_context context{env, lights, has_light_sampling(env, lights), last, depth};
+            alive.assign(n, 0);
+            has_shadow.assign(n, 0);
+            shadows.resize(n);
+
+#pragma omp parallel num_threads(6)
+            {
+                auto smp = prototype.clone();
+                shade_scratch scratch;
+#pragma omp for schedule(dynamic, 1)
+                for (int c = 0; c < static_cast<int>(runs.size()); ++c) {
+                    const auto& run = runs[c];
+                    switch (run.mat->type) {
+                        case material::material_type::lambertian:
+                            shade_batch(static_cast<const lambertian&>(*run.mat), run, context, *smp, scratch);
+                            break;
+                        case material::material_type::BRDF:
+                            shade_batch(static_cast<const BRDF&>(*run.mat), run, context, *smp, scratch);
+                            break;
+                        case material::material_type::isotropic:
+                            shade_batch(static_cast<const isotropic&>(*run.mat), run, context, *smp, scratch);
+                            break;
+                        default:
+                            shade_each(run, context, *smp);
+                            break;
+                    }
+                }
+            }
+
+            // 压缩阴影队列与下一层的路径队列
+            int m = 0;
+            next_queue.clear();
+            for (int k = 0; k < n; ++k) {
+                if (has_shadow[k])
+                    shadows[m++] = shadows[k];
+                if (alive[k])
+                    next_queue.push_back(sorted[k]);
+            }
+            shadows.resize(m);
+            timing[3] += omp_get_wtime() - start;
+        }
+
+        // 逐条着色：计入发光，调用 scatter
+        void shade_each(const shade_run& run, const shade_context& c, sampler& smp) {
+            for (int k = run.begin; k < run.end; ++k) {
+                auto& p = paths[sorted[k]];
+                const auto& rec = hits[sorted[k]];
+                smp.start_pixel_sample(p.px, p.py, p.sample);
+                smp.set_dimension(p.dimension);
+
+                if (rec.mat_ptr->emissive()) {
+                    auto emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p, rec.footprint);
+                    if (p.prev_pdf > 0 && c.light_sampling)
+                        emitted *= power_heuristic(p.prev_pdf, light_pdf(c.env, c.lights, p.prev_p, p.r.direction()));
+                    p.radiance += p.throughput * emitted;
+                }
+
+                ray scattered;
+                color attenuation;
+                if (!rec.mat_ptr->scatter(p.r, rec, attenuation, scattered, smp))
+                    continue;
+                finish_path(k, rec, scattered, attenuation, rec.mat_ptr->pdf(p.r, rec, scattered.direction()), c, smp);
+            }
+        }
+
+        // 批量着色：M 不发光，scatter 只使用一个二维样本，方向由 M::sample_n 成批生成。
+        // 先按路径各自的采样器维度取出样本，生成方向后恢复到取样之后的维度继续，与逐条调用 scatter 取到相同的样本
+        template <typename M>
+        void shade_batch(const M& m, const shade_run& run, const shade_context& c, sampler& smp, shade_scratch& s) {
+            const int n = run.end - run.begin;
+            for (int i = 0; i < n; ++i) {
+                auto& p = paths[sorted[run.begin + i]];
+                const auto& rec = hits[sorted[run.begin + i]];
+                smp.start_pixel_sample(p.px, p.py, p.sample);
+                smp.set_dimension(p.dimension);
+                auto xi = smp.get_2d();
+                s.u1[i] = xi.x();
+                s.u2[i] = xi.y();
+                s.nx[i] = rec.normal.x();
+                s.ny[i] = rec.normal.y();
+                s.nz[i] = rec.normal.z();
+                s.dimension[i] = smp.current_dimension();
+            }
+            M::sample_n(n, s.u1, s.u2, s.nx, s.ny, s.nz, s.x, s.y, s.z);
+            for (int i = 0; i < n; ++i) {
+                int k = run.begin + i;
+                auto& p = paths[sorted[k]];
+                const auto& rec = hits[sorted[k]];
+                smp.start_pixel_sample(p.px, p.py, p.sample);
+                smp.set_dimension(s.dimension[i]);
+                ray scattered;
+                color attenuation;
+                m.scatter_to(p.r, rec, vec3(s.x[i], s.y[i], s.z[i]), attenuation, scattered);
+                finish_path(k, rec, scattered, attenuation, m.pdf(p.r, rec, scattered.direction()), c, smp);
+            }
+        }
+
+        // scatter 之后的部分：光源采样生成阴影光线，更新 throughput，俄罗斯轮盘赌，存活的路径标记到下一层
+        void finish_path(int k, const hit_record& rec, const ray& scattered, const color& attenuation, double pdf,
+                         const shade_context& c, sampler& smp) {
+            auto& p = paths[sorted[k]];
+            p.prev_pdf = pdf;
+            p.prev_p = rec.p;
+            vec3 direction;
+            color weight;
+            if (p.prev_pdf > 0 && c.light_sampling &&
+                sample_light_direction(p.r, rec, c.env, c.lights, smp, direction, weight, nullptr, !c.last)) {
+                shadows[k] = {ray(rec.p, direction, p.r.time()), p.throughput * weight, sorted[k]};
+                has_shadow[k] = 1;
+            }
+
+            p.throughput = p.throughput * attenuation;
+            if (c.depth + 1 >= russian_roulette_depth) {
+                auto survive = fmin(max_component(p.throughput) / russian_roulette_threshold, 1.0);
+                if (smp.get_1d() >= survive) {
+                    p.dimension = smp.current_dimension();
+                    return;
+                }
+                p.throughput /= survive;
+            }
+
+            p.r = scattered;
+            p.dimension = smp.current_dimension();
+            alive[k] = 1;
+        }
+
+        // 阶段 4：追踪阴影光线
+        void trace_shadows(const environment& env, const hittable& world) {
+            auto start = omp_get_wtime();
+            const int n = static_cast<int>(shadows.size());
+#pragma omp parallel for schedule(dynamic, 64) num_threads(6)
+            for (int k = 0; k < n; ++k)
+                paths[shadows[k].path].radiance += shadows[k].weight * shadow_incoming(shadows[k].r, env, world);
+            timing[4] += omp_get_wtime() - start;
+        }
+
+    private:
+        int batch_size;
+        int reorder_buffer;
+        aabb scene_box;
+        std::vector<std::pair<uint64_t, int>> keys;
+        std::vector<path_state> paths;
+        std::vector<hit_record> hits;
+        std::vector<char> hit_flags;
+        std::vector<int> queue;        // 当前层的活动路径
+        std::vector<int> next_queue;   // 下一层的活动路径
+        std::vector<int> sorted;       // 按材质排序后命中物体的路径
+        std::vector<shadow_ray> shadows;
+        std::vector<const material*> materials; // 本层出现的材质
+        std::vector<int> bucket_of;    // 材质编号 -> materials 中的下标
+        std::vector<shade_run> runs;   // 着色的分段，按 sorted 的顺序
+        std::vector<char> alive;       // 着色后 sorted 中第 k 条路径是否进入下一层
+        std::vector<char> has_shadow;  // sorted 中第 k 条路径是否生成了阴影光线
+        std::vector<double> camera_samples; // 生成相机光线的样本值与临时数组，批次之间复用
+        std::vector<ray> camera_rays;
+        double timing[6] = {0, 0, 0, 0, 0, 0}; // 生成、求交、按材质排序、着色、阴影、重排
+};
+
+#endif //RTWEEKEND_WAVEFRONT_H
@@ -13,6 +13,10 @@
 
 #include "rtweekend.h"
 
+#include "sampler.h"
+
+#include <vector>
+
 
 class camera {
     public:
@@ -43,21 +47,97 @@ class camera {
             vertical = focus_dist * viewport_height * v;
             lower_left_corner = origin - horizontal/2 - vertical/2 - focus_dist*w;
 
+            focus_distance = focus_dist;
             lens_radius = aperture / 2;
             time0 = _time0;
             time1 = _time1;
         }
 
-        ray get_ray(double s, double t) const {
-            vec3 rd = lens_radius * random_in_unit_disk();
+        ray get_ray(double s, double t, sampler& smp) const {
+            // 镜头与快门时间各占用采样器的一个维度
+            vec3 lens = smp.get_2d();
+            vec3 rd = lens_radius * sample_uniform_disk_concentric(lens.x(), lens.y());
             vec3 offset = u * rd.x() + v * rd.y();
             return ray(
                 origin + offset,
                 lower_left_corner + s*horizontal + t*vertical - origin - offset,
-                random_double(time0, time1)
+                time0 + (time1 - time0) * smp.get_1d()
             );
         }
 
+        // 带光线微分的相机光线：ds、dt 为屏幕上 x、y 方向相邻一个像素的坐标差，相邻像素的光线与主光线共用镜头上的起点
+        ray get_ray(double s, double t, double ds, double dt, sampler& smp) const {
+            auto r = get_ray(s, t, smp);
+            r.has_differentials = true;
+            r.rx_origin = r.ry_origin = r.origin();
+            r.rx_direction = r.direction() + ds*horizontal;
+            r.ry_direction = r.direction() + dt*vertical;
+            return r;
+        }
+
+        // 批量生成 n 条光线，s,t 为屏幕坐标，lens_u,lens_v,time_u 为每条光线对应的样本值；
+        // ds,dt 与带光线微分的 get_ray 相同，都为 0 时光线不带微分；
+        // dx,dy 为调用者提供的 n 个元素的临时数组，存放镜头上的采样点，调用之间可以复用
+        void get_rays(
+            int n, const double* s, const double* t,
+            const double* lens_u, const double* lens_v, const double* time_u, double ds, double dt,
+            double* dx, double* dy, ray* out
+        ) const {
+            sample_uniform_disk_concentric_n(n, lens_u, lens_v, dx, dy);
+            bool differentials = ds != 0 || dt != 0;
+            for (int i = 0; i < n; ++i) {
+                vec3 offset = lens_radius * (u * dx[i] + v * dy[i]);
+                auto& r = out[i];
+                r = ray(
+                    origin + offset,
+                    lower_left_corner + s[i]*horizontal + t[i]*vertical - origin - offset,
+                    time0 + (time1 - time0) * time_u[i]
+                );
+                if (differentials) {
+                    r.has_differentials = true;
+                    r.rx_origin = r.ry_origin = r.origin();
+                    r.rx_direction = r.direction() + ds*horizontal;
+                    r.ry_direction = r.direction() + dt*vertical;
+                }
+            }
+        }
+
+        // 针孔相机的投影：点 p 在屏幕上的坐标 (s,t)，与 get_ray 的参数一致；p 不在相机前方时返回 false。
+        // 用于从光源一侧的路径连接到相机，不考虑光圈
+        bool project(const point3& p, double& s, double& t) const {
+            vec3 direction = p - origin;
+            auto depth = dot(direction, -w);
+            if (depth <= 0)
+                return false;
+            vec3 film = origin + direction * (focus_distance / depth) - lower_left_corner;
+            s = dot(film, horizontal) / horizontal.length_squared();
+            t = dot(film, vertical) / vertical.length_squared();
+            return true;
+        }
+
+        // 针孔相机中穿过点 p 的 get_ray 的方向(未归一化，终点在对焦平面上)，p 须在相机前方
+        vec3 ray_direction(const point3& p) const {
+            vec3 direction = p - origin;
+            return direction * (focus_distance / dot(direction, -w));
+        }
+
+        point3 position() const {
+            return origin;
+        }
+
+        vec3 forward() const {
+            return -w;
+        }
+
+        // 距相机单位距离处 s,t ∈ [0,1] 对应的成像平面面积
+        double film_area() const {
+            return horizontal.length() * vertical.length() / (focus_distance * focus_distance);
+        }
+
+        bool pinhole() const {
+            return lens_radius <= 0;
+        }
+
     private:
         point3 origin;
         point3 lower_left_corner;
@@ -65,6 +145,7 @@ class camera {
         vec3 vertical;
         vec3 u, v, w;
         double lens_radius;
+        double focus_distance;
         double time0, time1;  // shutter open/close times
 };
 
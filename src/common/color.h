@@ -16,7 +16,11 @@
 #include <iostream>
 
 
-void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
+inline color gamma_correct(color pixel_color, int samples_per_pixel) {
+    // 渐进模式在第一遍完成前停止时有的像素没有样本，输出黑色
+    if (samples_per_pixel <= 0)
+        return color(0, 0, 0);
+
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -28,9 +32,15 @@ void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
 
     // Divide the color by the number of samples and gamma-correct for gamma=2.0.
     auto scale = 1.0 / samples_per_pixel;
-    r = sqrt(scale * r);
-    g = sqrt(scale * g);
-    b = sqrt(scale * b);
+    return color(sqrt(scale * r), sqrt(scale * g), sqrt(scale * b));
+}
+
+
+void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
+    auto pixel = gamma_correct(pixel_color, samples_per_pixel);
+    auto r = pixel.x();
+    auto g = pixel.y();
+    auto b = pixel.z();
 
     // Write the translated [0,255] value of each color component.
     out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
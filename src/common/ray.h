@@ -37,6 +37,12 @@ class ray {
         point3 orig;
         vec3 dir;
         double tm;
+
+        // 光线微分：屏幕上 x、y 方向相邻一个像素的光线，用于估计交点处贴图的滤波范围。
+        // 相机光线与镜面散射的光线带有微分，其余光线 has_differentials 为 false
+        bool has_differentials = false;
+        point3 rx_origin, ry_origin;
+        vec3 rx_direction, ry_direction;
 };
 
 #endif
@@ -57,6 +57,7 @@ inline int random_int(int min, int max) {
 
 #include "ray.h"
 #include "vec3.h"
+#include "sampling.h"
 
 
 #endif
@@ -0,0 +1,308 @@
+//
+// Created by Qiuzhe on 2021/6/20.
+//
+
+#ifndef RTWEEKEND_SAMPLER_H
+#define RTWEEKEND_SAMPLER_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+
+// 整数哈希，用于由像素坐标、维度生成互不相关的种子
+inline uint32_t mix_bits(uint64_t v) {
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= v >> 33;
+    return static_cast<uint32_t>(v);
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return mix_bits((static_cast<uint64_t>(seed) << 32) | v);
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+// [0, 2^32) 的整数映射到 [0,1)
+inline double u32_to_unit(uint32_t x) {
+    return x * (1.0 / 4294967296.0);
+}
+
+// Kensler 的可索引随机置换，返回 [0, n) 上第 i 个元素的置换结果
+inline uint32_t permutation_element(uint32_t i, uint32_t n, uint32_t seed) {
+    uint32_t w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893d;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3f;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+}
+
+// Laine-Karras 置换，对位反转后的整数做哈希即等价于嵌套均匀(Owen)扰动
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// Sobol 序列前两维：第一维为 van der Corput 序列，第二维由方向数递推
+inline uint32_t sobol_dim0(uint32_t index) {
+    return reverse_bits(index);
+}
+
+inline uint32_t sobol_dim1(uint32_t index) {
+    uint32_t v = 1u << 31;
+    uint32_t result = 0;
+    for (; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+    return result;
+}
+
+// 拿不到采样器的代码(介质的自由程与零碰撞判定)使用的随机数流。每个线程一份，
+// 由该线程最近一次 start_pixel_sample / set_dimension 的像素、样本序号与维度重新设定，结果与线程调度无关
+inline uint64_t& sample_stream_state() {
+    thread_local uint64_t state = 0;
+    return state;
+}
+
+inline double sample_stream_random() {
+    auto& state = sample_stream_state();
+    state += 0x9e3779b97f4a7c15ULL;
+    return u32_to_unit(mix_bits(state));
+}
+
+
+class sampler {
+    /******************************
+        采样器基类，为像素、镜头、时间、BSDF、光源等每一个采样维度提供样本值。
+        每个线程持有自己的副本，每个样本开始时调用 start_pixel_sample。
+    ******************************/
+    public:
+        sampler(int spp, uint32_t s = 0) : samples_per_pixel(spp), seed(s) {}
+        virtual ~sampler() {}
+
+        virtual void start_pixel_sample(int px, int py, int index) {
+            pixel_seed = hash_combine(hash_combine(seed, px), py);
+            stream_seed = hash_combine(pixel_seed, index);
+            sample_index = index;
+            dimension = 0;
+            sample_stream_state() = static_cast<uint64_t>(stream_seed) << 32;
+        }
+
+        // 返回 [0,1) 上的一维样本
+        virtual double get_1d() = 0;
+
+        // 返回 [0,1)^2 上的二维样本，存放在 x,y 中
+        virtual vec3 get_2d() = 0;
+
+        virtual shared_ptr<sampler> clone() const = 0;
+
+        // 当前样本已使用的维度数。分阶段处理一条路径时(波前积分器)，在阶段之间保存并恢复
+        int current_dimension() const {
+            return dimension;
+        }
+
+        void set_dimension(int d) {
+            dimension = d;
+            sample_stream_state() = (static_cast<uint64_t>(stream_seed) << 32) | static_cast<uint32_t>(d);
+        }
+
+    public:
+        int samples_per_pixel;
+
+    protected:
+        uint32_t seed;
+        uint32_t pixel_seed = 0;
+        uint32_t stream_seed = 0; // sample_stream_random 的种子，不随子类对 pixel_seed 的修改变化
+        int sample_index = 0;
+        int dimension = 0;
+};
+
+
+class independent_sampler : public sampler {
+    /******************************
+        独立随机采样，即原先 random_double() 的行为
+    ******************************/
+    public:
+        independent_sampler(int spp, uint32_t s = 0) : sampler(spp, s) {}
+
+        virtual double get_1d() override {
+            return random_double();
+        }
+
+        virtual vec3 get_2d() override {
+            return vec3(random_double(), random_double(), 0);
+        }
+
+        virtual shared_ptr<sampler> clone() const override {
+            return make_shared<independent_sampler>(*this);
+        }
+};
+
+
+class stratified_sampler : public sampler {
+    /******************************
+        分层抖动采样，每个维度的分层顺序在像素内随机置换，避免维度间相关
+    ******************************/
+    public:
+        stratified_sampler(int spp, uint32_t s = 0) : sampler(spp, s) {
+            x_strata = std::max(1, static_cast<int>(std::sqrt(static_cast<double>(spp))));
+            y_strata = std::max(1, spp / x_strata);
+        }
+
+        virtual double get_1d() override {
+            uint32_t hash = hash_combine(pixel_seed, dimension++);
+            double jitter = u32_to_unit(mix_bits(hash));
+            if (sample_index >= samples_per_pixel)
+                return jitter;
+            uint32_t stratum = permutation_element(sample_index, samples_per_pixel, hash);
+            return (stratum + jitter) / samples_per_pixel;
+        }
+
+        virtual vec3 get_2d() override {
+            uint32_t hash = hash_combine(pixel_seed, dimension);
+            dimension += 2;
+            double jx = u32_to_unit(mix_bits(hash));
+            double jy = u32_to_unit(mix_bits(hash ^ 0x68bc21eb));
+            int cells = x_strata * y_strata;
+            if (sample_index >= cells)
+                return vec3(jx, jy, 0);
+            uint32_t stratum = permutation_element(sample_index, cells, hash);
+            int x = stratum % x_strata;
+            int y = stratum / x_strata;
+            return vec3((x + jx) / x_strata, (y + jy) / y_strata, 0);
+        }
+
+        virtual shared_ptr<sampler> clone() const override {
+            return make_shared<stratified_sampler>(*this);
+        }
+
+    private:
+        int x_strata, y_strata;
+};
+
+
+class sobol_sampler : public sampler {
+    /******************************
+        Owen 扰动的 Sobol 采样。每对维度使用 Sobol 序列前两维，
+        并对样本序号做独立置换(padding)，保证高维之间不相关。
+    ******************************/
+    public:
+        sobol_sampler(int spp, uint32_t s = 0) : sampler(spp, s) {}
+
+        virtual double get_1d() override {
+            uint32_t hash = hash_combine(pixel_seed, dimension++);
+            uint32_t index = shuffled_index(hash);
+            return u32_to_unit(nested_uniform_scramble(sobol_dim0(index), hash_combine(hash, 0)) + offset(0));
+        }
+
+        virtual vec3 get_2d() override {
+            uint32_t hash = hash_combine(pixel_seed, dimension);
+            dimension += 2;
+            uint32_t index = shuffled_index(hash);
+            uint32_t x = nested_uniform_scramble(sobol_dim0(index), hash_combine(hash, 0)) + offset(0);
+            uint32_t y = nested_uniform_scramble(sobol_dim1(index), hash_combine(hash, 1)) + offset(1);
+            return vec3(u32_to_unit(x), u32_to_unit(y), 0);
+        }
+
+        virtual shared_ptr<sampler> clone() const override {
+            return make_shared<sobol_sampler>(*this);
+        }
+
+    protected:
+        uint32_t shuffled_index(uint32_t hash) const {
+            return nested_uniform_scramble(sample_index, hash);
+        }
+
+        // 子类可以在扰动后的样本上再叠加一个逐像素偏移
+        virtual uint32_t offset(int component) const {
+            return 0;
+        }
+};
+
+
+class blue_noise_sampler : public sobol_sampler {
+    /******************************
+        蓝噪声采样：所有像素共用同一套 Owen 扰动，再按 R2 序列生成的屏幕空间
+        抖动做 Cranley-Patterson 平移，使相邻像素的误差呈高频分布。
+    ******************************/
+    public:
+        blue_noise_sampler(int spp, uint32_t s = 0) : sobol_sampler(spp, s) {}
+
+        virtual void start_pixel_sample(int px, int py, int index) override {
+            sobol_sampler::start_pixel_sample(px, py, index);
+            pixel_seed = seed;
+            double mask = 0.7548776662466927 * px + 0.5698402909980532 * py;
+            shift = static_cast<uint32_t>((mask - std::floor(mask)) * 4294967296.0);
+        }
+
+        virtual shared_ptr<sampler> clone() const override {
+            return make_shared<blue_noise_sampler>(*this);
+        }
+
+    protected:
+        virtual uint32_t offset(int component) const override {
+            // 不同维度使用黄金比例错开的偏移，避免各维度误差同相
+            return shift + static_cast<uint32_t>(dimension + component) * 0x9e3779b9u;
+        }
+
+    private:
+        uint32_t shift = 0;
+};
+
+
+inline shared_ptr<sampler> make_sampler(const std::string& name, int spp, uint32_t seed = 0) {
+    if (name == "random" || name == "independent")
+        return make_shared<independent_sampler>(spp, seed);
+    if (name == "stratified")
+        return make_shared<stratified_sampler>(spp, seed);
+    if (name == "bluenoise")
+        return make_shared<blue_noise_sampler>(spp, seed);
+    if (name != "sobol")
+        std::cerr << "Unknown sampler '" << name << "', using sobol.\n";
+    return make_shared<sobol_sampler>(spp, seed);
+}
+
+#endif //RTWEEKEND_SAMPLER_H
@@ -0,0 +1,286 @@
+//
+// Created by Qiuzhe on 2021/6/21.
+//
+
+#ifndef RTWEEKEND_SAMPLING_H
+#define RTWEEKEND_SAMPLING_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <vector>
+
+
+/******************************
+    采样映射库：把 [0,1)^2 上的样本以解析形式映射到圆盘、球面、半球与圆锥上。
+    每个映射都有对应的 pdf，以及批量版本(_n)：批量版本输入输出均为 SoA 数组，
+    循环体无分支，可以被编译器向量化，用于一次生成大量样本。目前只有相机(get_rays)使用批量版本：
+    材质的 scatter 每次处理一条光线并从采样器逐维取样，使用标量版本，两者的结果相同。
+******************************/
+
+// 同心圆映射(Shirley-Chiu)，保持分层结构，结果位于 z=0 平面
+inline vec3 sample_uniform_disk_concentric(double u1, double u2) {
+    auto a = 2 * u1 - 1;
+    auto b = 2 * u2 - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    double r, phi;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        phi = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        phi = (pi / 2) - (pi / 4) * (a / b);
+    }
+    return vec3(r * cos(phi), r * sin(phi), 0);
+}
+
+// 以 z 轴为法线的余弦加权半球采样
+inline vec3 sample_cosine_hemisphere(double u1, double u2) {
+    auto d = sample_uniform_disk_concentric(u1, u2);
+    auto z = sqrt(fmax(0.0, 1 - d.x() * d.x() - d.y() * d.y()));
+    return vec3(d.x(), d.y(), z);
+}
+
+inline double cosine_hemisphere_pdf(double cos_theta) {
+    return cos_theta > 0 ? cos_theta / pi : 0;
+}
+
+inline vec3 sample_uniform_sphere(double u1, double u2) {
+    auto z = 1 - 2 * u1;
+    auto r = sqrt(fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * u2;
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+inline double uniform_sphere_pdf() {
+    return 1 / (4 * pi);
+}
+
+inline vec3 sample_uniform_hemisphere(double u1, double u2) {
+    auto z = u1;
+    auto r = sqrt(fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * u2;
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+inline double uniform_hemisphere_pdf() {
+    return 1 / (2 * pi);
+}
+
+// 单位球内均匀采样，需要三个样本值
+inline vec3 sample_uniform_ball(double u1, double u2, double u3) {
+    return std::cbrt(u3) * sample_uniform_sphere(u1, u2);
+}
+
+// 以 z 轴为中心、半角余弦为 cos_theta_max 的圆锥内均匀采样
+inline vec3 sample_uniform_cone(double u1, double u2, double cos_theta_max) {
+    auto z = (1 - u1) + u1 * cos_theta_max;
+    auto r = sqrt(fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * u2;
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+inline double uniform_cone_pdf(double cos_theta_max) {
+    return 1 / (2 * pi * (1 - cos_theta_max));
+}
+
+// 三角形上均匀采样，返回重心坐标 (b0, b1, b2)
+inline vec3 sample_uniform_triangle(double u1, double u2) {
+    auto su = sqrt(u1);
+    auto b0 = 1 - su;
+    auto b1 = u2 * su;
+    return vec3(b0, b1, 1 - b0 - b1);
+}
+
+// 由单位法线构造正交基(Duff et al. 2017，无分支)，把局部坐标 (x,y,z) 变换到以 n 为 z 轴的世界坐标
+inline vec3 local_to_world(const vec3& n, const vec3& local) {
+    auto sign = std::copysign(1.0, n.z());
+    auto a = -1.0 / (sign + n.z());
+    auto b = n.x() * n.y() * a;
+    vec3 s(1.0 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+    vec3 t(b, sign + n.y() * n.y() * a, -n.y());
+    return local.x() * s + local.y() * t + local.z() * n;
+}
+
+
+// 旧接口：内部改为解析映射，不再使用拒绝采样
+
+inline vec3 random_in_unit_disk() {
+    return sample_uniform_disk_concentric(random_double(), random_double());
+}
+
+inline vec3 random_unit_vector() {
+    return sample_uniform_sphere(random_double(), random_double());
+}
+
+inline vec3 random_in_unit_sphere() {
+    return sample_uniform_ball(random_double(), random_double(), random_double());
+}
+
+inline vec3 random_in_hemisphere(const vec3& normal) {
+    vec3 on_sphere = random_unit_vector();
+    return dot(on_sphere, normal) > 0.0 ? on_sphere : -on_sphere;
+}
+
+
+// 批量版本
+
+inline void sample_uniform_disk_concentric_n(
+        int n, const double* u1, const double* u2, double* x, double* y) {
+#pragma omp simd
+    for (int i = 0; i < n; ++i) {
+        auto a = 2 * u1[i] - 1;
+        auto b = 2 * u2[i] - 1;
+        bool major_a = fabs(a) > fabs(b);
+        auto r = major_a ? a : b;
+        // 避免除零：原点处 r 为 0，phi 取任意值均可
+        auto ratio = major_a ? b / (a != 0 ? a : 1) : a / (b != 0 ? b : 1);
+        auto phi = major_a ? (pi / 4) * ratio : (pi / 2) - (pi / 4) * ratio;
+        x[i] = r * cos(phi);
+        y[i] = r * sin(phi);
+    }
+}
+
+inline void sample_cosine_hemisphere_n(
+        int n, const double* u1, const double* u2, double* x, double* y, double* z) {
+    sample_uniform_disk_concentric_n(n, u1, u2, x, y);
+#pragma omp simd
+    for (int i = 0; i < n; ++i)
+        z[i] = sqrt(fmax(0.0, 1 - x[i] * x[i] - y[i] * y[i]));
+}
+
+inline void sample_uniform_sphere_n(
+        int n, const double* u1, const double* u2, double* x, double* y, double* z) {
+#pragma omp simd
+    for (int i = 0; i < n; ++i) {
+        auto cz = 1 - 2 * u1[i];
+        auto r = sqrt(fmax(0.0, 1 - cz * cz));
+        auto phi = 2 * pi * u2[i];
+        x[i] = r * cos(phi);
+        y[i] = r * sin(phi);
+        z[i] = cz;
+    }
+}
+
+inline void sample_uniform_hemisphere_n(
+        int n, const double* u1, const double* u2, double* x, double* y, double* z) {
+#pragma omp simd
+    for (int i = 0; i < n; ++i) {
+        auto cz = u1[i];
+        auto r = sqrt(fmax(0.0, 1 - cz * cz));
+        auto phi = 2 * pi * u2[i];
+        x[i] = r * cos(phi);
+        y[i] = r * sin(phi);
+        z[i] = cz;
+    }
+}
+
+inline void sample_uniform_ball_n(
+        int n, const double* u1, const double* u2, const double* u3, double* x, double* y, double* z) {
+    sample_uniform_sphere_n(n, u1, u2, x, y, z);
+#pragma omp simd
+    for (int i = 0; i < n; ++i) {
+        auto radius = std::cbrt(u3[i]);
+        x[i] *= radius;
+        y[i] *= radius;
+        z[i] *= radius;
+    }
+}
+
+inline void sample_uniform_cone_n(
+        int n, const double* u1, const double* u2, double cos_theta_max, double* x, double* y, double* z) {
+#pragma omp simd
+    for (int i = 0; i < n; ++i) {
+        auto cz = (1 - u1[i]) + u1[i] * cos_theta_max;
+        auto r = sqrt(fmax(0.0, 1 - cz * cz));
+        auto phi = 2 * pi * u2[i];
+        x[i] = r * cos(phi);
+        y[i] = r * sin(phi);
+        z[i] = cz;
+    }
+}
+
+// 批量把局部方向变换到各自法线(nx,ny,nz)的世界坐标，结果原地写回
+inline void local_to_world_n(
+        int n, const double* nx, const double* ny, const double* nz, double* x, double* y, double* z) {
+#pragma omp simd
+    for (int i = 0; i < n; ++i) {
+        auto sign = std::copysign(1.0, nz[i]);
+        auto a = -1.0 / (sign + nz[i]);
+        auto b = nx[i] * ny[i] * a;
+        auto lx = x[i], ly = y[i], lz = z[i];
+        x[i] = lx * (1.0 + sign * nx[i] * nx[i] * a) + ly * b + lz * nx[i];
+        y[i] = lx * (sign * b) + ly * (sign + ny[i] * ny[i] * a) + lz * ny[i];
+        z[i] = lx * (-sign * nx[i]) + ly * (-ny[i]) + lz * nz[i];
+    }
+}
+
+
+class alias_table {
+    /******************************
+        Walker/Vose 别名表：O(1) 时间按离散分布抽取下标
+    ******************************/
+    public:
+        alias_table() {}
+
+        alias_table(const std::vector<double>& weights) {
+            auto n = weights.size();
+            auto sum = 0.0;
+            for (auto w : weights)
+                sum += w;
+
+            pmf.resize(n);
+            prob.resize(n);
+            alias.resize(n);
+            std::vector<double> scaled(n);
+            std::vector<int> small, large;
+            for (size_t i = 0; i < n; ++i) {
+                pmf[i] = sum > 0 ? weights[i] / sum : 1.0 / n;
+                scaled[i] = pmf[i] * n;
+                (scaled[i] < 1 ? small : large).push_back(static_cast<int>(i));
+            }
+
+            while (!small.empty() && !large.empty()) {
+                int s = small.back(); small.pop_back();
+                int l = large.back(); large.pop_back();
+                prob[s] = scaled[s];
+                alias[s] = l;
+                scaled[l] = (scaled[l] + scaled[s]) - 1;
+                (scaled[l] < 1 ? small : large).push_back(l);
+            }
+            // 剩余项由于浮点误差应当恰好为 1
+            for (auto i : large) { prob[i] = 1; alias[i] = i; }
+            for (auto i : small) { prob[i] = 1; alias[i] = i; }
+        }
+
+        // 由 [0,1) 上的样本 u 抽取下标，remapped 返回可重复使用的 [0,1) 样本
+        int sample(double u, double& remapped) const {
+            auto n = prob.size();
+            auto scaled = u * n;
+            auto index = std::min(static_cast<size_t>(scaled), n - 1);
+            auto frac = fmin(scaled - index, 0.99999999);
+            if (frac < prob[index]) {
+                remapped = frac / prob[index];
+                return static_cast<int>(index);
+            }
+            remapped = (frac - prob[index]) / (1 - prob[index]);
+            return alias[index];
+        }
+
+        double probability(int index) const {
+            return pmf[index];
+        }
+
+        size_t size() const {
+            return pmf.size();
+        }
+
+    private:
+        std::vector<double> pmf;
+        std::vector<double> prob;
+        std::vector<int> alias;
+};
+
+#endif //RTWEEKEND_SAMPLING_H
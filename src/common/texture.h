@@ -15,20 +15,55 @@
 
 #include "perlin.h"
 #include "rtw_stb_image.h"
+#include "texture_cache.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// 贴图坐标在屏幕上相邻一个像素间的变化量，由光线微分求出；全为 0 时贴图不做滤波
+struct texture_footprint {
+    double dudx = 0, dvdx = 0;
+    double dudy = 0, dvdy = 0;
+
+    bool empty() const {
+        return dudx == 0 && dvdx == 0 && dudy == 0 && dvdy == 0;
+    }
+};
 
 
 class texture  {
     public:
+        // 贴图种类，compiled_texture 按种类把贴图编译为节点；其余种类(other)的贴图编译后仍调用虚函数 value
+        enum class texture_type { other, solid_color, checker, noise, perlin_brdf, image };
+
+        texture() : type(texture_type::other) {}
+        virtual ~texture() {}
+
         virtual color value(double u, double v, const vec3& p) const = 0;
+
+    protected:
+        explicit texture(texture_type type) : type(type) {}
+
+    public:
+        const texture_type type;
 };
 
 
-class solid_color : public texture {
+class solid_color final : public texture {
     public:
-        solid_color() {}
-        solid_color(color c) : color_value(c) {}
+        solid_color() : texture(texture_type::solid_color) {}
+        solid_color(color c) : texture(texture_type::solid_color), color_value(c) {}
 
         solid_color(double red, double green, double blue)
           : solid_color(color(red,green,blue)) {}
@@ -38,39 +73,45 @@ class solid_color : public texture {
         }
 
     private:
+        friend class compiled_texture;
         color color_value;
 };
 
 
-class checker_texture : public texture {
+class checker_texture final : public texture {
     public:
-        checker_texture() {}
+        checker_texture() : texture(texture_type::checker) {}
 
         checker_texture(shared_ptr<texture> _even, shared_ptr<texture> _odd)
-            : even(_even), odd(_odd) {}
+            : texture(texture_type::checker), odd(_odd), even(_even) {}
 
         checker_texture(color c1, color c2)
-            : even(make_shared<solid_color>(c1)) , odd(make_shared<solid_color>(c2)) {}
+            : texture(texture_type::checker), odd(make_shared<solid_color>(c2)), even(make_shared<solid_color>(c1)) {}
 
         virtual color value(double u, double v, const vec3& p) const override {
-//            auto sines = sin(10*p.x())*sin(10*p.y())*sin(10*p.z());
-            int total = std::floor(p.x()/4) + std::floor(p.y()/4) + std::floor(p.z()/4);
-            if (total % 2 == 0)
+            if (odd_cell(p))
                 return odd->value(u, v, p);
             else
                 return even->value(u, v, p);
         }
 
+        // p 所在的格子是否取 odd 贴图
+        static bool odd_cell(const vec3& p) {
+//            auto sines = sin(10*p.x())*sin(10*p.y())*sin(10*p.z());
+            int total = std::floor(p.x()/4) + std::floor(p.y()/4) + std::floor(p.z()/4);
+            return total % 2 == 0;
+        }
+
     public:
         shared_ptr<texture> odd;
         shared_ptr<texture> even;
 };
 
 
-class noise_texture : public texture {
+class noise_texture final : public texture {
     public:
-        noise_texture() {}
-        noise_texture(double sc) : scale(sc) {}
+        noise_texture() : texture(texture_type::noise) {}
+        noise_texture(double sc) : texture(texture_type::noise), scale(sc) {}
 
         virtual color value(double u, double v, const vec3& p) const override {
 //             return color(1,1,1)*0.5*(1 + noise.turb(scale * p));
@@ -84,10 +125,10 @@ class noise_texture : public texture {
         double scale;
 };
 
-class perlin_brdf_texture : public texture {
+class perlin_brdf_texture final : public texture {
 public:
-    perlin_brdf_texture() {}
-    perlin_brdf_texture(double sc) : scale(sc) {}
+    perlin_brdf_texture() : texture(texture_type::perlin_brdf) {}
+    perlin_brdf_texture(double sc) : texture(texture_type::perlin_brdf), scale(sc) {}
 
     virtual color value(double u, double v, const vec3& p) const override {
         // return color(1,1,1)*0.5*(1 + noise.turb(scale * p));
@@ -109,57 +150,532 @@ public:
 };
 
 
-class image_texture : public texture {
+class image_texture final : public texture {
+    /******************************
+        图片贴图。构造时只读取图片的宽高，像素在第一次被访问时才读入：
+        第一次访问时若图片旁没有对应的分块文件(filename.tex，sRGB 为 filename.srgb.tex)或图片更新过，
+        先解码图片、建立 mip 金字塔并写出分块文件，之后按页(32x32 个像素)经 texture_cache 从文件读入，
+        常驻内存的页数受缓存容量限制，没有被访问的区域与层级不占内存。
+        mip 金字塔每层的宽高减半(不小于 1)，每个像素为上一层 2x2 个像素的平均。
+        value 在第 0 层取最近的像素；filtered 按贴图坐标在屏幕上的变化范围选择层级：
+        以较短的轴决定层级，在相邻两层之间做三线性插值，沿较长的轴取至多 max_anisotropy 个样本平均(简化的各向异性滤波)。
+        页内按 4x4 个像素一块存储，每个像素 RGBA8(A 不使用)，一块正好是一个 64 字节的缓存行，
+        双线性插值的 2x2 个像素与上下相邻的查找大多落在同一个缓存行中。
+        像素值经 256 项的查找表转为浮点：srgb 为 true 时按 sRGB 曲线解码为线性值，否则为 value/255；
+        sRGB 贴图在线性空间中求平均建立 mip 层级
+    ******************************/
     public:
         const static int bytes_per_pixel = 3;
+        const static int max_anisotropy = 8;
 
-        image_texture()
-          : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
-
-        image_texture(const char* filename) {
-            auto components_per_pixel = bytes_per_pixel;
-
-            data = stbi_load(
-                filename, &width, &height, &components_per_pixel, components_per_pixel);
+        image_texture() : texture(texture_type::image), decode(decode_table(false)) {}
 
-            if (!data) {
+        image_texture(const char* filename, bool srgb = false)
+            : texture(texture_type::image), filename(filename), srgb(srgb), decode(decode_table(srgb)),
+              cache(&texture_cache::global()), id(cache->register_texture()) {
+            int width, height, components;
+            if (!stbi_info(filename, &width, &height, &components)) {
                 std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
-                width = height = 0;
+                return;
             }
 
-            bytes_per_scanline = bytes_per_pixel * width;
+            uint32_t pages = 0;
+            for (;;) {
+                mip_level level{width, height, (width + texture_page::size - 1) >> texture_page::shift, pages};
+                pages += level.pages_x * ((height + texture_page::size - 1) >> texture_page::shift);
+                levels.push_back(level);
+                if (width == 1 && height == 1)
+                    break;
+                width = std::max(width / 2, 1);
+                height = std::max(height / 2, 1);
+            }
+            page_count = pages;
         }
 
-        ~image_texture() {
-            STBI_FREE(data);
+        image_texture(const image_texture&) = delete;
+        image_texture& operator=(const image_texture&) = delete;
+
+        virtual ~image_texture() {
+            if (fd >= 0)
+                close(fd);
+            if (cache)
+                cache->release(id);
         }
 
         virtual color value(double u, double v, const vec3& p) const override {
             // If we have no texture data, then return solid cyan as a debugging aid.
-            if (data == nullptr)
+            if (levels.empty())
                 return color(0,1,1);
+            const auto& level = levels[0];
 
             // Clamp input texture coordinates to [0,1] x [1,0]
             u = clamp(u, 0.0, 1.0);
             v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
 
-            auto i = static_cast<int>(u * width);
-            auto j = static_cast<int>(v * height);
+            auto i = static_cast<int>(u * level.width);
+            auto j = static_cast<int>(v * level.height);
 
             // Clamp integer mapping, since actual coordinates should be less than 1.0
-            if (i >= width)  i = width-1;
-            if (j >= height) j = height-1;
+            if (i >= level.width)  i = level.width-1;
+            if (j >= level.height) j = level.height-1;
+
+            return texel(page(0, i, j), i, j);
+        }
 
-            const auto color_scale = 1.0 / 255.0;
-            auto pixel = data + j*bytes_per_scanline + i*bytes_per_pixel;
+        // footprint 为空(光线没有微分)时与 value 相同
+        color filtered(double u, double v, const texture_footprint& footprint) const {
+            if (levels.empty() || footprint.empty())
+                return value(u, v, point3());
+            const auto& base = levels[0];
+
+            // 屏幕上 x、y 方向的变化范围换算到第 0 层的像素，较长的作为长轴
+            double major_u = footprint.dudx, major_v = footprint.dvdx;
+            double minor_u = footprint.dudy, minor_v = footprint.dvdy;
+            auto major = sqrt(sqr(major_u * base.width) + sqr(major_v * base.height));
+            auto minor = sqrt(sqr(minor_u * base.width) + sqr(minor_v * base.height));
+            if (major < minor) {
+                std::swap(major_u, minor_u);
+                std::swap(major_v, minor_v);
+                std::swap(major, minor);
+            }
+            if (major <= 0)
+                return value(u, v, point3());
+
+            // 长短轴之比超过 max_anisotropy 时放大短轴，以一定的模糊换取有限的样本数
+            minor = fmax(minor, major / max_anisotropy);
+            auto lod = std::log2(minor);
+            int n = std::min(static_cast<int>(ceil(major / minor - 1e-6)), max_anisotropy);
+            if (n <= 1)
+                return trilinear(u, v, lod);
+
+            color sum(0, 0, 0);
+            for (int k = 0; k < n; ++k) {
+                auto offset = (k + 0.5) / n - 0.5;
+                sum += trilinear(u + offset * major_u, v + offset * major_v, lod);
+            }
+            return sum / n;
+        }
+
+        int width() const {
+            return levels.empty() ? 0 : levels[0].width;
+        }
+
+        int height() const {
+            return levels.empty() ? 0 : levels[0].height;
+        }
+
+        int level_count() const {
+            return static_cast<int>(levels.size());
+        }
+
+        // 所有层级的页全部读入时占用的字节数
+        size_t memory() const {
+            return static_cast<size_t>(page_count) * sizeof(texture_page);
+        }
+
+    private:
+        static const int file_version = 1;
+        static const off_t page_bytes = sizeof(texture_page);
+
+        // 分块文件的开头，之后从 page_bytes 处起按层级依次存放各页
+        struct file_header {
+            char magic[4];
+            int32_t version, width, height, srgb, levels;
+        };
+
+        struct mip_level {
+            int width, height;
+            int pages_x;         // 每行的页数，宽高不是 32 的倍数时最后一页用边界像素补齐
+            uint32_t first_page; // 本层第一页在文件中的序号
+        };
+
+        static double sqr(double x) {
+            return x * x;
+        }
+
+        // 8 位像素值到浮点的查找表
+        static const double* decode_table(bool srgb) {
+            struct tables {
+                double linear[256], srgb[256];
+                tables() {
+                    for (int i = 0; i < 256; ++i) {
+                        linear[i] = i * (1.0 / 255.0);
+                        auto c = i / 255.0;
+                        srgb[i] = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+                    }
+                }
+            };
+            static const tables t;
+            return srgb ? t.srgb : t.linear;
+        }
+
+        static unsigned char encode_srgb(double c) {
+            c = c <= 0.0031308 ? 12.92 * c : 1.055 * pow(c, 1 / 2.4) - 0.055;
+            return static_cast<unsigned char>(clamp(c * 255 + 0.5, 0.0, 255.0));
+        }
+
+        std::string tiled_filename() const {
+            return filename + (srgb ? ".srgb.tex" : ".tex");
+        }
 
-            return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+        // 第一次读页时打开分块文件，多个线程同时读页时只有一个线程打开，其余等待
+        int open_tiled() const {
+            std::call_once(opened, [this] {
+                fd = open_existing();
+                if (fd < 0)
+                    fd = write_tiled();
+            });
+            return fd;
+        }
+
+        // 分块文件存在、比图片新且与图片的宽高、层级一致时打开它，否则返回 -1
+        int open_existing() const {
+            auto path = tiled_filename();
+            struct stat image_stat, tiled_stat;
+            if (stat(filename.c_str(), &image_stat) != 0 || stat(path.c_str(), &tiled_stat) != 0 ||
+                tiled_stat.st_mtime < image_stat.st_mtime ||
+                tiled_stat.st_size != page_bytes * (1 + static_cast<off_t>(page_count)))
+                return -1;
+
+            int file = open(path.c_str(), O_RDONLY);
+            if (file < 0)
+                return -1;
+            file_header header;
+            if (pread(file, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, "TTEX", 4) != 0 ||
+                header.version != file_version || header.width != levels[0].width ||
+                header.height != levels[0].height || header.srgb != srgb || header.levels != level_count()) {
+                close(file);
+                return -1;
+            }
+            return file;
+        }
+
+        // 解码图片并写出分块文件；先写临时文件再改名，多个进程同时渲染时不会读到写了一半的文件。
+        // 图片所在的目录不可写时写到匿名的临时文件中，只在本次运行中使用
+        int write_tiled() const {
+            auto components_per_pixel = bytes_per_pixel;
+            int width, height;
+            auto data = stbi_load(filename.c_str(), &width, &height, &components_per_pixel, components_per_pixel);
+            if (!data) {
+                std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
+                return -1;
+            }
+            std::vector<unsigned char> pixels(data, data + width*height*bytes_per_pixel);
+            STBI_FREE(data);
+
+            auto path = tiled_filename();
+            // 临时文件名包含进程号与贴图编号：同一进程中读入同一图片的多个贴图各写各的临时文件，改名是原子的
+            auto temporary = path + "." + std::to_string(getpid()) + "." + std::to_string(id);
+            FILE* file = fopen(temporary.c_str(), "wb");
+            bool named = file != nullptr;
+            if (!named)
+                file = tmpfile();
+            if (!file) {
+                std::cerr << "ERROR: Could not write tiled texture file '" << path << "'.\n";
+                return -1;
+            }
+
+            std::vector<unsigned char> first(page_bytes, 0);
+            file_header header{{'T', 'T', 'E', 'X'}, file_version, width, height, srgb, level_count()};
+            memcpy(first.data(), &header, sizeof(header));
+            bool ok = fwrite(first.data(), 1, first.size(), file) == first.size();
+            build_mipmaps(width, height, std::move(pixels), [&](int level_width, int level_height,
+                                                                const std::vector<unsigned char>& level_pixels) {
+                ok = ok && write_pages(file, level_width, level_height, level_pixels);
+            });
+            ok = fflush(file) == 0 && ok;
+
+            if (!named) {
+                // 匿名临时文件在关闭 FILE 时删除，复制一个描述符供读页使用
+                int copy = ok ? dup(fileno(file)) : -1;
+                fclose(file);
+                return copy;
+            }
+            ok = fclose(file) == 0 && ok && rename(temporary.c_str(), path.c_str()) == 0;
+            if (!ok) {
+                std::cerr << "ERROR: Could not write tiled texture file '" << path << "'.\n";
+                remove(temporary.c_str());
+                return -1;
+            }
+            return open(path.c_str(), O_RDONLY);
+        }
+
+        // pixels 为按行存储的 RGB8，逐层减半，每得到一层调用一次 emit(width, height, pixels)
+        template<typename F>
+        void build_mipmaps(int width, int height, std::vector<unsigned char> pixels, F emit) const {
+            for (;;) {
+                emit(width, height, pixels);
+                if (width == 1 && height == 1)
+                    break;
+
+                int coarse_width = std::max(width / 2, 1), coarse_height = std::max(height / 2, 1);
+                std::vector<unsigned char> coarse(coarse_width * coarse_height * bytes_per_pixel);
+                for (int j = 0; j < coarse_height; ++j) {
+                    int j0 = std::min(2*j, height-1), j1 = std::min(2*j+1, height-1);
+                    for (int i = 0; i < coarse_width; ++i) {
+                        int i0 = std::min(2*i, width-1), i1 = std::min(2*i+1, width-1);
+                        for (int c = 0; c < bytes_per_pixel; ++c) {
+                            auto at = [&](int x, int y) { return pixels[(y*width + x)*bytes_per_pixel + c]; };
+                            auto& out = coarse[(j*coarse_width + i)*bytes_per_pixel + c];
+                            if (srgb)
+                                out = encode_srgb(0.25 * (decode[at(i0, j0)] + decode[at(i1, j0)] +
+                                                          decode[at(i0, j1)] + decode[at(i1, j1)]));
+                            else
+                                out = static_cast<unsigned char>(
+                                    (at(i0, j0) + at(i1, j0) + at(i0, j1) + at(i1, j1) + 2) / 4);
+                        }
+                    }
+                }
+                pixels.swap(coarse);
+                width = coarse_width;
+                height = coarse_height;
+            }
+        }
+
+        // 按页写出一层，页按行排列
+        static bool write_pages(FILE* file, int width, int height, const std::vector<unsigned char>& pixels) {
+            int pages_x = (width + texture_page::size - 1) >> texture_page::shift;
+            int pages_y = (height + texture_page::size - 1) >> texture_page::shift;
+            texture_page page;
+            for (int py = 0; py < pages_y; ++py) {
+                for (int px = 0; px < pages_x; ++px) {
+                    for (int y = 0; y < texture_page::size; ++y) {
+                        for (int x = 0; x < texture_page::size; ++x) {
+                            int i = std::min(px * texture_page::size + x, width - 1);
+                            int j = std::min(py * texture_page::size + y, height - 1);
+                            auto out = page.rgba + texture_page::offset(x, y);
+                            for (int c = 0; c < bytes_per_pixel; ++c)
+                                out[c] = pixels[(j*width + i)*bytes_per_pixel + c];
+                            out[3] = 255;
+                        }
+                    }
+                    if (fwrite(page.rgba, 1, sizeof(page.rgba), file) != sizeof(page.rgba))
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        // texture_cache 未命中时调用
+        static bool load_page(const void* owner, uint64_t key, texture_page& page) {
+            auto self = static_cast<const image_texture*>(owner);
+            int file = self->open_tiled();
+            if (file < 0)
+                return false;
+            const auto& level = self->levels[(key >> 32) & 0xff];
+            auto offset = page_bytes * (1 + static_cast<off_t>(level.first_page) + static_cast<uint32_t>(key));
+            size_t done = 0;
+            while (done < sizeof(page.rgba)) {
+                auto n = pread(file, page.rgba + done, sizeof(page.rgba) - done, offset + done);
+                if (n <= 0)
+                    return false;
+                done += n;
+            }
+            return true;
+        }
+
+        // 第 l 层包含像素 (i, j) 的页，读入失败时为 nullptr；指针只在本线程下一次查找之前有效
+        const texture_page* page(int l, int i, int j) const {
+            const auto& level = levels[l];
+            uint32_t index = (j >> texture_page::shift) * level.pages_x + (i >> texture_page::shift);
+            return cache->lookup(texture_cache::page_key(id, l, index), this, load_page);
+        }
+
+        color texel(const texture_page* page, int i, int j) const {
+            if (!page)
+                return color(0,1,1);
+            auto pixel = page->texel(i, j);
+            return color(decode[pixel[0]], decode[pixel[1]], decode[pixel[2]]);
+        }
+
+        // 第 l 层的双线性插值，以像素中心为格点，超出边界的坐标取边界像素
+        color bilinear(int l, double u, double v) const {
+            const auto& level = levels[l];
+            auto x = clamp(u, 0.0, 1.0) * level.width - 0.5;
+            auto y = (1.0 - clamp(v, 0.0, 1.0)) * level.height - 0.5;
+            auto x0 = static_cast<int>(floor(x));
+            auto y0 = static_cast<int>(floor(y));
+            auto fx = x - x0, fy = y - y0;
+            int i0 = std::max(x0, 0), i1 = std::min(x0 + 1, level.width - 1);
+            int j0 = std::max(y0, 0), j1 = std::min(y0 + 1, level.height - 1);
+
+            // 4 个像素大多在同一页中，只查一次缓存。页的指针只在本线程下一次查找之前有效
+            // (线程表的表项被替换时，已被全局表淘汰的页随之释放)，每次查找后立即读出这一页中的像素
+            const int ci[4] = {i0, i1, i0, i1}, cj[4] = {j0, j0, j1, j1};
+            color c[4];
+            bool done[4] = {false, false, false, false};
+            for (int k = 0; k < 4; ++k) {
+                if (done[k])
+                    continue;
+                auto p = page(l, ci[k], cj[k]);
+                for (int m = k; m < 4; ++m) {
+                    if (!done[m] && (ci[m] >> texture_page::shift) == (ci[k] >> texture_page::shift) &&
+                        (cj[m] >> texture_page::shift) == (cj[k] >> texture_page::shift)) {
+                        c[m] = texel(p, ci[m], cj[m]);
+                        done[m] = true;
+                    }
+                }
+            }
+            return (1 - fy) * ((1 - fx) * c[0] + fx * c[1]) + fy * ((1 - fx) * c[2] + fx * c[3]);
+        }
+
+        // 在 lod 两侧的层级之间线性插值
+        color trilinear(double u, double v, double lod) const {
+            if (lod <= 0)
+                return bilinear(0, u, v);
+            int last = static_cast<int>(levels.size()) - 1;
+            if (lod >= last)
+                return bilinear(last, u, v);
+            int l = static_cast<int>(lod);
+            auto f = lod - l;
+            return (1 - f) * bilinear(l, u, v) + f * bilinear(l + 1, u, v);
+        }
+
+    private:
+        std::string filename;
+        bool srgb = false;
+        const double* decode; // 像素值到浮点的查找表
+        texture_cache* cache = nullptr;
+        uint32_t id = 0;      // 在 cache 中的编号
+        std::vector<mip_level> levels;
+        uint32_t page_count = 0;
+        mutable std::once_flag opened;
+        mutable int fd = -1;  // 分块文件
+};
+
+
+class compiled_texture {
+    /******************************
+        编译后的贴图：构建场景时把贴图图展开为一个扁平的节点数组，子节点用下标引用，同一个子贴图只编译一次。
+        value 是不含虚函数调用的解释器：棋盘格节点只选择下一个节点的下标，叶子节点按种类直接调用具体贴图的实现。
+        纯色贴图在编译时折叠为常量，两个子节点都是常量的棋盘格把两种颜色存在节点内(颜色相同时同样折叠为常量)；
+        整张贴图为常量时不保留节点，value 直接返回保存的颜色，lambertian(color) 之类的材质不做任何贴图查找
+    ******************************/
+    public:
+        compiled_texture() : constant_value(0, 0, 0) {}
+        compiled_texture(const color& c) : constant_value(c) {}
+
+        compiled_texture(shared_ptr<texture> t) : constant_value(0, 0, 0) {
+            if (!t)
+                return;
+            std::unordered_map<const texture*, int> compiled;
+            root = compile(t.get(), compiled);
+            if (nodes[root].op == texture_op::constant) {
+                constant_value = nodes[root].value[0];
+                nodes.clear();
+                return;
+            }
+            source = t;
+        }
+
+        bool constant() const {
+            return nodes.empty();
+        }
+
+        // footprint 只用于图片贴图的滤波
+        color value(double u, double v, const vec3& p, const texture_footprint& footprint = texture_footprint()) const {
+            if (nodes.empty())
+                return constant_value;
+            return interpret(u, v, p, footprint);
+        }
+
+        size_t size() const {
+            return nodes.size();
+        }
+
+    private:
+        enum class texture_op { constant, checker, constant_checker, noise, perlin_brdf, image, other };
+
+        struct texture_node {
+            texture_op op;
+            color value[2];            // constant 节点的颜色，constant_checker 节点 even、odd 格子的颜色
+            int children[2] = {0, 0};  // checker 节点的 even、odd 子节点
+            const texture* leaf = nullptr; // 叶子节点对应的贴图
+        };
+
+        color interpret(double u, double v, const vec3& p, const texture_footprint& footprint) const {
+            int i = root;
+            for (;;) {
+                const auto& n = nodes[i];
+                if (n.op == texture_op::constant)
+                    return n.value[0];
+                switch (n.op) {
+                    case texture_op::checker:
+                        i = n.children[checker_texture::odd_cell(p) ? 1 : 0];
+                        break;
+                    case texture_op::constant_checker:
+                        return n.value[checker_texture::odd_cell(p) ? 1 : 0];
+                    case texture_op::noise:
+                        return static_cast<const noise_texture*>(n.leaf)->value(u, v, p);
+                    case texture_op::perlin_brdf:
+                        return static_cast<const perlin_brdf_texture*>(n.leaf)->value(u, v, p);
+                    case texture_op::image:
+                        return static_cast<const image_texture*>(n.leaf)->filtered(u, v, footprint);
+                    default:
+                        return n.leaf->value(u, v, p);
+                }
+            }
+        }
+
+        static bool same_color(const color& a, const color& b) {
+            return a.x() == b.x() && a.y() == b.y() && a.z() == b.z();
+        }
+
+        // 后序编译，返回节点下标
+        int compile(const texture* t, std::unordered_map<const texture*, int>& compiled) {
+            auto found = compiled.find(t);
+            if (found != compiled.end())
+                return found->second;
+
+            texture_node n;
+            switch (t->type) {
+                case texture::texture_type::solid_color:
+                    n.op = texture_op::constant;
+                    n.value[0] = static_cast<const solid_color*>(t)->color_value;
+                    break;
+                case texture::texture_type::checker: {
+                    auto checker = static_cast<const checker_texture*>(t);
+                    int even = compile(checker->even.get(), compiled);
+                    int odd = compile(checker->odd.get(), compiled);
+                    if (nodes[even].op == texture_op::constant && nodes[odd].op == texture_op::constant) {
+                        // 两种颜色都是常量时直接存在节点内，颜色相同时整个节点折叠为常量
+                        n.op = same_color(nodes[even].value[0], nodes[odd].value[0]) ? texture_op::constant
+                                                                                      : texture_op::constant_checker;
+                        n.value[0] = nodes[even].value[0];
+                        n.value[1] = nodes[odd].value[0];
+                    } else {
+                        n.op = texture_op::checker;
+                        n.children[0] = even;
+                        n.children[1] = odd;
+                    }
+                    break;
+                }
+                case texture::texture_type::noise:
+                    n.op = texture_op::noise;
+                    n.leaf = t;
+                    break;
+                case texture::texture_type::perlin_brdf:
+                    n.op = texture_op::perlin_brdf;
+                    n.leaf = t;
+                    break;
+                case texture::texture_type::image:
+                    n.op = texture_op::image;
+                    n.leaf = t;
+                    break;
+                default:
+                    n.op = texture_op::other;
+                    n.leaf = t;
+                    break;
+            }
+            nodes.push_back(n);
+            return compiled[t] = static_cast<int>(nodes.size()) - 1;
         }
 
     private:
-        unsigned char *data;
-        int width, height;
-        int bytes_per_scanline;
+        color constant_value;
+        std::vector<texture_node> nodes;
+        int root = 0;
+        shared_ptr<texture> source; // 保证叶子节点引用的贴图在编译后仍然有效
 };
 
 
@@ -0,0 +1,238 @@
+//
+// Created by Qiuzhe on 2021/7/6.
+//
+
+#ifndef RTWEEKEND_TEXTURE_CACHE_H
+#define RTWEEKEND_TEXTURE_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+// 贴图缓存的一页：32x32 个像素，按 4x4 个像素(一个 64 字节的缓存行)一块存储，块按行排列，每个像素 RGBA8
+struct alignas(64) texture_page {
+    static const int shift = 5;
+    static const int size = 1 << shift;
+    static const int bytes = size * size * 4;
+
+    unsigned char rgba[bytes];
+
+    // 坐标 (i, j) 的像素在页内的字节偏移，只用坐标的低 shift 位
+    static int offset(int i, int j) {
+        int tile = ((j & (size - 1)) >> 2) * (size / 4) + ((i & (size - 1)) >> 2);
+        return 4 * (tile * 16 + ((j & 3) << 2) + (i & 3));
+    }
+
+    const unsigned char* texel(int i, int j) const {
+        return rgba + offset(i, j);
+    }
+};
+
+
+class texture_cache {
+    /******************************
+        所有图片贴图共享的页缓存：页在第一次访问时从贴图的分块文件中读入，总内存超过 capacity 时按 LRU 淘汰。
+        每个线程先查自己的直接映射表(local_slots 项)，命中时不加锁、没有原子操作；未命中时在互斥锁下查全局表，
+        全局表也没有时在锁外读入该页。页读入后不再修改，线程表与全局表通过 shared_ptr 共享，
+        被全局表淘汰的页在各线程的表项被替换之后释放，内存最多超出 线程数 * local_slots 页。
+        线程表的命中不经过全局表，每个表项命中 touch_interval 次后加锁刷新一次该页在 LRU 中的位置
+        (已被淘汰时重新放回全局表)，常用的页不会因为只在线程表中命中而被最先淘汰
+    ******************************/
+    public:
+        // load(owner, key, page) 把 key 对应的页读入 page，owner 为注册该页的贴图
+        using loader = bool (*)(const void* owner, uint64_t key, texture_page& page);
+
+        static const int local_slots_shift = 9;
+        static const int local_slots = 1 << local_slots_shift;
+        static const uint32_t touch_interval = 256;
+
+        struct statistics {
+            uint64_t local_hits = 0;  // 线程表命中
+            uint64_t shared_hits = 0; // 全局表命中
+            uint64_t misses = 0;      // 从文件读入的页数
+            uint64_t evictions = 0;
+        };
+
+        // 所有贴图使用的缓存
+        static texture_cache& global() {
+            static texture_cache cache;
+            return cache;
+        }
+
+        void set_capacity(size_t bytes) {
+            std::lock_guard<std::mutex> lock(mutex);
+            capacity = bytes;
+            evict();
+        }
+
+        size_t capacity_bytes() const {
+            return capacity;
+        }
+
+        // 每张贴图的编号，构成页的 key 的高位
+        uint32_t register_texture() {
+            return next_texture.fetch_add(1);
+        }
+
+        // 贴图析构时丢弃它在全局表中的页，线程表中的页在表项被替换时释放
+        void release(uint32_t texture) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = lru.begin(); it != lru.end();) {
+                if ((*it >> 40) == texture) {
+                    pages.erase(*it);
+                    it = lru.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        // key = (贴图编号 << 40) | (层级 << 32) | 页序号
+        static uint64_t page_key(uint32_t texture, int level, uint32_t index) {
+            return (static_cast<uint64_t>(texture) << 40) | (static_cast<uint64_t>(level) << 32) | index;
+        }
+
+        // 返回的指针由本线程表的表项持有，只在本线程下一次 lookup 之前有效：
+        // 下一次查找可能替换同一表项，全局表已淘汰的页随之释放，调用者不能同时持有两次查找的结果
+        const texture_page* lookup(uint64_t key, const void* owner, loader load) {
+            auto& local = local_state();
+            auto& slot = local.slots[(key * 0x9E3779B97F4A7C15ULL) >> (64 - local_slots_shift)];
+            if (slot.key == key) {
+                local.stats.local_hits += 1;
+                if (++slot.hits >= touch_interval) {
+                    slot.hits = 0;
+                    touch(key, slot.page);
+                }
+                return slot.page.get();
+            }
+            slot.page = fetch(key, owner, load, local.stats);
+            slot.key = slot.page ? key : 0;
+            slot.hits = 0;
+            return slot.page.get();
+        }
+
+        // 各线程统计之和，在渲染结束后读取
+        statistics stats() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            statistics total;
+            for (const auto* s : thread_stats) {
+                total.local_hits += s->local_hits;
+                total.shared_hits += s->shared_hits;
+                total.misses += s->misses;
+            }
+            total.evictions = evictions;
+            return total;
+        }
+
+        size_t resident_bytes() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return pages.size() * sizeof(texture_page);
+        }
+
+        size_t peak_bytes() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return peak;
+        }
+
+    private:
+        struct local_slot {
+            uint64_t key = 0;
+            uint32_t hits = 0; // 上次刷新全局 LRU 之后的命中次数
+            std::shared_ptr<const texture_page> page;
+        };
+
+        struct thread_state {
+            local_slot slots[local_slots];
+            statistics stats;
+        };
+
+        struct entry {
+            std::shared_ptr<const texture_page> page;
+            std::list<uint64_t>::iterator position; // 在 lru 中的位置
+        };
+
+        texture_cache() = default;
+
+        thread_state& local_state() {
+            thread_local thread_state* state = nullptr;
+            if (!state) {
+                // 线程状态在程序结束前不释放，统计可以在线程结束后读取
+                state = new thread_state();
+                std::lock_guard<std::mutex> lock(mutex);
+                thread_stats.push_back(&state->stats);
+            }
+            return *state;
+        }
+
+        std::shared_ptr<const texture_page> fetch(uint64_t key, const void* owner, loader load, statistics& stats) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (auto page = find(key)) {
+                    stats.shared_hits += 1;
+                    return page;
+                }
+            }
+
+            // 读入时不持有锁，其它线程的查找与读入可以同时进行；两个线程同时读入同一页时保留先插入的
+            auto page = std::make_shared<texture_page>();
+            if (!load(owner, key, *page))
+                return nullptr;
+            stats.misses += 1;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (auto existing = find(key))
+                return existing;
+            lru.push_front(key);
+            pages.emplace(key, entry{page, lru.begin()});
+            evict();
+            peak = std::max(peak, pages.size() * sizeof(texture_page));
+            return page;
+        }
+
+        // 线程表中常用的页移到 lru 的最前面，已被淘汰时重新放回全局表
+        void touch(uint64_t key, const std::shared_ptr<const texture_page>& page) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (find(key))
+                return;
+            lru.push_front(key);
+            pages.emplace(key, entry{page, lru.begin()});
+            evict();
+            peak = std::max(peak, pages.size() * sizeof(texture_page));
+        }
+
+        // 在全局表中查找并移到 lru 的最前面，调用时须持有锁
+        std::shared_ptr<const texture_page> find(uint64_t key) {
+            auto found = pages.find(key);
+            if (found == pages.end())
+                return nullptr;
+            lru.splice(lru.begin(), lru, found->second.position);
+            return found->second.page;
+        }
+
+        // 淘汰最久未使用的页直到不超过容量，至少保留刚读入的一页
+        void evict() {
+            while (pages.size() > 1 && pages.size() * sizeof(texture_page) > capacity) {
+                pages.erase(lru.back());
+                lru.pop_back();
+                evictions += 1;
+            }
+        }
+
+    private:
+        mutable std::mutex mutex;
+        size_t capacity = static_cast<size_t>(512) << 20;
+        std::unordered_map<uint64_t, entry> pages;
+        std::list<uint64_t> lru; // 最近使用的在前
+        size_t peak = 0;
+        uint64_t evictions = 0;
+        std::vector<const statistics*> thread_stats;
+        std::atomic<uint32_t> next_texture{1};
+};
+
+#endif //RTWEEKEND_TEXTURE_CACHE_H
@@ -131,36 +131,18 @@ inline vec3 normalize(const vec3 &v){
     return v;
 }
 
-inline vec3 unit_vector(vec3 v) {
-    return v / v.length();
-}
-
-inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
+// 颜色的亮度(Rec.709 系数)
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
 }
 
-inline vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1,1);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
-}
-
-inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+// 逐分量截断到 [min, max]
+inline vec3 clamp(const vec3& v, double min, double max) {
+    return vec3(fmin(fmax(v.x(), min), max), fmin(fmax(v.y(), min), max), fmin(fmax(v.z(), min), max));
 }
 
-inline vec3 random_in_hemisphere(const vec3& normal) {
-    vec3 in_unit_sphere = random_in_unit_sphere();
-    if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
-        return in_unit_sphere;
-    else
-        return -in_unit_sphere;
+inline vec3 unit_vector(vec3 v) {
+    return v / v.length();
 }
 
 inline vec3 reflect(const vec3& v, const vec3& n) {